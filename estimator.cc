@@ -0,0 +1,206 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "estimator.h"
+
+namespace cmpt740 {
+
+    SelectivityEstimator::SelectivityEstimator(uint32_t min[DIMENSION],
+					       uint32_t max[DIMENSION],
+					       int cells)
+    {
+	int ncells = 1;
+	this->cells = (cells > 0) ? cells : 1;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    space.min[i] = min[i];
+	    space.max[i] = max[i];
+	    extent_sum[i] = 0;
+	    extent_max[i] = 0;
+	    ncells *= this->cells;
+	}
+	counts = new int64_t[ncells];
+	memset(counts, 0, sizeof(int64_t) * ncells);
+	total = 0;
+	pthread_rwlock_init(&shape_lock, NULL);
+    }
+
+    SelectivityEstimator::~SelectivityEstimator()
+    {
+	pthread_rwlock_destroy(&shape_lock);
+	delete[] counts;
+    }
+
+    int SelectivityEstimator::CellOf(uint64_t value, int dim)
+    {
+	uint64_t width = (uint64_t)space.max[dim] - space.min[dim] + 1;
+	if (value <= space.min[dim])
+	    return 0;
+	if (value >= space.max[dim])
+	    return cells - 1;
+	return (int)((value - space.min[dim]) * cells / width);
+    }
+
+    int SelectivityEstimator::CellIndex(Rtree::RtreeRect* rect)
+    {
+	int index = 0;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    uint64_t center = ((uint64_t)rect->min[i] + rect->max[i]) / 2;
+	    index = index * cells + CellOf(center, i);
+	}
+	return index;
+    }
+
+    // Counters are bumped atomically; no lock is taken on the write path.
+    void SelectivityEstimator::Update(Rtree::RtreeRect* rect, int delta)
+    {
+	__sync_add_and_fetch(&counts[CellIndex(rect)], delta);
+	__sync_add_and_fetch(&total, delta);
+	for (int i = 0; i < DIMENSION; ++i) {
+	    __sync_add_and_fetch(&extent_sum[i],
+				 delta * (int64_t)(rect->max[i] - rect->min[i]));
+	}
+    }
+
+    // The largest extent is never lowered on Remove, which keeps
+    // records_high a bound at the price of a looser one.
+    void SelectivityEstimator::Add(Rtree::RtreeRect* rect)
+    {
+	Update(rect, 1);
+	for (int i = 0; i < DIMENSION; ++i) {
+	    uint64_t extent = rect->max[i] - rect->min[i];
+	    uint64_t seen = extent_max[i];
+	    while (extent > seen &&
+		   !__sync_bool_compare_and_swap(&extent_max[i], seen, extent))
+		seen = extent_max[i];
+	}
+    }
+
+    void SelectivityEstimator::Remove(Rtree::RtreeRect* rect)
+    {
+	Update(rect, -1);
+    }
+
+    void SelectivityEstimator::Refresh(Rtree* rtree, int budget)
+    {
+	std::vector<Rtree::LevelShape> sampled;
+	rtree->Shape(sampled, budget);
+	pthread_rwlock_wrlock(&shape_lock);
+	shape.swap(sampled);
+	pthread_rwlock_unlock(&shape_lock);
+    }
+
+    // A record overlaps the window iff its center lies in the window grown
+    // by half the record's extent; the average extent stands in for it.
+    // Partly covered cells contribute in proportion to the covered part,
+    // which assumes centers are uniform inside a cell. The bounds need no
+    // such guess: records_high counts every cell the window grown by half
+    // the largest extent touches, records_low only the cells inside the
+    // window itself, as a record centered in the window overlaps it.
+    // Nodes follow the usual per-level model: a level of n nodes of
+    // average extent e is hit n * prod((e + q) / D) times for a window of
+    // extent q in a space of extent D.
+    SelectivityEstimator::Estimate
+    SelectivityEstimator::EstimateQuery(uint32_t min[DIMENSION],
+					uint32_t max[DIMENSION])
+    {
+	Estimate est;
+	int64_t n = (total > 0) ? total : 0;
+	int first[DIMENSION], last[DIMENSION];
+	std::vector<double> fraction[DIMENSION];
+	std::vector<bool> inside[DIMENSION];
+
+	for (int i = 0; i < DIMENSION; ++i) {
+	    uint64_t half = (n > 0) ? extent_sum[i] / n / 2 : 0;
+	    uint64_t lo = (min[i] > half) ? min[i] - half : 0;
+	    uint64_t hi = (uint64_t)max[i] + half;
+	    uint64_t reach = (extent_max[i] + 1) / 2;
+	    uint64_t width = (uint64_t)space.max[i] - space.min[i] + 1;
+	    first[i] = CellOf((min[i] > reach) ? min[i] - reach : 0, i);
+	    last[i] = CellOf((uint64_t)max[i] + reach, i);
+	    for (int c = first[i]; c <= last[i]; ++c) {
+		uint64_t cmin = space.min[i] + width * c / cells;
+		uint64_t cmax = space.min[i] + width * (c + 1) / cells - 1;
+		// border cells also hold everything beyond the space
+		if (c == 0)
+		    cmin = 0;
+		if (c == cells - 1)
+		    cmax = UINT32_MAX;
+		uint64_t olo = std::max(lo, cmin);
+		uint64_t ohi = std::min(hi, cmax);
+		double f = (ohi >= olo) ?
+		    (double)(ohi - olo + 1) / (double)(cmax - cmin + 1) : 0.0;
+		fraction[i].push_back(f);
+		inside[i].push_back(cmin >= min[i] && cmax <= max[i]);
+	    }
+	}
+
+	est.records = est.records_low = est.records_high = 0;
+	int at[DIMENSION];
+	for (int i = 0; i < DIMENSION; ++i) {
+	    at[i] = first[i];
+	}
+	while (true) {
+	    int index = 0;
+	    double f = 1.0;
+	    bool whole = true;
+	    for (int i = 0; i < DIMENSION; ++i) {
+		index = index * cells + at[i];
+		f *= fraction[i][at[i] - first[i]];
+		whole = whole && inside[i][at[i] - first[i]];
+	    }
+	    double count = (double)std::max(counts[index], (int64_t)0);
+	    est.records += count * f;
+	    est.records_high += count;
+	    if (whole)
+		est.records_low += count;
+
+	    int i = DIMENSION - 1;
+	    while (i >= 0 && at[i] == last[i]) {
+		at[i] = first[i];
+		--i;
+	    }
+	    if (i < 0)
+		break;
+	    ++at[i];
+	}
+
+	est.nodes = 0;
+	pthread_rwlock_rdlock(&shape_lock);
+	if (!shape.empty()) {
+	    Rtree::LevelShape* top = &shape[0];
+	    for (size_t l = 0; l < shape.size(); ++l) {
+		double p = 1.0;
+		for (int i = 0; i < DIMENSION; ++i) {
+		    double q = (double)max[i] - min[i] + 1;
+		    p *= std::min(1.0, (shape[l].extent[i] + q) /
+				  (top->extent[i] + 1));
+		}
+		est.nodes += shape[l].nodes * p;
+	    }
+	}
+	pthread_rwlock_unlock(&shape_lock);
+	return est;
+    }
+}
@@ -0,0 +1,74 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#ifndef _ESTIMATOR_H_
+#define _ESTIMATOR_H_
+
+#include <vector>
+#include <pthread.h>
+#include "rtree.h"
+
+namespace cmpt740 {
+
+    // Spatial histogram of record centers kept up to date by Rtree::Insert
+    // and Rtree::Delete, plus a sampled shape of the tree, used to guess
+    // the cost of a window query without running it.
+    class SelectivityEstimator {
+    public:
+	struct Estimate {
+	    double records;      // expected number of overlapping records
+	    double records_low;  // bounds on records, as far as the
+	    double records_high; // histogram is up to date
+	    double nodes;        // expected number of nodes visited
+	};
+
+	// space: the region covered by the histogram, cut into cells slices
+	// along every dimension. Centers outside it land in border cells.
+	SelectivityEstimator(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+			     int cells);
+	virtual ~SelectivityEstimator();
+	void Add(Rtree::RtreeRect* rect);
+	void Remove(Rtree::RtreeRect* rect);
+	// Resample the shape of the tree used for node estimates, looking at
+	// no more than budget nodes per level.
+	void Refresh(Rtree* rtree, int budget = 256);
+	Estimate EstimateQuery(uint32_t min[DIMENSION], uint32_t max[DIMENSION]);
+	int64_t Total() { return total; }
+
+    protected:
+	int CellOf(uint64_t value, int dim);
+	int CellIndex(Rtree::RtreeRect* rect);
+	void Update(Rtree::RtreeRect* rect, int delta);
+
+    private:
+	Rtree::RtreeRect space;
+	int cells;
+	int64_t* counts;                 // one counter per cell
+	int64_t total;
+	int64_t extent_sum[DIMENSION];   // for the average record extent
+	uint64_t extent_max[DIMENSION];  // largest extent ever added
+	std::vector<Rtree::LevelShape> shape;
+	pthread_rwlock_t shape_lock;
+    };
+}
+
+#endif
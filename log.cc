@@ -0,0 +1,464 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+
+// Messages each thread can have waiting for the flusher, power of two
+#define LOG_RING_SIZE 256
+// Room for the text of a message, or its format arguments in binary
+#define LOG_MESSAGE_SIZE 472
+
+namespace {
+
+    struct LogMessage {
+	const char* prefix;
+	const char* file;
+	const char* func;
+	const char* fmt;   // set for binary messages only
+	int line;
+	int length;        // bytes used in data
+	char data[LOG_MESSAGE_SIZE];
+    };
+
+    // Single producer (the owning thread), single consumer (the
+    // flusher). head and tail only grow; slot i is data[i % size].
+    struct LogRing {
+	LogMessage messages[LOG_RING_SIZE];
+	volatile uint64_t head;
+	volatile uint64_t tail;
+	volatile unsigned long dropped;
+	unsigned long reported; // drops already reported by the flusher
+	volatile int retired;   // the owner has exited, see RetireRing
+	LogRing* volatile next;
+    };
+
+    // Rings are added at the head of the list under log_lock; only the
+    // flusher removes them, also under log_lock, so it walks the list
+    // without it.
+    LogRing* volatile log_rings = NULL;
+    __thread LogRing* log_ring = NULL;
+    volatile int log_binary = 0;
+    pthread_once_t log_once = PTHREAD_ONCE_INIT;
+    pthread_key_t log_key; // retires the ring of an exiting thread
+    pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;    // flusher
+    pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER; // LogFlush
+    volatile int log_sleeping = 0;   // the flusher waits on log_wake
+    int log_waiters = 0;             // threads in LogFlush
+    uint64_t log_passes = 0;         // DrainRings passes completed
+    unsigned long log_retired_dropped = 0; // drops of freed rings
+
+    // Kinds of argument a conversion takes, see ParseConversion
+    enum ArgKind { ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_DOUBLE,
+		   ARG_LDOUBLE, ARG_STRING, ARG_POINTER };
+
+    // Parse the conversion starting after a '%'. Returns a pointer past
+    // it, fills in its kind and whether width/precision are '*'.
+    const char* ParseConversion(const char* p, ArgKind* kind,
+				bool* star_width, bool* star_prec)
+    {
+	int longs = 0;
+	bool ldouble = false;
+	*star_width = *star_prec = false;
+	while (*p && strchr("-+ #0", *p))
+	    ++p;
+	if (*p == '*') {
+	    *star_width = true;
+	    ++p;
+	}
+	while (*p >= '0' && *p <= '9')
+	    ++p;
+	if (*p == '.') {
+	    ++p;
+	    if (*p == '*') {
+		*star_prec = true;
+		++p;
+	    }
+	    while (*p >= '0' && *p <= '9')
+		++p;
+	}
+	while (*p && strchr("hlLqjzt", *p)) {
+	    if (*p == 'l' || *p == 'q')
+		++longs;
+	    else if (*p == 'j')
+		longs = 2;
+	    else if (*p == 'z' || *p == 't')
+		longs = 1;
+	    else if (*p == 'L')
+		ldouble = true;
+	    ++p;
+	}
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+	    *kind = (longs >= 2) ? ARG_LLONG : (longs == 1) ? ARG_LONG
+		: ARG_INT;
+	    break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+	case 'a': case 'A':
+	    *kind = ldouble ? ARG_LDOUBLE : ARG_DOUBLE;
+	    break;
+	case 's':
+	    *kind = ARG_STRING;
+	    break;
+	case 'p': case 'n':
+	    *kind = ARG_POINTER;
+	    break;
+	default: // "%%" or something unknown
+	    *kind = ARG_NONE;
+	    break;
+	}
+	return (*p) ? p + 1 : p;
+    }
+
+    // Copy the arguments fmt takes into data. False if they do not fit.
+    bool EncodeArgs(LogMessage* msg, const char* fmt, va_list ap)
+    {
+	char* out = msg->data;
+	char* end = msg->data + LOG_MESSAGE_SIZE;
+	for (const char* p = fmt; *p; ) {
+	    if (*p++ != '%')
+		continue;
+	    ArgKind kind;
+	    bool star_width, star_prec;
+	    p = ParseConversion(p, &kind, &star_width, &star_prec);
+	    for (int n = star_width + star_prec; n > 0; --n) {
+		int v = va_arg(ap, int);
+		if (out + sizeof(v) > end)
+		    return false;
+		memcpy(out, &v, sizeof(v));
+		out += sizeof(v);
+	    }
+	    switch (kind) {
+#define ENCODE(type, fetch)					\
+		{							\
+		    type v = (type)va_arg(ap, fetch);			\
+		    if (out + sizeof(v) > end)				\
+			return false;					\
+		    memcpy(out, &v, sizeof(v));				\
+		    out += sizeof(v);					\
+		    break;						\
+		}
+	    case ARG_INT: ENCODE(int, int)
+	    case ARG_LONG: ENCODE(long, long)
+	    case ARG_LLONG: ENCODE(long long, long long)
+	    case ARG_DOUBLE: ENCODE(double, double)
+	    case ARG_LDOUBLE: ENCODE(long double, long double)
+	    case ARG_POINTER: ENCODE(void*, void*)
+#undef ENCODE
+	    case ARG_STRING: {
+		const char* s = va_arg(ap, const char*);
+		if (s == NULL)
+		    s = "(null)";
+		size_t len = strlen(s) + 1;
+		if (out + len > end)
+		    return false;
+		memcpy(out, s, len);
+		out += len;
+		break;
+	    }
+	    case ARG_NONE:
+		break;
+	    }
+	}
+	msg->length = out - msg->data;
+	return true;
+    }
+
+    // Format one conversion spec[0..len) with the value at *in
+    size_t FormatOne(FILE* fp, const char* spec, size_t len, ArgKind kind,
+		     bool star_width, bool star_prec, const char** in)
+    {
+	char conv[32];
+	if (len >= sizeof(conv))
+	    len = sizeof(conv) - 1;
+	memcpy(conv, spec, len);
+	conv[len] = '\0';
+	int stars[2] = { 0, 0 };
+	int nstars = star_width + star_prec;
+	for (int i = 0; i < nstars; ++i) {
+	    memcpy(&stars[i], *in, sizeof(int));
+	    *in += sizeof(int);
+	}
+	switch (kind) {
+#define DECODE(type)							\
+	    {								\
+		type v;							\
+		memcpy(&v, *in, sizeof(v));				\
+		*in += sizeof(v);					\
+		if (nstars == 2)					\
+		    return fprintf(fp, conv, stars[0], stars[1], v);	\
+		if (nstars == 1)					\
+		    return fprintf(fp, conv, stars[0], v);		\
+		return fprintf(fp, conv, v);				\
+	    }
+	case ARG_INT: DECODE(int)
+	case ARG_LONG: DECODE(long)
+	case ARG_LLONG: DECODE(long long)
+	case ARG_DOUBLE: DECODE(double)
+	case ARG_LDOUBLE: DECODE(long double)
+	case ARG_POINTER: DECODE(void*)
+#undef DECODE
+	case ARG_STRING: {
+	    const char* v = *in;
+	    *in += strlen(v) + 1;
+	    if (nstars == 2)
+		return fprintf(fp, conv, stars[0], stars[1], v);
+	    if (nstars == 1)
+		return fprintf(fp, conv, stars[0], v);
+	    return fprintf(fp, conv, v);
+	}
+	case ARG_NONE:
+	    break;
+	}
+	return fprintf(fp, "%s", conv[1] == '%' ? "%" : conv);
+    }
+
+    void WriteMessage(FILE* fp, LogMessage* msg)
+    {
+	fprintf(fp, "%s|%s:%d:%s|", msg->prefix, msg->file, msg->line,
+		msg->func);
+	if (msg->fmt == NULL) {
+	    fwrite(msg->data, 1, msg->length, fp);
+	    return;
+	}
+	const char* in = msg->data;
+	const char* p = msg->fmt;
+	while (*p) {
+	    const char* pct = strchr(p, '%');
+	    if (pct == NULL) {
+		fputs(p, fp);
+		break;
+	    }
+	    fwrite(p, 1, pct - p, fp);
+	    ArgKind kind;
+	    bool star_width, star_prec;
+	    p = ParseConversion(pct + 1, &kind, &star_width, &star_prec);
+	    FormatOne(fp, pct, p - pct, kind, star_width, star_prec, &in);
+	}
+    }
+
+    // Drain every ring once, and free the rings of exited threads once
+    // they are drained. Returns the number of messages written.
+    int DrainRings()
+    {
+	int written = 0;
+	LogRing* volatile* link = &log_rings;
+	while (*link != NULL) {
+	    LogRing* ring = *link;
+	    int retired = ring->retired;
+	    __sync_synchronize(); // nothing is logged to it after retired
+	    uint64_t head = ring->head;
+	    __sync_synchronize(); // messages before head, see __LogWrite
+	    for (uint64_t i = ring->tail; i < head; ++i) {
+		WriteMessage(PPNFS_OUTPUT_FD,
+			     &ring->messages[i & (LOG_RING_SIZE - 1)]);
+		++written;
+	    }
+	    __sync_synchronize(); // done reading before the slots are reused
+	    ring->tail = head;
+	    unsigned long dropped = ring->dropped;
+	    if (dropped != ring->reported) {
+		fprintf(PPNFS_OUTPUT_FD, "WRN|log: %lu messages dropped\n",
+			dropped - ring->reported);
+		ring->reported = dropped;
+		++written;
+	    }
+	    if (!retired) {
+		link = &ring->next;
+		continue;
+	    }
+	    // A ring added meanwhile may now point at it
+	    pthread_mutex_lock(&log_lock);
+	    while (*link != ring)
+		link = &(*link)->next;
+	    *link = ring->next;
+	    log_retired_dropped += dropped;
+	    pthread_mutex_unlock(&log_lock);
+	    delete ring;
+	}
+	if (written > 0)
+	    fflush(PPNFS_OUTPUT_FD);
+	return written;
+    }
+
+    bool RingsPending()
+    {
+	for (LogRing* ring = log_rings; ring != NULL; ring = ring->next) {
+	    if (ring->head != ring->tail || ring->retired ||
+		ring->dropped != ring->reported)
+		return true;
+	}
+	return false;
+    }
+
+    // Drain until every ring is empty, then sleep on log_wake until a
+    // writer finds log_sleeping set, or LogFlush asks for a pass.
+    void* FlusherRoutine(void*)
+    {
+	while (true) {
+	    int written = DrainRings();
+	    pthread_mutex_lock(&log_lock);
+	    ++log_passes;
+	    pthread_cond_broadcast(&log_drained);
+	    if (written == 0 && log_waiters == 0) {
+		log_sleeping = 1;
+		__sync_synchronize(); // log_sleeping before the heads
+		if (!RingsPending())
+		    pthread_cond_wait(&log_wake, &log_lock);
+		log_sleeping = 0;
+	    }
+	    pthread_mutex_unlock(&log_lock);
+	}
+	return NULL;
+    }
+
+    void AtExit()
+    {
+	LogFlush();
+    }
+
+    // Runs as a thread exits. A message logged later, by another key's
+    // destructor, goes to a new ring.
+    void RetireRing(void* arg)
+    {
+	LogRing* ring = (LogRing*)arg;
+	log_ring = NULL;
+	__sync_synchronize(); // the last message before retired
+	ring->retired = 1;
+	if (log_sleeping) {
+	    pthread_mutex_lock(&log_lock);
+	    pthread_cond_signal(&log_wake);
+	    pthread_mutex_unlock(&log_lock);
+	}
+    }
+
+    void StartFlusher()
+    {
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_key_create(&log_key, RetireRing);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&thread, &attr, FlusherRoutine, NULL);
+	pthread_attr_destroy(&attr);
+	atexit(AtExit);
+    }
+
+    // The flusher frees the ring once the thread has exited and the
+    // ring is drained.
+    LogRing* Ring()
+    {
+	if (log_ring == NULL) {
+	    pthread_once(&log_once, StartFlusher);
+	    LogRing* ring = new LogRing;
+	    ring->head = ring->tail = 0;
+	    ring->dropped = ring->reported = 0;
+	    ring->retired = 0;
+	    pthread_mutex_lock(&log_lock);
+	    ring->next = log_rings;
+	    log_rings = ring;
+	    pthread_mutex_unlock(&log_lock);
+	    pthread_setspecific(log_key, ring);
+	    log_ring = ring;
+	}
+	return log_ring;
+    }
+}
+
+void __LogWrite(const char* prefix, const char* file, int line,
+		const char* func, const char* fmt, ...)
+{
+    LogRing* ring = Ring();
+    if (ring->head - ring->tail >= LOG_RING_SIZE) {
+	ring->dropped = ring->dropped + 1;
+	return;
+    }
+    LogMessage* msg = &ring->messages[ring->head & (LOG_RING_SIZE - 1)];
+    msg->prefix = prefix;
+    msg->file = file;
+    msg->func = func;
+    msg->line = line;
+
+    va_list ap;
+    bool encoded = false;
+    if (log_binary) {
+	va_start(ap, fmt);
+	encoded = EncodeArgs(msg, fmt, ap);
+	va_end(ap);
+    }
+    if (encoded) {
+	msg->fmt = fmt;
+    } else { // formatted here, truncated if too long
+	msg->fmt = NULL;
+	va_start(ap, fmt);
+	int len = vsnprintf(msg->data, LOG_MESSAGE_SIZE, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+	    len = 0;
+	msg->length = (len < LOG_MESSAGE_SIZE) ? len : LOG_MESSAGE_SIZE - 1;
+    }
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    __sync_synchronize(); // head before log_sleeping, see FlusherRoutine
+    if (log_sleeping) {
+	pthread_mutex_lock(&log_lock);
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_lock);
+    }
+}
+
+// The pass under way may have started before the call: wait for the
+// one after it, which sees every message logged so far.
+void LogFlush()
+{
+    pthread_once(&log_once, StartFlusher);
+    pthread_mutex_lock(&log_lock);
+    uint64_t target = log_passes + 2;
+    ++log_waiters;
+    pthread_cond_signal(&log_wake);
+    while (log_passes < target)
+	pthread_cond_wait(&log_drained, &log_lock);
+    --log_waiters;
+    pthread_mutex_unlock(&log_lock);
+    fflush(PPNFS_OUTPUT_FD);
+}
+
+void LogSetBinary(int on)
+{
+    log_binary = on;
+}
+
+unsigned long LogDropped()
+{
+    pthread_mutex_lock(&log_lock);
+    unsigned long dropped = log_retired_dropped;
+    for (LogRing* ring = log_rings; ring != NULL; ring = ring->next)
+	dropped += ring->dropped;
+    pthread_mutex_unlock(&log_lock);
+    return dropped;
+}
@@ -26,13 +26,24 @@
 #include <stdio.h>
 #define PPNFS_OUTPUT_FD stdout
 
+// Messages go to a ring buffer of the calling thread and are written to
+// PPNFS_OUTPUT_FD by a background thread, so logging never waits on
+// stdio. When a ring is full the message is dropped and counted.
+void __LogWrite(const char* prefix, const char* file, int line,
+		const char* func, const char* fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+// Block until every message logged so far is written out
+void LogFlush();
+// Store the arguments of later messages in binary and format them on
+// the background thread instead of the caller (off by default). The
+// format string must then outlive the message, as literals do.
+void LogSetBinary(int on);
+// Messages dropped so far because a ring was full
+unsigned long LogDropped();
+
 #define __Log(__prefix, __fmt, ...)                                     \
-    do {                                                                \
-        fprintf(PPNFS_OUTPUT_FD, __prefix "|" __FILE__ ":%d:%s|" __fmt, \
-                __LINE__,  __FUNCTION__,                                \
-                ##__VA_ARGS__ );                                        \
-        fflush(PPNFS_OUTPUT_FD);                                        \
-       } while(0)
+    __LogWrite(__prefix, __FILE__, __LINE__, __FUNCTION__, __fmt,       \
+               ##__VA_ARGS__)
 
 #ifdef DEBUG
 #define Log(...) __Log("LOG", __VA_ARGS__)
@@ -42,6 +53,7 @@
 #define Info(...) __Log("INF", __VA_ARGS__)
 #define Warn(...) __Log("WRN", __VA_ARGS__)
 #define Err(...)  __Log("ERR", __VA_ARGS__)
-#define Bug(...) do { __Log("BUG",__VA_ARGS__); ((char*)NULL)[0] = 0; } while(0)
+#define Bug(...) do { __Log("BUG",__VA_ARGS__); LogFlush();             \
+                      ((char*)NULL)[0] = 0; } while(0)
 
 #endif
@@ -0,0 +1,573 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#include <stdint.h>
+#include <math.h>
+#include <sched.h>
+#include <algorithm>
+#include <utility>
+
+#include "lsm_rtree.h"
+
+namespace cmpt740 {
+
+    static bool RectOverlap(Rtree::RtreeRect* rectA, Rtree::RtreeRect* rectB)
+    {
+	for (int index = 0; index < DIMENSION; ++index) {
+	    if (rectA->min[index] > rectB->max[index] ||
+		rectB->min[index] > rectA->max[index]) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    // Orders entries by the center of their rectangle along one dimension
+    struct CenterLess {
+	int dim;
+	CenterLess(int dim) : dim(dim) {}
+	template <typename T>
+	bool operator()(const T& a, const T& b) const {
+	    return ((uint64_t)a.rect.min[dim] + a.rect.max[dim] <
+		    (uint64_t)b.rect.min[dim] + b.rect.max[dim]);
+	}
+    };
+
+    // Groups the writes of one record together, newest first
+    struct KeyLess {
+	template <typename T>
+	bool operator()(const T& a, const T& b) const {
+	    for (int i = 0; i < DIMENSION; ++i) {
+		if (a.rect.min[i] != b.rect.min[i])
+		    return a.rect.min[i] < b.rect.min[i];
+		if (a.rect.max[i] != b.rect.max[i])
+		    return a.rect.max[i] < b.rect.max[i];
+	    }
+	    if (a.data != b.data)
+		return a.data < b.data;
+	    return a.seq > b.seq;
+	}
+    };
+
+    // Writes of the same record: same rectangle, same data
+    template <typename T>
+    static bool SameRecord(const T& a, const T& b)
+    {
+	for (int i = 0; i < DIMENSION; ++i) {
+	    if (a.rect.min[i] != b.rect.min[i] ||
+		a.rect.max[i] != b.rect.max[i]) {
+		return false;
+	    }
+	}
+	return (a.data == b.data);
+    }
+
+    LsmRtree::LsmRtree(uint32_t memtable)
+    {
+	memtable_size = (memtable > 0) ? memtable : 1;
+	seq = 0;
+	frozen = 0;
+	pthread_mutex_init(&version_lock, NULL);
+	pthread_mutex_init(&compact_lock, NULL);
+
+	Component* component = new Component;
+	component->memtable = new Rtree(NULL);
+	component->run = NULL;
+	component->inserts = 0;
+	component->writers = 0;
+	component->refs = 1;
+	current = new Version;
+	current->components.push_back(component);
+	current->refs = 1;
+	pool = new ThreadPool(1);
+    }
+
+    LsmRtree::~LsmRtree()
+    {
+	pool->Wait(&group);
+	delete pool;
+	std::vector<Component*> dead;
+	pthread_mutex_lock(&version_lock);
+	Drop(current, dead);
+	pthread_mutex_unlock(&version_lock);
+	for (size_t i = 0; i < dead.size(); ++i)
+	    FreeComponent(dead[i]);
+	pthread_mutex_destroy(&version_lock);
+	pthread_mutex_destroy(&compact_lock);
+    }
+
+    bool LsmRtree::Insert(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+			  data_t* data)
+    {
+	return Write(min, max, data, false);
+    }
+
+    // Always true: whether the tombstone deletes anything is only known
+    // to the queries that meet it.
+    bool LsmRtree::Delete(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+			  data_t* data)
+    {
+	return Write(min, max, data, true);
+    }
+
+    bool LsmRtree::Write(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+			 data_t* data, bool tombstone)
+    {
+	Entry* entry = new Entry;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    entry->rect.min[i] = min[i];
+	    entry->rect.max[i] = max[i];
+	}
+	entry->data = data;
+	entry->tombstone = tombstone;
+
+	// Freeze swaps level 0 under the same lock, so once it has, no
+	// write can start on the frozen tree. Numbering the write under
+	// the lock too keeps every entry of a component older than those
+	// of the components before it, which Convert and Compact count on
+	// when they drop tombstones by position.
+	pthread_mutex_lock(&version_lock);
+	entry->seq = ++seq;
+	Component* component = current->components[0];
+	__sync_add_and_fetch(&component->writers, 1);
+	pthread_mutex_unlock(&version_lock);
+
+	bool ret = component->memtable->Insert(entry->rect.min, entry->rect.max,
+					       (data_t*)entry);
+	uint64_t inserts = __sync_add_and_fetch(&component->inserts, 1);
+	__sync_sub_and_fetch(&component->writers, 1);
+	if (inserts == memtable_size)
+	    Freeze(component);
+	return ret;
+    }
+
+    std::vector<Rtree::RtreeRecord> LsmRtree::Search(uint32_t min[DIMENSION],
+						     uint32_t max[DIMENSION])
+    {
+	Rtree::RtreeRect rect;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.min[i] = min[i];
+	    rect.max[i] = max[i];
+	}
+
+	// A tombstone has the rectangle of the records it deletes, so the
+	// window finds it wherever it finds them
+	std::vector<Entry> entries;
+	Version* version = Acquire();
+	for (size_t n = 0; n < version->components.size(); ++n) {
+	    Component* component = version->components[n];
+	    if (component->memtable != NULL)
+		SearchMemtable(component, &rect, entries);
+	    else
+		SearchRun(component->run, &rect, entries);
+	}
+	Release(version);
+	Resolve(entries, false);
+
+	std::vector<Rtree::RtreeRecord> results(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i) {
+	    results[i].rect = entries[i].rect;
+	    results[i].data = entries[i].data;
+	}
+	return results;
+    }
+
+    void LsmRtree::Flush()
+    {
+	pthread_mutex_lock(&version_lock);
+	Component* component = current->components[0];
+	pthread_mutex_unlock(&version_lock);
+	if (component->inserts > 0)
+	    Freeze(component);
+	pool->Wait(&group);
+    }
+
+    void LsmRtree::Components(std::vector<uint64_t>& sizes)
+    {
+	sizes.clear();
+	Version* version = Acquire();
+	for (size_t n = 0; n < version->components.size(); ++n) {
+	    Component* component = version->components[n];
+	    if (component->memtable != NULL)
+		sizes.push_back((uint64_t)component->inserts);
+	    else
+		sizes.push_back(component->run->entries.size());
+	}
+	Release(version);
+    }
+
+    LsmRtree::Version* LsmRtree::Acquire()
+    {
+	pthread_mutex_lock(&version_lock);
+	Version* version = current;
+	++version->refs;
+	pthread_mutex_unlock(&version_lock);
+	return version;
+    }
+
+    void LsmRtree::Release(Version* version)
+    {
+	std::vector<Component*> dead;
+	pthread_mutex_lock(&version_lock);
+	Drop(version, dead);
+	pthread_mutex_unlock(&version_lock);
+	for (size_t i = 0; i < dead.size(); ++i)
+	    FreeComponent(dead[i]);
+    }
+
+    // Drop a reference to version, collecting the components no version
+    // holds any more into dead. Called with version_lock held.
+    void LsmRtree::Drop(Version* version, std::vector<Component*>& dead)
+    {
+	if (--version->refs > 0)
+	    return;
+	for (size_t n = 0; n < version->components.size(); ++n) {
+	    if (--version->components[n]->refs == 0)
+		dead.push_back(version->components[n]);
+	}
+	delete version;
+    }
+
+    // Publish a version with components [first, last) of the current one
+    // replaced by replacement, or just removed if it is NULL. Called with
+    // version_lock held.
+    void LsmRtree::Install(size_t first, size_t last, Component* replacement,
+			   std::vector<Component*>& dead)
+    {
+	Version* version = new Version;
+	version->refs = 1;
+	std::vector<Component*>& from = current->components;
+	version->components.insert(version->components.end(), from.begin(),
+				   from.begin() + first);
+	if (replacement != NULL)
+	    version->components.push_back(replacement);
+	version->components.insert(version->components.end(),
+				   from.begin() + last, from.end());
+	for (size_t n = 0; n < version->components.size(); ++n)
+	    ++version->components[n]->refs;
+	Version* old = current;
+	current = version;
+	Drop(old, dead);
+    }
+
+    // Give writers a fresh level 0 and queue the full one for conversion.
+    // Writers stall here while too many frozen trees are waiting.
+    void LsmRtree::Freeze(Component* memtable)
+    {
+	std::vector<Component*> dead;
+	pthread_mutex_lock(&version_lock);
+	if (current->components[0] != memtable) { // frozen already
+	    pthread_mutex_unlock(&version_lock);
+	    return;
+	}
+	Component* component = new Component;
+	component->memtable = new Rtree(NULL);
+	component->run = NULL;
+	component->inserts = 0;
+	component->writers = 0;
+	component->refs = 0;
+	Install(0, 0, component, dead);
+	long waiting = __sync_add_and_fetch(&frozen, 1);
+	pthread_mutex_unlock(&version_lock);
+
+	pool->Submit(ConvertRoutine, this, &group);
+	if (waiting > LSM_MAX_FROZEN)
+	    pool->Wait(&group);
+    }
+
+    void LsmRtree::ConvertRoutine(void* arg)
+    {
+	LsmRtree* lsm = (LsmRtree*)arg;
+	lsm->Convert();
+	while (lsm->Compact());
+    }
+
+    // Pack the oldest frozen level 0 tree into a run. Frozen trees are
+    // converted in the order they were frozen, so runs are always the
+    // oldest components.
+    void LsmRtree::Convert()
+    {
+	pthread_mutex_lock(&compact_lock);
+	Version* version = Acquire();
+	Component* memtable = NULL;
+	bool oldest = true;
+	for (size_t n = version->components.size() - 1; n > 0; --n) {
+	    if (version->components[n]->memtable != NULL) {
+		memtable = version->components[n];
+		break;
+	    }
+	    oldest = false;
+	}
+	if (memtable == NULL) {
+	    Release(version);
+	    pthread_mutex_unlock(&compact_lock);
+	    return;
+	}
+
+	// Writes that picked the tree before it froze
+	while (memtable->writers > 0)
+	    sched_yield();
+
+	uint32_t min[DIMENSION], max[DIMENSION];
+	for (int i = 0; i < DIMENSION; ++i) {
+	    min[i] = 0;
+	    max[i] = UINT32_MAX;
+	}
+	std::vector<Rtree::RtreeRecord> records =
+	    memtable->memtable->ParallelSearch(min, max, NULL);
+	std::vector<Entry> entries(records.size());
+	for (size_t i = 0; i < records.size(); ++i)
+	    entries[i] = *(Entry*)records[i].data;
+	// Nothing older is left for the tombstones to delete
+	Component* run = NewRun(entries, !oldest);
+
+	std::vector<Component*> dead;
+	pthread_mutex_lock(&version_lock);
+	for (size_t n = 0; n < current->components.size(); ++n) {
+	    if (current->components[n] == memtable) {
+		Install(n, n + 1, run, dead);
+		break;
+	    }
+	}
+	__sync_sub_and_fetch(&frozen, 1);
+	Drop(version, dead);
+	pthread_mutex_unlock(&version_lock);
+	pthread_mutex_unlock(&compact_lock);
+	for (size_t i = 0; i < dead.size(); ++i)
+	    FreeComponent(dead[i]);
+    }
+
+    // Merge LSM_TIER_RUNS adjacent runs whose sizes are within a factor
+    // of two of each other into one. Runs are merged with neighbours
+    // only, so a merge that takes in the oldest run can drop the
+    // tombstones. Returns false if no tier was full.
+    bool LsmRtree::Compact()
+    {
+	pthread_mutex_lock(&compact_lock);
+	Version* version = Acquire();
+	std::vector<Component*>& components = version->components;
+	size_t first = components.size();
+	while (first > 0 && components[first - 1]->run != NULL)
+	    --first;
+
+	size_t from = 0, to = 0;
+	bool full = false;
+	for (size_t n = first; n < components.size() && !full; n = to) {
+	    uint64_t low = components[n]->run->entries.size();
+	    uint64_t high = low;
+	    for (to = n + 1; to < components.size(); ++to) {
+		uint64_t size = components[to]->run->entries.size();
+		if (size > 2 * low || 2 * size < high)
+		    break;
+		low = std::min(low, size);
+		high = std::max(high, size);
+	    }
+	    if (to - n >= LSM_TIER_RUNS) {
+		from = n;
+		to = n + LSM_TIER_RUNS;
+		full = true;
+	    }
+	}
+	if (!full) {
+	    Release(version);
+	    pthread_mutex_unlock(&compact_lock);
+	    return false;
+	}
+
+	std::vector<Entry> entries;
+	for (size_t n = from; n < to; ++n) {
+	    Run* run = components[n]->run;
+	    entries.insert(entries.end(), run->entries.begin(),
+			   run->entries.end());
+	}
+	Component* run = NewRun(entries, to < components.size());
+
+	// Only this thread removes runs, and new components come in at
+	// the front, so the runs merged are still the last ones
+	std::vector<Component*> dead;
+	pthread_mutex_lock(&version_lock);
+	size_t shift = current->components.size() - components.size();
+	Install(from + shift, to + shift, run, dead);
+	Drop(version, dead);
+	pthread_mutex_unlock(&version_lock);
+	pthread_mutex_unlock(&compact_lock);
+	for (size_t i = 0; i < dead.size(); ++i)
+	    FreeComponent(dead[i]);
+	return true;
+    }
+
+    // Build a run from entries, dropping what their tombstones delete
+    // and, unless tombstones is set, the tombstones. NULL if nothing is
+    // left.
+    LsmRtree::Component* LsmRtree::NewRun(std::vector<Entry>& entries,
+					  bool tombstones)
+    {
+	Resolve(entries, tombstones);
+	if (entries.empty())
+	    return NULL;
+
+	Run* run = new Run;
+	run->entries.swap(entries);
+	SortStr(run->entries, 0, run->entries.size(), 0);
+	run->tombstones = 0;
+	size_t count = run->entries.size();
+	std::vector<Rtree::RtreeRect> level;
+	for (size_t i = 0; i < count; ++i) {
+	    Entry* entry = &run->entries[i];
+	    if (entry->tombstone)
+		++run->tombstones;
+	    if (i % LSM_RUN_FANOUT == 0) {
+		level.push_back(entry->rect);
+		continue;
+	    }
+	    Rtree::RtreeRect* cover = &level.back();
+	    for (int d = 0; d < DIMENSION; ++d) {
+		cover->min[d] = std::min(cover->min[d], entry->rect.min[d]);
+		cover->max[d] = std::max(cover->max[d], entry->rect.max[d]);
+	    }
+	}
+	run->bounds.push_back(level);
+	while (run->bounds.back().size() > 1) {
+	    std::vector<Rtree::RtreeRect>& below = run->bounds.back();
+	    level.clear();
+	    for (size_t i = 0; i < below.size(); ++i) {
+		if (i % LSM_RUN_FANOUT == 0) {
+		    level.push_back(below[i]);
+		    continue;
+		}
+		Rtree::RtreeRect* cover = &level.back();
+		for (int d = 0; d < DIMENSION; ++d) {
+		    cover->min[d] = std::min(cover->min[d], below[i].min[d]);
+		    cover->max[d] = std::max(cover->max[d], below[i].max[d]);
+		}
+	    }
+	    run->bounds.push_back(level);
+	}
+
+	Component* component = new Component;
+	component->memtable = NULL;
+	component->run = run;
+	component->inserts = 0;
+	component->writers = 0;
+	component->refs = 0;
+	return component;
+    }
+
+    void LsmRtree::FreeComponent(Component* component)
+    {
+	if (component->memtable != NULL) {
+	    uint32_t min[DIMENSION], max[DIMENSION];
+	    for (int i = 0; i < DIMENSION; ++i) {
+		min[i] = 0;
+		max[i] = UINT32_MAX;
+	    }
+	    std::vector<Rtree::RtreeRecord> records =
+		component->memtable->ParallelSearch(min, max, NULL);
+	    for (size_t i = 0; i < records.size(); ++i)
+		delete (Entry*)records[i].data;
+	    delete component->memtable;
+	}
+	delete component->run;
+	delete component;
+    }
+
+    void LsmRtree::SearchMemtable(Component* component, Rtree::RtreeRect* rect,
+				  std::vector<Entry>& out)
+    {
+	std::vector<Rtree::RtreeRecord> records =
+	    component->memtable->ParallelSearch(rect->min, rect->max, NULL);
+	for (size_t i = 0; i < records.size(); ++i)
+	    out.push_back(*(Entry*)records[i].data);
+    }
+
+    // Runs never change, so they are read without any locking
+    void LsmRtree::SearchRun(Run* run, Rtree::RtreeRect* rect,
+			     std::vector<Entry>& out)
+    {
+	std::vector<std::pair<int, size_t> > stack;
+	stack.push_back(std::make_pair((int)run->bounds.size() - 1, (size_t)0));
+	while (!stack.empty()) {
+	    int level = stack.back().first;
+	    size_t node = stack.back().second;
+	    stack.pop_back();
+	    if (!RectOverlap(rect, &run->bounds[level][node]))
+		continue;
+	    size_t first = node * LSM_RUN_FANOUT;
+	    size_t last = first + LSM_RUN_FANOUT;
+	    if (level == 0) {
+		last = std::min(last, run->entries.size());
+		for (size_t i = first; i < last; ++i) {
+		    if (RectOverlap(rect, &run->entries[i].rect))
+			out.push_back(run->entries[i]);
+		}
+		continue;
+	    }
+	    last = std::min(last, run->bounds[level - 1].size());
+	    for (size_t i = first; i < last; ++i)
+		stack.push_back(std::make_pair(level - 1, i));
+	}
+    }
+
+    // Sort-Tile-Recursive order: sort by dimension dim, cut into slabs
+    // that will hold an equal share of the leaves, and sort each slab by
+    // the next dimension.
+    void LsmRtree::SortStr(std::vector<Entry>& entries, size_t from,
+			   size_t to, int dim)
+    {
+	std::sort(entries.begin() + from, entries.begin() + to,
+		  CenterLess(dim));
+	if (dim == DIMENSION - 1)
+	    return;
+	size_t leaves = (to - from + LSM_RUN_FANOUT - 1) / LSM_RUN_FANOUT;
+	size_t slabs = (size_t)ceil(pow((double)leaves,
+					1.0 / (DIMENSION - dim)));
+	if (slabs < 1)
+	    slabs = 1;
+	size_t slab = LSM_RUN_FANOUT * ((leaves + slabs - 1) / slabs);
+	for (size_t start = from; start < to; start += slab)
+	    SortStr(entries, start, std::min(start + slab, to), dim + 1);
+    }
+
+    // Keep the entries no newer tombstone deletes. Of the tombstones
+    // only the newest of each record is kept, and only if tombstones is
+    // set.
+    void LsmRtree::Resolve(std::vector<Entry>& entries, bool tombstones)
+    {
+	std::sort(entries.begin(), entries.end(), KeyLess());
+	size_t kept = 0;
+	bool deleted = false;
+	for (size_t i = 0; i < entries.size(); ++i) {
+	    Entry& entry = entries[i];
+	    if (i == 0 || !SameRecord(entries[i - 1], entry))
+		deleted = false;
+	    if (deleted)
+		continue;
+	    if (entry.tombstone) {
+		deleted = true;
+		if (!tombstones)
+		    continue;
+	    }
+	    entries[kept++] = entry;
+	}
+	entries.resize(kept);
+    }
+}
@@ -0,0 +1,141 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#ifndef _LSM_RTREE_H_
+#define _LSM_RTREE_H_
+
+#include <vector>
+#include <pthread.h>
+#include "rtree.h"
+#include "threadpool.h"
+
+namespace cmpt740 {
+
+    namespace internal {
+	// Records in the mutable level 0 before it is frozen
+	#define LSM_MEMTABLE_SIZE 65536
+	// Children per node of the packed immutable trees
+	#define LSM_RUN_FANOUT 16
+	// Runs of about the same size that get merged into one
+	#define LSM_TIER_RUNS 4
+	// Frozen level 0 trees waiting for conversion before writers stall
+	#define LSM_MAX_FROZEN 2
+    }
+
+    // A log-structured spatial index. Writes go to a mutable in-memory
+    // Rtree, level 0; a delete is written there too, as a tombstone.
+    // When level 0 fills up it is frozen, a fresh one takes the writes,
+    // and a background thread packs the frozen tree into an immutable
+    // run. Runs of about the same size are merged, size-tiered. Queries
+    // search every component and drop records a newer tombstone deletes.
+    //
+    // Records are only matched by their exact rectangle and data: Delete
+    // removes the records inserted earlier with both the same, unlike
+    // Rtree::Delete, which removes whatever overlaps the rectangle.
+    class LsmRtree {
+    public:
+	// memtable: records per level 0 tree.
+	LsmRtree(uint32_t memtable = LSM_MEMTABLE_SIZE);
+	virtual ~LsmRtree();
+	bool Insert(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data);
+	bool Delete(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data);
+	// Every live record overlapping the window, in no particular order
+	std::vector<Rtree::RtreeRecord> Search(uint32_t min[DIMENSION],
+					       uint32_t max[DIMENSION]);
+	// Freeze level 0 and wait until it and every compaction it leads
+	// to are done.
+	void Flush();
+	// Entries, tombstones included, of each component, newest first;
+	// level 0 trees are listed with their insert counts.
+	void Components(std::vector<uint64_t>& sizes);
+
+    protected:
+	// A record or tombstone with the sequence number of its write
+	struct Entry {
+	    Rtree::RtreeRect rect;
+	    data_t* data;
+	    uint64_t seq;
+	    bool tombstone;
+	};
+
+	// Immutable packed tree. entries are in STR order; bounds[0][i]
+	// covers entries i*LSM_RUN_FANOUT and on, bounds[l][i] the nodes
+	// i*LSM_RUN_FANOUT and on of bounds[l-1]. The last level has one
+	// rectangle.
+	struct Run {
+	    std::vector<Entry> entries;
+	    std::vector<std::vector<Rtree::RtreeRect> > bounds;
+	    uint64_t tombstones;
+	};
+
+	// A level 0 tree or a run. Level 0 trees hold Entry pointers as
+	// their records' data.
+	struct Component {
+	    Rtree* memtable;
+	    Run* run;
+	    volatile uint64_t inserts; // level 0: records written so far
+	    volatile long writers;     // level 0: writes in progress
+	    long refs;                 // versions holding the component
+	};
+
+	// The components at one point in time, newest first; the first is
+	// level 0 taking the writes. Never changed once published, so
+	// readers walk it without locks.
+	struct Version {
+	    std::vector<Component*> components;
+	    long refs;
+	};
+
+	static void ConvertRoutine(void* arg);
+	bool Write(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+		   data_t* data, bool tombstone);
+	Version* Acquire();
+	void Release(Version* version);
+	void Drop(Version* version, std::vector<Component*>& dead);
+	void Install(size_t first, size_t last, Component* replacement,
+		     std::vector<Component*>& dead);
+	void Freeze(Component* memtable);
+	void Convert();
+	bool Compact();
+	Component* NewRun(std::vector<Entry>& entries, bool tombstones);
+	void FreeComponent(Component* component);
+	void SearchMemtable(Component* component, Rtree::RtreeRect* rect,
+			    std::vector<Entry>& out);
+	void SearchRun(Run* run, Rtree::RtreeRect* rect,
+		       std::vector<Entry>& out);
+	static void SortStr(std::vector<Entry>& entries, size_t from,
+			    size_t to, int dim);
+	static void Resolve(std::vector<Entry>& entries, bool tombstones);
+
+    private:
+	uint32_t memtable_size;
+	uint64_t seq;                 // last write numbered, under version_lock
+	Version* current;
+	pthread_mutex_t version_lock; // guards current and the refcounts
+	pthread_mutex_t compact_lock; // one conversion or merge at a time
+	volatile long frozen;         // level 0 trees not yet converted
+	ThreadPool* pool;             // the background thread
+	TaskGroup group;
+    };
+}
+
+#endif
@@ -22,13 +22,14 @@
 
 #include "mempool.h"
 #include "log.h"
+#include "trace.h"
 
 namespace cmpt740 {
     Mempool::Mempool(const char* filename)
     {
 	hd.open(filename, std::fstream::in | std::fstream::out);
 	if (!hd.is_open()) {
-	    hd.open("rtree.dat", std::fstream::in |
+	    hd.open(filename, std::fstream::in |
 		    std::fstream::out | std::fstream::trunc);
 	}
     }
@@ -49,7 +50,9 @@ namespace cmpt740 {
 	long pos = hd.tellg();
 	hd.seekg(offset);
 	Rtree::RtreeNode* node = new Rtree::RtreeNode;
+	TRACE_BEGIN(TRACE_MEMPOOL_READ, offset);
 	hd.read((char*)node, sizeof(Rtree::RtreeNode));
+	TRACE_END(TRACE_MEMPOOL_READ);
 	hd.seekg(pos);
 
 	RtreeNodeEnt ent;
@@ -63,24 +66,28 @@ namespace cmpt740 {
     long Mempool::SaveRtreeNode(Rtree::RtreeNode* node)
     {
 	long offset = hd.tellp();
+	long ret;
+	TRACE_BEGIN(TRACE_MEMPOOL_WRITE, node->offset);
 	if (node->offset == 0) { // root node
 	    hd.seekp(hd.beg);
 	    hd.write((char*)node, sizeof(Rtree::RtreeNode));
 	    if (offset == 0) offset = sizeof(Rtree::RtreeNode);
 	    hd.seekp(offset);
 	    hd.flush();
-	    return 0;
+	    ret = 0;
 	} else if (node->offset == -1) { // newly created node
 	    node->offset = offset;
 	    hd.write((char*)node, sizeof(Rtree::RtreeNode));
 	    hd.flush();
-	    return offset;
+	    ret = offset;
 	} else { // node already exists in disk
 	    hd.seekp(node->offset);
 	    hd.write((char*)node, sizeof(Rtree::RtreeNode));
 	    hd.seekp(offset);
 	    hd.flush();
-	    return node->offset;
+	    ret = node->offset;
 	}
+	TRACE_END(TRACE_MEMPOOL_WRITE);
+	return ret;
     }
 }
@@ -0,0 +1,213 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <time.h>
+#include <algorithm>
+#include "recorder.h"
+#include "log.h"
+
+namespace cmpt740 {
+
+    static int recorder_next_thread = 0;
+    static __thread int recorder_thread = -1;
+
+    static bool CompareStart(const OpRecorder::OpRecord& a,
+			     const OpRecorder::OpRecord& b)
+    {
+	return a.start < b.start;
+    }
+
+    OpRecorder::OpRecorder()
+    {
+	file = NULL;
+	origin = 0;
+	slots = new Slot[RECORDER_SLOTS];
+	for (int i = 0; i < RECORDER_SLOTS; ++i) {
+	    pthread_mutex_init(&slots[i].lock, NULL);
+	    slots[i].recorded = 0;
+	}
+	pthread_mutex_init(&file_lock, NULL);
+    }
+
+    OpRecorder::~OpRecorder()
+    {
+	Close();
+	for (int i = 0; i < RECORDER_SLOTS; ++i)
+	    pthread_mutex_destroy(&slots[i].lock);
+	delete[] slots;
+	pthread_mutex_destroy(&file_lock);
+    }
+
+    uint64_t OpRecorder::Now()
+    {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    int OpRecorder::ThreadIndex()
+    {
+	if (recorder_thread < 0)
+	    recorder_thread = __sync_fetch_and_add(&recorder_next_thread, 1);
+	return recorder_thread;
+    }
+
+    bool OpRecorder::Open(const char* path)
+    {
+	Close();
+	pthread_mutex_lock(&file_lock);
+	FILE* out = fopen(path, "wb");
+	if (out == NULL) {
+	    pthread_mutex_unlock(&file_lock);
+	    Err("cannot create trace %s\n", path);
+	    return false;
+	}
+	RecorderHeader header;
+	header.magic = RECORDER_MAGIC;
+	header.version = RECORDER_VERSION;
+	header.dimension = DIMENSION;
+	header.record_size = sizeof(OpRecord);
+	header.reserved = 0;
+	fwrite(&header, sizeof(header), 1, out);
+	for (int i = 0; i < RECORDER_SLOTS; ++i) {
+	    pthread_mutex_lock(&slots[i].lock);
+	    slots[i].buffer.reserve(RECORDER_BUFFER);
+	    slots[i].recorded = 0;
+	    pthread_mutex_unlock(&slots[i].lock);
+	}
+	origin = Now();
+	__sync_synchronize(); // origin before file, see Record
+	file = out;
+	pthread_mutex_unlock(&file_lock);
+	return true;
+    }
+
+    // Every slot is written out in turn: the batches of the threads
+    // merge into the one file.
+    void OpRecorder::Close()
+    {
+	std::vector<OpRecord> records;
+	pthread_mutex_lock(&file_lock);
+	if (file != NULL) {
+	    for (int i = 0; i < RECORDER_SLOTS; ++i) {
+		pthread_mutex_lock(&slots[i].lock);
+		records.swap(slots[i].buffer);
+		pthread_mutex_unlock(&slots[i].lock);
+		WriteBuffer(records);
+	    }
+	    fclose(file);
+	    file = NULL;
+	}
+	pthread_mutex_unlock(&file_lock);
+    }
+
+    // Caller holds file_lock
+    void OpRecorder::WriteBuffer(std::vector<OpRecord>& records)
+    {
+	if (!records.empty()
+	    && fwrite(&records[0], sizeof(OpRecord), records.size(), file)
+	    != records.size())
+	    Err("short write to trace, %lu records lost\n",
+		(unsigned long)records.size());
+	records.clear();
+    }
+
+    uint64_t OpRecorder::Recorded()
+    {
+	uint64_t recorded = 0;
+	for (int i = 0; i < RECORDER_SLOTS; ++i) {
+	    pthread_mutex_lock(&slots[i].lock);
+	    recorded += slots[i].recorded;
+	    pthread_mutex_unlock(&slots[i].lock);
+	}
+	return recorded;
+    }
+
+    void OpRecorder::Record(OpKind op, Rtree::RtreeRect* rect, data_t* data,
+			    uint64_t start, uint32_t result)
+    {
+	if (file == NULL)
+	    return;
+	OpRecord r;
+	uint64_t end = Now();
+	r.start = start - origin;
+	r.data = (uint64_t)(uintptr_t)data;
+	r.duration = (end - start > 0xffffffffULL) ? 0xffffffffU
+	    : (uint32_t)(end - start);
+	r.result = result;
+	r.thread = (uint16_t)ThreadIndex();
+	r.op = (uint8_t)op;
+	r.reserved = 0;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    r.min[i] = rect->min[i];
+	    r.max[i] = rect->max[i];
+	}
+
+	// Only threads beyond RECORDER_SLOTS share a slot; the lock is
+	// uncontended otherwise. A full buffer is swapped out and written
+	// without it.
+	Slot* slot = &slots[r.thread % RECORDER_SLOTS];
+	std::vector<OpRecord> full;
+	pthread_mutex_lock(&slot->lock);
+	slot->buffer.push_back(r);
+	++slot->recorded;
+	if (slot->buffer.size() >= RECORDER_BUFFER) {
+	    full.swap(slot->buffer);
+	    slot->buffer.reserve(RECORDER_BUFFER);
+	}
+	pthread_mutex_unlock(&slot->lock);
+	if (!full.empty()) {
+	    pthread_mutex_lock(&file_lock);
+	    if (file != NULL)
+		WriteBuffer(full);
+	    pthread_mutex_unlock(&file_lock);
+	}
+    }
+
+    bool OpRecorder::Load(const char* path, std::vector<OpRecord>& records)
+    {
+	FILE* in = fopen(path, "rb");
+	if (in == NULL) {
+	    Err("cannot open trace %s\n", path);
+	    return false;
+	}
+	RecorderHeader header;
+	if (fread(&header, sizeof(header), 1, in) != 1
+	    || header.magic != RECORDER_MAGIC
+	    || header.version != RECORDER_VERSION
+	    || header.dimension != DIMENSION
+	    || header.record_size != sizeof(OpRecord)) {
+	    Err("%s is not a trace of this build\n", path);
+	    fclose(in);
+	    return false;
+	}
+	records.clear();
+	OpRecord chunk[256];
+	size_t n;
+	while ((n = fread(chunk, sizeof(OpRecord), 256, in)) > 0)
+	    records.insert(records.end(), chunk, chunk + n);
+	fclose(in);
+	std::stable_sort(records.begin(), records.end(), CompareStart);
+	return true;
+    }
+}
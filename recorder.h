@@ -0,0 +1,102 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdio.h>
+#include <vector>
+#include <pthread.h>
+#include "rtree.h"
+
+#define RECORDER_MAGIC 0x43525452U // "RTRC"
+#define RECORDER_VERSION 1
+#define RECORDER_BUFFER 4096       // records a thread buffers before a write
+#define RECORDER_SLOTS 64          // buffers, threads share them beyond that
+
+namespace cmpt740 {
+
+    // Streams the operations of an Rtree to a binary trace file, see
+    // Rtree::AttachRecorder. The file is a RecorderHeader followed by
+    // fixed-size OpRecords, in batches of one thread each; replay sorts
+    // them by start time. Each thread buffers into a slot of its own, so
+    // recording threads do not wait on each other but to write a batch.
+    class OpRecorder {
+    public:
+	enum OpKind { OP_INSERT, OP_DELETE, OP_SEARCH };
+
+	struct RecorderHeader {
+	    uint32_t magic;
+	    uint16_t version;
+	    uint16_t dimension;
+	    uint32_t record_size; // sizeof(OpRecord) of the writer
+	    uint32_t reserved;
+	};
+	struct OpRecord {
+	    uint64_t start;    // ns since the recording was opened
+	    uint64_t data;     // the data pointer, as an opaque id
+	    uint32_t duration; // ns, saturated
+	    uint32_t result;   // Insert/Delete return value, Search hits
+	    uint16_t thread;   // recording threads numbered from 0
+	    uint8_t op;        // OpKind
+	    uint8_t reserved;
+	    uint32_t min[DIMENSION];
+	    uint32_t max[DIMENSION];
+	};
+
+	OpRecorder();
+	virtual ~OpRecorder();
+	// Start a new trace in path, false if it cannot be created
+	bool Open(const char* path);
+	// Write what is buffered and close the file. Detach the recorder
+	// from every tree first.
+	void Close();
+	// Called by Rtree once an operation finished; start from Now()
+	void Record(OpKind op, Rtree::RtreeRect* rect, data_t* data,
+		    uint64_t start, uint32_t result);
+	uint64_t Recorded();
+	static uint64_t Now(); // monotonic, in ns
+
+	// Load a whole trace, sorted by start time. False if the file is
+	// missing or was written with another format or DIMENSION.
+	static bool Load(const char* path, std::vector<OpRecord>& records);
+
+    protected:
+	struct Slot {
+	    pthread_mutex_t lock;
+	    std::vector<OpRecord> buffer;
+	    uint64_t recorded;
+	    char pad[64]; // keep slots of different threads apart
+	};
+	void WriteBuffer(std::vector<OpRecord>& records);
+	static int ThreadIndex();
+
+    private:
+	FILE* volatile file;
+	uint64_t origin; // Now() at Open
+	Slot* slots;
+	pthread_mutex_t file_lock; // the file, and Open/Close
+    };
+}
+
+#endif
@@ -0,0 +1,199 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include "result_cache.h"
+
+namespace cmpt740 {
+
+    bool ResultCache::CacheKey::operator<(const CacheKey& other) const
+    {
+	if (tree != other.tree)
+	    return tree < other.tree;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    if (min[i] != other.min[i])
+		return min[i] < other.min[i];
+	    if (max[i] != other.max[i])
+		return max[i] < other.max[i];
+	}
+	return false;
+    }
+
+    ResultCache::ResultCache(size_t max_bytes, int nstripes)
+    {
+	this->nstripes = (nstripes > 0) ? nstripes : 1;
+	stripe_bytes = max_bytes / this->nstripes;
+	stripes = new Stripe[this->nstripes];
+	for (int i = 0; i < this->nstripes; ++i) {
+	    pthread_mutex_init(&stripes[i].lock, NULL);
+	    stripes[i].bytes = 0;
+	    stripes[i].hits = 0;
+	    stripes[i].misses = 0;
+	}
+    }
+
+    ResultCache::~ResultCache()
+    {
+	for (int i = 0; i < nstripes; ++i)
+	    pthread_mutex_destroy(&stripes[i].lock);
+	delete[] stripes;
+    }
+
+    ResultCache::CacheKey ResultCache::MakeKey(uint64_t tree,
+					       Rtree::RtreeRect* rect)
+    {
+	CacheKey key;
+	key.tree = tree;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    key.min[i] = rect->min[i];
+	    key.max[i] = rect->max[i];
+	}
+	return key;
+    }
+
+    ResultCache::Stripe* ResultCache::StripeOf(const CacheKey& key)
+    {
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	hash = (hash ^ key.tree) * 1099511628211ULL;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    hash = (hash ^ key.min[i]) * 1099511628211ULL;
+	    hash = (hash ^ key.max[i]) * 1099511628211ULL;
+	}
+	return &stripes[hash % nstripes];
+    }
+
+    // Versions only grow, so an equal version means the node was not
+    // written since the query read it. The nodes are looked at only
+    // while the generation says none of them can have been freed.
+    bool ResultCache::IsValid(const CacheEntry& entry, uint64_t generation)
+    {
+	if (entry.generation != generation)
+	    return false;
+	for (size_t i = 0; i < entry.deps.size(); ++i) {
+	    const Rtree::RtreeNodeVersion& dep = entry.deps[i];
+	    if (*(volatile uint64_t*)&dep.node->version != dep.version)
+		return false;
+	}
+	return true;
+    }
+
+    void ResultCache::Erase(Stripe* stripe, EntryList::iterator it)
+    {
+	stripe->bytes -= it->bytes;
+	stripe->index.erase(it->key);
+	stripe->lru.erase(it);
+    }
+
+    bool ResultCache::Lookup(uint64_t tree, uint64_t generation,
+			     Rtree::RtreeRect* rect,
+			     std::vector<Rtree::RtreeRecord>& results)
+    {
+	CacheKey key = MakeKey(tree, rect);
+	Stripe* stripe = StripeOf(key);
+	pthread_mutex_lock(&stripe->lock);
+	std::map<CacheKey, EntryList::iterator>::iterator found =
+	    stripe->index.find(key);
+	if (found == stripe->index.end()) {
+	    stripe->misses++;
+	    pthread_mutex_unlock(&stripe->lock);
+	    return false;
+	}
+	EntryList::iterator it = found->second;
+	if (!IsValid(*it, generation)) {
+	    Erase(stripe, it);
+	    stripe->misses++;
+	    pthread_mutex_unlock(&stripe->lock);
+	    return false;
+	}
+	stripe->lru.splice(stripe->lru.begin(), stripe->lru, it);
+	results = it->results;
+	stripe->hits++;
+	pthread_mutex_unlock(&stripe->lock);
+	return true;
+    }
+
+    void ResultCache::Insert(uint64_t tree, uint64_t generation,
+			     Rtree::RtreeRect* rect,
+			     const std::vector<Rtree::RtreeRecord>& results,
+			     const std::vector<Rtree::RtreeNodeVersion>& deps)
+    {
+	size_t bytes = sizeof(CacheEntry)
+	    + results.size() * sizeof(Rtree::RtreeRecord)
+	    + deps.size() * sizeof(Rtree::RtreeNodeVersion);
+	if (bytes > stripe_bytes)
+	    return;
+
+	CacheKey key = MakeKey(tree, rect);
+	Stripe* stripe = StripeOf(key);
+	pthread_mutex_lock(&stripe->lock);
+	std::map<CacheKey, EntryList::iterator>::iterator found =
+	    stripe->index.find(key);
+	if (found != stripe->index.end())
+	    Erase(stripe, found->second);
+	while (stripe->bytes + bytes > stripe_bytes)
+	    Erase(stripe, --stripe->lru.end());
+
+	stripe->lru.push_front(CacheEntry());
+	CacheEntry& entry = stripe->lru.front();
+	entry.key = key;
+	entry.results = results;
+	entry.deps = deps;
+	entry.generation = generation;
+	entry.bytes = bytes;
+	stripe->index[key] = stripe->lru.begin();
+	stripe->bytes += bytes;
+	pthread_mutex_unlock(&stripe->lock);
+    }
+
+    uint64_t ResultCache::Hits()
+    {
+	uint64_t hits = 0;
+	for (int i = 0; i < nstripes; ++i) {
+	    pthread_mutex_lock(&stripes[i].lock);
+	    hits += stripes[i].hits;
+	    pthread_mutex_unlock(&stripes[i].lock);
+	}
+	return hits;
+    }
+
+    uint64_t ResultCache::Misses()
+    {
+	uint64_t misses = 0;
+	for (int i = 0; i < nstripes; ++i) {
+	    pthread_mutex_lock(&stripes[i].lock);
+	    misses += stripes[i].misses;
+	    pthread_mutex_unlock(&stripes[i].lock);
+	}
+	return misses;
+    }
+
+    size_t ResultCache::Bytes()
+    {
+	size_t bytes = 0;
+	for (int i = 0; i < nstripes; ++i) {
+	    pthread_mutex_lock(&stripes[i].lock);
+	    bytes += stripes[i].bytes;
+	    pthread_mutex_unlock(&stripes[i].lock);
+	}
+	return bytes;
+    }
+}
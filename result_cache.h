@@ -0,0 +1,101 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#ifndef _RESULT_CACHE_H_
+#define _RESULT_CACHE_H_
+
+#include <vector>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include "rtree.h"
+
+namespace cmpt740 {
+
+    // Results of Rtree::Search keyed by the tree and the query rectangle.
+    // Each entry keeps the version of every node the query read; a lookup
+    // finding any of them changed drops the entry, so only writes to nodes
+    // the query actually visited invalidate it. Entries are spread over
+    // stripes by key, each with its own lock, LRU list and share of the
+    // byte budget.
+    //
+    // DeleteRange frees nodes, so the node versions are only read while
+    // the entry's generation is still the tree's: the tree bumps it
+    // before it frees anything a search may have read, and Lookup runs
+    // inside the tree's read bracket. Trees are told apart by their
+    // tree_id, never reused, so one cache may serve several trees and
+    // outlive them.
+    class ResultCache {
+    public:
+	ResultCache(size_t max_bytes, int nstripes = 64);
+	virtual ~ResultCache();
+	// True and results filled in if a valid entry exists for rect
+	// generation: the tree's as of before the query read any node.
+	bool Lookup(uint64_t tree, uint64_t generation,
+		    Rtree::RtreeRect* rect,
+		    std::vector<Rtree::RtreeRecord>& results);
+	void Insert(uint64_t tree, uint64_t generation,
+		    Rtree::RtreeRect* rect,
+		    const std::vector<Rtree::RtreeRecord>& results,
+		    const std::vector<Rtree::RtreeNodeVersion>& deps);
+	uint64_t Hits();
+	uint64_t Misses();
+	size_t Bytes();
+
+    protected:
+	struct CacheKey {
+	    uint64_t tree;
+	    uint32_t min[DIMENSION];
+	    uint32_t max[DIMENSION];
+	    bool operator<(const CacheKey& other) const;
+	};
+	struct CacheEntry {
+	    CacheKey key;
+	    std::vector<Rtree::RtreeRecord> results;
+	    std::vector<Rtree::RtreeNodeVersion> deps;
+	    uint64_t generation;
+	    size_t bytes;
+	};
+	typedef std::list<CacheEntry> EntryList;
+	struct Stripe {
+	    pthread_mutex_t lock;
+	    EntryList lru;  // most recently used first
+	    std::map<CacheKey, EntryList::iterator> index;
+	    size_t bytes;
+	    uint64_t hits;
+	    uint64_t misses;
+	};
+
+	static CacheKey MakeKey(uint64_t tree, Rtree::RtreeRect* rect);
+	Stripe* StripeOf(const CacheKey& key);
+	bool IsValid(const CacheEntry& entry, uint64_t generation);
+	void Erase(Stripe* stripe, EntryList::iterator it);
+
+    private:
+	Stripe* stripes;
+	int nstripes;
+	size_t stripe_bytes; // budget of each stripe
+    };
+}
+
+#endif
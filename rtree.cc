@@ -21,29 +21,354 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
+#include <algorithm>
 #include <assert.h>
+#include <time.h>
+#include <sched.h>
 
 #include "rtree.h"
 #include "mempool.h"
+#include "threadpool.h"
+#include "estimator.h"
+#include "result_cache.h"
+#include "recorder.h"
+#include "trace.h"
 
 namespace cmpt740 {
 
-    long Rtree::global_lsn = 0;
-
-    Rtree::Rtree()
+#ifdef RTREE_STATS
+#define STAT_ADD(field, n) (StatsOfThread()->field += (n))
+    static __thread int stats_slot = -1;
+    static int stats_next_slot = 0;
+#else
+#define STAT_ADD(field, n)
+#endif
+
+    // Last leaf the thread inserted into and its lsn at the time. A
+    // leaf keeps its lsn until it splits, so an unchanged lsn means it
+    // still holds the records it was picked for.
+    struct InsertFinger {
+	uint64_t tree_id;
+	Rtree::RtreeNode* leaf;
+	uint64_t lsn;
+	uint64_t generation; // of the tree, see DeleteRange
+    };
+    static __thread InsertFinger insert_finger = { 0, NULL, 0, 0 };
+    static uint64_t next_tree_id = 0;
+
+    // Operation slot of the thread, taken once as with the stats slots
+    static __thread int op_slot = -1;
+    static int op_next_slot = 0;
+
+    Rtree::Rtree(const char* filename)
     {
-	root = new RtreeNode;
-	root->level = 0;
+	tree_lsn = 0;
+	tree_id = __sync_add_and_fetch(&next_tree_id, 1);
+	estimator = NULL;
+	cache = NULL;
+	recorder = NULL;
+#ifdef RTREE_BUFFERED
+	flush_pool = NULL;
+	flush_group = new TaskGroup;
+	moves_begun = 0;
+	moves_ended = 0;
+	move_holds = 0;
+#endif
+	op_slots = new OpSlot[RTREE_STATS_SLOTS];
+	for (int i = 0; i < RTREE_STATS_SLOTS; ++i) {
+	    op_slots[i].readers[0] = op_slots[i].readers[1] = 0;
+	    op_slots[i].writers = 0;
+	}
+	read_phase = 0;
+	holding = 0;
+	generation = 0;
+	pthread_mutex_init(&quiesce_lock, NULL);
+#ifdef RTREE_SNAPSHOT
+	epoch = 0;
+	oldest = (uint64_t)-1;
+	pinned = 0;
+	pthread_mutex_init(&sweep_lock, NULL);
+	pthread_mutex_init(&snapshot_lock, NULL);
+#endif
+#ifdef RTREE_STATS
+	stats = new StatsSlot[RTREE_STATS_SLOTS];
+	ResetStats();
+#endif
+#ifdef RTREE_LOCK_PROFILE
+	lock_waits = new LockWaitStats;
+	memset(lock_waits, 0, sizeof(LockWaitStats));
+#endif
+	root = NewNode(0);
 	root->offset = 0;
-	root->lsn = global_lsn;
-	mempool = new Mempool("rtree.dat");
+	root->lsn = tree_lsn;
+	mempool = (filename != NULL) ? new Mempool(filename) : NULL;
     }
 
     Rtree::~Rtree()
     {
+#ifdef RTREE_BUFFERED
+	if (flush_pool != NULL) // queued flushes still point at our nodes
+	    flush_pool->Wait(flush_group);
+	delete flush_group;
+#endif
 	Reset(); // Free, or reset node memory
+#ifdef RTREE_BUFFERED
+	for (size_t i = 0; i < unflushed.size(); ++i)
+	    FreeNode(unflushed[i]);
+#endif
 	delete mempool;
+#ifdef RTREE_SNAPSHOT
+	for (size_t i = 0; i < snapshots.size(); ++i)
+	    delete snapshots[i];
+	for (size_t i = 0; i < retired.size(); ++i)
+	    delete retired[i].image;
+	for (size_t i = 0; i < retired_nodes.size(); ++i) {
+	    for (size_t j = 0; j < retired_nodes[i].nodes.size(); ++j)
+		FreeNode(retired_nodes[i].nodes[j]);
+	}
+	pthread_mutex_destroy(&sweep_lock);
+	pthread_mutex_destroy(&snapshot_lock);
+#endif
+	delete[] op_slots;
+	pthread_mutex_destroy(&quiesce_lock);
+#ifdef RTREE_STATS
+	delete[] stats;
+#endif
+#ifdef RTREE_LOCK_PROFILE
+	delete lock_waits;
+#endif
+    }
+
+    // Hand out a new LSN. Splits on different nodes run concurrently, so
+    // the counter is bumped atomically.
+    uint64_t Rtree::NextLsn()
+    {
+	return __sync_add_and_fetch(&tree_lsn, 1);
+    }
+
+#ifdef RTREE_TIME_LOCK_WAITS
+    static uint64_t NowNs()
+    {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+#endif
+
+    // With RTREE_LOCK_PROFILE or RTREE_TRACE the lock is tried first, and
+    // only an acquisition that has to wait is timed.
+    void Rtree::ReadLock(RtreeNode* node)
+    {
+	STAT_ADD(read_locks, 1);
+#ifdef RTREE_TIME_LOCK_WAITS
+	if (node->tryrdlock())
+	    return;
+	uint64_t start = NowNs();
+	node->rdlock();
+	RecordLockWait(node, 0, start, NowNs());
+#else
+	node->rdlock();
+#endif
+    }
+
+    void Rtree::WriteLock(RtreeNode* node)
+    {
+	STAT_ADD(write_locks, 1);
+#ifdef RTREE_TIME_LOCK_WAITS
+	if (!node->trywrlock()) {
+	    uint64_t start = NowNs();
+	    node->wrlock();
+	    RecordLockWait(node, 1, start, NowNs());
+	}
+#else
+	node->wrlock();
+#endif
+#ifdef RTREE_SNAPSHOT
+	// The lock is taken to change the node: keep what the snapshots
+	// pinned since the last image see
+	if (pinned > 0 && node->image_epoch < epoch)
+	    SaveImage(node);
+#endif
+    }
+
+#ifdef RTREE_TIME_LOCK_WAITS
+    void Rtree::RecordLockWait(RtreeNode* node, int mode, uint64_t start,
+			       uint64_t end)
+    {
+	TRACE_COMPLETE(mode ? TRACE_WRITE_LOCK_WAIT : TRACE_READ_LOCK_WAIT,
+		       start, end, node->level);
+#ifdef RTREE_LOCK_PROFILE
+	uint64_t ns = end - start;
+	int level = node->level < RTREE_STATS_LEVELS ? node->level
+	    : RTREE_STATS_LEVELS - 1;
+	int bucket = 0;
+	while (bucket < LOCK_WAIT_BUCKETS - 1 && (ns >> bucket) != 0)
+	    ++bucket;
+	__sync_add_and_fetch(&lock_waits->waits[mode][level], 1);
+	__sync_add_and_fetch(&lock_waits->wait_ns[mode][level], ns);
+	__sync_add_and_fetch(&lock_waits->hist[mode][level][bucket], 1);
+	__sync_add_and_fetch(&node->lock_waits, 1);
+	__sync_add_and_fetch(&node->lock_wait_ns, ns);
+#endif
+    }
+#endif
+
+    Rtree::LockWaitStats Rtree::GetLockWaits()
+    {
+	LockWaitStats stats;
+#ifdef RTREE_LOCK_PROFILE
+	stats = *lock_waits;
+#else
+	memset(&stats, 0, sizeof(stats));
+#endif
+	return stats;
+    }
+
+#ifdef RTREE_LOCK_PROFILE
+    static bool CompareWaitTime(const Rtree::ContendedNode& a,
+				const Rtree::ContendedNode& b)
+    {
+	return a.wait_ns > b.wait_ns;
+    }
+#endif
+
+    // Walks the whole tree a level at a time under read locks, which are
+    // taken directly so the walk does not show up in the profile.
+    void Rtree::TopContendedNodes(std::vector<ContendedNode>& top, size_t n)
+    {
+	top.clear();
+#ifdef RTREE_LOCK_PROFILE
+	std::vector<RtreeNode*> level, next;
+	int phase = EnterRead();
+	level.push_back(root);
+	while (!level.empty()) {
+	    next.clear();
+	    for (size_t i = 0; i < level.size(); ++i) {
+		RtreeNode* node = level[i];
+		node->rdlock();
+		if (node->lock_waits > 0) {
+		    ContendedNode entry;
+		    entry.node = node;
+		    entry.level = node->level;
+		    entry.waits = node->lock_waits;
+		    entry.wait_ns = node->lock_wait_ns;
+		    top.push_back(entry);
+		}
+		if (node->IsInternalNode()) {
+		    for (uint32_t j = 0; j < node->count; ++j)
+			next.push_back(node->records[j].child);
+		}
+		node->unlock();
+	    }
+	    level.swap(next);
+	}
+	ExitRead(phase);
+	if (top.size() > n) {
+	    std::partial_sort(top.begin(), top.begin() + n, top.end(),
+			      CompareWaitTime);
+	    top.resize(n);
+	} else {
+	    std::sort(top.begin(), top.end(), CompareWaitTime);
+	}
+#endif
+    }
+
+    void Rtree::DumpLockProfile(size_t n)
+    {
+	static const char* modes[2] = { "read", "write" };
+	LockWaitStats stats = GetLockWaits();
+	for (int mode = 0; mode < 2; ++mode) {
+	    for (int level = 0; level < RTREE_STATS_LEVELS; ++level) {
+		uint64_t waits = stats.waits[mode][level];
+		if (waits == 0)
+		    continue;
+		std::cout << "---- " << modes[mode] << " level: " << level
+			  << ", waits: " << waits
+			  << ", avg ns: " << stats.wait_ns[mode][level] / waits
+			  << std::endl;
+		for (int b = 0; b < LOCK_WAIT_BUCKETS; ++b) {
+		    if (stats.hist[mode][level][b] != 0)
+			std::cout << "  < 2^" << b << " ns: "
+				  << stats.hist[mode][level][b] << std::endl;
+		}
+	    }
+	}
+	std::vector<ContendedNode> top;
+	TopContendedNodes(top, n);
+	for (size_t i = 0; i < top.size(); ++i) {
+	    std::cout << "node " << top[i].node << ", level: " << top[i].level
+		      << ", waits: " << top[i].waits
+		      << ", wait ns: " << top[i].wait_ns << std::endl;
+	}
+    }
+
+    // Per-node totals are only cleared on nodes still reachable from root
+    void Rtree::ResetLockProfile()
+    {
+#ifdef RTREE_LOCK_PROFILE
+	memset(lock_waits, 0, sizeof(LockWaitStats));
+	std::vector<RtreeNode*> level, next;
+	int phase = EnterRead();
+	level.push_back(root);
+	while (!level.empty()) {
+	    next.clear();
+	    for (size_t i = 0; i < level.size(); ++i) {
+		RtreeNode* node = level[i];
+		node->wrlock();
+		node->lock_waits = 0;
+		node->lock_wait_ns = 0;
+		if (node->IsInternalNode()) {
+		    for (uint32_t j = 0; j < node->count; ++j)
+			next.push_back(node->records[j].child);
+		}
+		node->unlock();
+	    }
+	    level.swap(next);
+	}
+	ExitRead(phase);
+#endif
+    }
+
+#ifdef RTREE_STATS
+    // Each thread takes a slot once and keeps it for every tree, so its
+    // counters stay in its own cache lines and need no atomic adds. Past
+    // RTREE_STATS_SLOTS threads slots are shared and counts may be lost.
+    Rtree::RtreeStats* Rtree::StatsOfThread()
+    {
+	if (stats_slot < 0) {
+	    stats_slot = __sync_fetch_and_add(&stats_next_slot, 1)
+		% RTREE_STATS_SLOTS;
+	}
+	return &stats[stats_slot].stats;
+    }
+#endif
+
+    Rtree::RtreeStats Rtree::GetStats()
+    {
+	RtreeStats total;
+	memset(&total, 0, sizeof(total));
+#ifdef RTREE_STATS
+	for (int i = 0; i < RTREE_STATS_SLOTS; ++i) {
+	    uint64_t* from = (uint64_t*)&stats[i].stats;
+	    uint64_t* to = (uint64_t*)&total;
+	    for (size_t j = 0; j < sizeof(RtreeStats) / sizeof(uint64_t); ++j)
+		to[j] += from[j];
+	}
+#endif
+	return total;
+    }
+
+    // Not atomic with respect to running operations: counts bumped while
+    // the reset is under way may survive it.
+    void Rtree::ResetStats()
+    {
+#ifdef RTREE_STATS
+	for (int i = 0; i < RTREE_STATS_SLOTS; ++i)
+	    memset(&stats[i].stats, 0, sizeof(RtreeStats));
+#endif
     }
 
     void Rtree::Reset()
@@ -51,9 +376,28 @@ namespace cmpt740 {
 	RemoveAllRec(root);
     }
 
+    // Leaves carry only their records; internal nodes are RtreeBranch.
+    // A node never changes level, so the layout it is made with holds.
+    Rtree::RtreeNode* Rtree::NewNode(int32_t level)
+    {
+	RtreeNode* node = (level > 0) ? new RtreeBranch : new RtreeNode;
+	node->level = level;
+	return node;
+    }
+
     void Rtree::FreeNode(RtreeNode* node)
     {
-	delete node;
+#ifdef RTREE_SNAPSHOT
+	while (node->images != NULL) {
+	    RtreeNodeImage* image = node->images;
+	    node->images = image->next;
+	    delete image;
+	}
+#endif
+	if (node->IsInternalNode())
+	    delete Branch(node);
+	else
+	    delete node;
     }
 
     void Rtree::RemoveAllRec(RtreeNode* node)
@@ -69,11 +413,15 @@ namespace cmpt740 {
 
     long Rtree::SaveNode(RtreeNode* node)
     {
+	if (mempool == NULL)
+	    return -1;
 	return mempool->SaveRtreeNode(node);
     }
 
     Rtree::RtreeNode* Rtree::LoadNode(long offset)
     {
+	if (mempool == NULL)
+	    return NULL;
 	return mempool->LoadRtreeNode(offset);
     }
 
@@ -92,55 +440,180 @@ namespace cmpt740 {
 
 	record.data = data;
 
+	STAT_ADD(inserts, 1);
+	TRACE_BEGIN(TRACE_INSERT, 0);
+	uint64_t start = (recorder != NULL) ? OpRecorder::Now() : 0;
+	EnterWrite();
+#ifdef RTREE_BUFFERED
+	ret = BufferRecord(&record);
+#else
 	ret = InsertRecord(&record, &root);
+#endif
+	ExitWrite();
+	if (ret && estimator != NULL)
+	    estimator->Add(&record.rect);
+	if (recorder != NULL)
+	    recorder->Record(OpRecorder::OP_INSERT, &record.rect, data, start,
+			     ret);
+	TRACE_END(TRACE_INSERT);
 	//	SaveNode(root);
 	return ret;
     }
 
+#ifdef RTREE_AGGREGATE
+    bool Rtree::Insert(uint32_t min[DIMENSION],
+		       uint32_t max[DIMENSION],
+		       data_t* data, uint64_t weight)
+    {
+	RtreeRecord record;
+
+	for (int i = 0; i < DIMENSION; ++i) {
+	    record.rect.max[i] = max[i];
+	    record.rect.min[i] = min[i];
+	}
+
+	record.data = data;
+	record.agg_sum = weight;
+
+	STAT_ADD(inserts, 1);
+	TRACE_BEGIN(TRACE_INSERT, 0);
+	uint64_t start = (recorder != NULL) ? OpRecorder::Now() : 0;
+	EnterWrite();
+	bool ret = InsertRecord(&record, &root);
+	ExitWrite();
+	if (ret && estimator != NULL)
+	    estimator->Add(&record.rect);
+	if (recorder != NULL) // the weight is not recorded
+	    recorder->Record(OpRecorder::OP_INSERT, &record.rect, data, start,
+			     ret);
+	TRACE_END(TRACE_INSERT);
+	return ret;
+    }
+#endif
+
     // Insert a record
     bool Rtree::InsertRecord(RtreeRecord* record, RtreeNode** root)
     {
         uint64_t lsn;
-	lsn = (*root)->lsn;
-
-	RtreeNode* leaf = FindLeaf(*root, record, lsn);
-	if (leaf == NULL)
-	    return false;
+	RtreeNode* leaf = FingerLeaf(record);
+#ifdef RTREE_PREENLARGE
+	// Aggregates change on every insert and still climb afterwards
+#ifdef RTREE_AGGREGATE
+	bool covered = false;
+#else
+	bool covered = (leaf == NULL);
+#endif
+	RtreeNode* grown = NULL;
+#endif
+	if (leaf == NULL) {
+	    RtreeNode* top = *root; // read once, the root may grow meanwhile
+	    lsn = top->lsn;
+#ifdef RTREE_PREENLARGE
+	    leaf = FindLeafEnlarging(top, record, lsn, &covered);
+	    if (*root != top)
+		grown = top;
+#else
+	    leaf = FindLeaf(top, record, lsn);
+#endif
+	    if (leaf == NULL)
+		return false;
+	}
 	RtreeRect rect = NodeCover(leaf);
 	RtreeNode* newNode;
-	bool ret = AddRecord(record, leaf, &newNode);
+	bool ret = AddRecord(record, 0, leaf, &newNode);
 	//	SaveNode(node);
 	if (ret == true) { // leaf node was split
+	    // Follow the record into the half it went to
+	    RtreeRect cover = NodeCover(leaf);
+	    SetFinger(Inside(&record->rect, &cover) ? leaf : leaf->sibling);
 	    ExternParent(leaf, leaf->lsn, leaf->sibling, leaf->sibling->lsn);
 	} else {
+	    SetFinger(leaf);
 	    RtreeRect rect2 = NodeCover(leaf);
-	    if (isRectCoverChanged(&rect, &rect2)) { // bounding rect changed
+#ifdef RTREE_PREENLARGE
+	    if (covered) { // the parents grew on the way down
+		leaf->unlock();
+	    } else
+#endif
+	    if (ParentNeedsUpdate(&rect, &rect2)) { // bounding rect changed
 		UpdateParent(leaf, rect2);
 	    } else {
 		leaf->unlock();
 	    }
 	}
+#ifdef RTREE_PREENLARGE
+	if (grown != NULL) {
+	    // The root grew while we descended. If it did before top was
+	    // locked, the new root covers top without what the descent
+	    // grew there, and nothing above top knows of it yet.
+	    WriteLock(grown);
+	    UpdateParent(grown, NodeCover(grown));
+	}
+#endif
 	return true;
     }
 
+    // The thread's last leaf, write-locked, if record can go straight
+    // there: the leaf has not split since, and either covers record
+    // already or grows by no more than the average gap between its
+    // entries along any axis, as the next record of a local stream
+    // does. NULL means descend from the root. A grown cover reaches the
+    // parents through UpdateParent, as after a descent.
+    Rtree::RtreeNode* Rtree::FingerLeaf(RtreeRecord* record)
+    {
+	if (insert_finger.tree_id != tree_id ||
+	    insert_finger.generation != generation)
+	    return NULL;
+	RtreeNode* leaf = insert_finger.leaf;
+	WriteLock(leaf);
+	if (leaf->lsn == insert_finger.lsn && leaf->count > 1) {
+	    RtreeRect cover = NodeCover(leaf);
+	    RtreeRect grown = CombineRect(&cover, &record->rect);
+	    bool near = true;
+	    for (int i = 0; i < DIMENSION && near; ++i) {
+		uint32_t growth = (grown.max[i] - cover.max[i])
+		    + (cover.min[i] - grown.min[i]);
+		near = (growth <= (cover.max[i] - cover.min[i])
+			/ (leaf->count - 1));
+	    }
+	    if (near) {
+		STAT_ADD(finger_inserts, 1);
+		return leaf;
+	    }
+	}
+	leaf->unlock();
+	return NULL;
+    }
+
+    // Caller holds the write lock of leaf
+    void Rtree::SetFinger(RtreeNode* leaf)
+    {
+	insert_finger.tree_id = tree_id;
+	insert_finger.leaf = leaf;
+	insert_finger.lsn = leaf->lsn;
+	insert_finger.generation = generation;
+    }
+
     Rtree::RtreeNode* Rtree::FindLeaf(RtreeNode* node, RtreeRecord* record,
 				      uint64_t lsn)
     {
 	if (node->level == 0) {
-	    node->wrlock();
+	    WriteLock(node);
 	} else {
-	    node->rdlock();
+	    ReadLock(node);
 	}
 
 	while (node != NULL && lsn != node->lsn) {
+	    STAT_ADD(sibling_chases, 1);
+	    TRACE_INSTANT(TRACE_SIBLING_CHASE, node->level);
 	    RtreeNode* prev = node;
 	    node = node->sibling;
 	    prev->unlock();
 	    if (node != NULL) {
 		if (node->level == 0) {
-		    node->wrlock();
+		    WriteLock(node);
 		} else {
-		    node->rdlock();
+		    ReadLock(node);
 		}
 	    } else {
 		return NULL;
@@ -153,37 +626,113 @@ namespace cmpt740 {
 	    return node;
 	} else {
 	    int index = PickRecord(&record->rect, node);
-	    lsn = node->records[index].child->lsn;
+	    RtreeNode* child = node->records[index].child;
+	    lsn = child->lsn;
 	    node->unlock();
-	    return FindLeaf(node->records[index].child, record, lsn);
+	    return FindLeaf(child, record, lsn);
 	}
 	return node;
     }
 
+#ifdef RTREE_PREENLARGE
+    // FindLeaf that grows each parent record to cover record before
+    // descending, so that the insert needs no UpdateParent afterwards.
+    // An internal node is read-locked first and relocked for writing only
+    // when its chosen record must grow; as rwlocks cannot be upgraded the
+    // node may split in between, so the lsn is checked again and the
+    // choice made afresh. The child's lsn is taken from the parent record
+    // rather than the child: a child that split but is not yet extended
+    // into its parent then shows a mismatch, and the walk to the right
+    // clears *covered, since the records grown above may belong to the
+    // other half. With *covered clear nothing more is grown and the
+    // caller falls back to UpdateParent.
+    Rtree::RtreeNode* Rtree::FindLeafEnlarging(RtreeNode* node,
+					       RtreeRecord* record,
+					       uint64_t lsn, bool* covered)
+    {
+	bool write = (node->level == 0);
+	int index;
+	for (;;) {
+	    if (write) {
+		WriteLock(node);
+	    } else {
+		ReadLock(node);
+	    }
+	    while (node != NULL && lsn != node->lsn) {
+		STAT_ADD(sibling_chases, 1);
+		TRACE_INSTANT(TRACE_SIBLING_CHASE, node->level);
+		*covered = false;
+		RtreeNode* prev = node;
+		node = node->sibling;
+		prev->unlock();
+		if (node == NULL)
+		    return NULL;
+		if (write) {
+		    WriteLock(node);
+		} else {
+		    ReadLock(node);
+		}
+	    }
+	    if (node->level == 0)
+		return node;
+
+	    index = PickRecord(&record->rect, node);
+	    if (!*covered || Inside(&record->rect, &node->records[index].rect))
+		break;
+	    if (write) {
+		RtreeRecord* parent = &node->records[index];
+		parent->rect = CombineRect(&parent->rect, &record->rect);
+		TouchNode(node);
+#ifdef RTREE_QUANTIZE_BITS
+		QuantizeNode(node);
+#endif
+		STAT_ADD(enlarge_down, 1);
+		break;
+	    }
+	    node->unlock();
+	    write = true;
+	}
+
+	RtreeNode* child = node->records[index].child;
+	lsn = Branch(node)->lsns[index];
+	node->unlock();
+	return FindLeafEnlarging(child, record, lsn, covered);
+    }
+#endif
+
     void Rtree::ExternParent(RtreeNode* p, uint64_t p_lsn,
 			     RtreeNode* q, uint64_t q_lsn)
     {
+	STAT_ADD(extern_parent, 1);
 	if (q->parent == NULL) {
 	    RtreeRecord newRecord;
-	    RtreeNode* newRoot = new RtreeNode;
-	    newRoot->wrlock();
-	    newRoot->level = q->level + 1;
-	    newRoot->lsn = ++global_lsn;
+	    RtreeNode* newRoot = NewNode(q->level + 1);
+#ifdef RTREE_SNAPSHOT
+	    newRoot->image_epoch = epoch; // no snapshot has seen it
+#endif
+	    WriteLock(newRoot);
+	    newRoot->lsn = NextLsn();
 	    //	    newRoot->offset = 0;
 	    newRecord.rect = NodeCover(p);
 	    newRecord.child = p;
-            newRecord.lsn = p_lsn;
+#ifdef RTREE_AGGREGATE
+	    AggregateNode(p, &newRecord);
+#endif
 	    //	    p->offset = -1;
 	    //	    newRecord.offset = SaveNode(*root);
-	    AddRecord(&newRecord, newRoot, NULL);
+	    AddRecord(&newRecord, p_lsn, newRoot, NULL);
 
 	    newRecord.rect = NodeCover(q);
 	    newRecord.child = q;
-            newRecord.lsn = q_lsn;
+#ifdef RTREE_AGGREGATE
+	    AggregateNode(q, &newRecord);
+#endif
 	    //	    newRecord.offset = SaveNode(newNode);
-	    AddRecord(&newRecord, newRoot, NULL);
+	    AddRecord(&newRecord, q_lsn, newRoot, NULL);
 
 	    root = newRoot;
+	    STAT_ADD(root_changes, 1);
+	    TRACE_INSTANT(TRACE_ROOT_GROWTH, newRoot->level);
 
 	    p->parent = root;
 	    q->parent = root;
@@ -195,7 +744,7 @@ namespace cmpt740 {
 	    RtreeNode* parent = q->parent;
 	    RtreeRecord* record = NULL;
 	    while (parent != NULL) {
-		parent->wrlock();
+		WriteLock(parent);
 		for (uint32_t i = 0; i < parent->count; ++i) {
 		    if (parent->records[i].child == p) {
 			record = &parent->records[i];
@@ -208,18 +757,22 @@ namespace cmpt740 {
 	    }
 	found:
 	    p->parent = parent;
+	    q->parent = parent;
 
 	    assert(record != NULL);
-	    record->lsn = p_lsn;
+	    RtreeRect rect = NodeCover(parent); // cover before any change
+	    Branch(parent)->lsns[record - parent->records] = p_lsn;
 	    record->rect = NodeCover(p);
-	    RtreeRect rect = NodeCover(parent);
 	    RtreeRecord newRecord;
-	    newRecord.lsn = q_lsn;
 	    newRecord.rect = NodeCover(q);
 	    newRecord.child = q;
+#ifdef RTREE_AGGREGATE
+	    AggregateNode(p, record);
+	    AggregateNode(q, &newRecord);
+#endif
 
 	    RtreeNode* newNode;
-	    bool ret = AddRecord(&newRecord, parent, &newNode);
+	    bool ret = AddRecord(&newRecord, q_lsn, parent, &newNode);
 
 	    if (ret == true) {
 		q->unlock();
@@ -232,7 +785,7 @@ namespace cmpt740 {
 		q->unlock();
 		p->unlock();
 		RtreeRect rect2 = NodeCover(parent);
-		if (isRectCoverChanged(&rect, &rect2)) {// bounding rect changed
+		if (ParentNeedsUpdate(&rect, &rect2)) {// bounding rect changed
 		    UpdateParent(parent, rect2);
 		} else {
 		    parent->unlock();
@@ -243,13 +796,16 @@ namespace cmpt740 {
 
     void Rtree::UpdateParent(RtreeNode* node, RtreeRect rect)
     {
+	STAT_ADD(update_parent, 1);
 	if (node->parent == NULL) {
 	    node->unlock();
 	} else {
+	    // node stays locked until its record is set, as in ExternParent:
+	    // a split of node meanwhile would bring its new lsn and cover
+	    // here before the record of the node split off
 	    RtreeNode* parent = node->parent;
 	    assert(parent != NULL);
-	    node->unlock();
-            parent->wrlock();
+	    WriteLock(parent);
 	    RtreeRecord* record = NULL;
 	    while (parent != NULL) {
 		for (uint32_t i = 0; i < parent->count; ++i) {
@@ -262,13 +818,37 @@ namespace cmpt740 {
 		parent = parent->sibling;
 		assert(parent != NULL);
 		prev->unlock();
-                parent->wrlock();
+		WriteLock(parent);
 	    }
 	found:
-	    record->lsn = node->lsn;
+	    // The hint lags while parent splits before it is locked; it is
+	    // exact again once set here. The record's lsn stays as
+	    // ExternParent set it, node has not split since.
+	    node->parent = parent;
+	    rect = NodeCover(parent);
+#ifdef RTREE_PREENLARGE
+	    // Only ever grow: an exact cover could drop the room an insert
+	    // still descending below has claimed. Parent rectangles then
+	    // shrink only when their node splits.
+	    if (node->count > 0) {
+		RtreeRect cover = NodeCover(node);
+		record->rect = CombineRect(&record->rect, &cover);
+	    }
+#else
 	    record->rect = NodeCover(node);
+#endif
+#ifdef RTREE_AGGREGATE
+	    AggregateNode(node, record);
+#endif
+	    node->unlock();
+	    TouchNode(parent);
+#ifdef RTREE_QUANTIZE_BITS
+	    QuantizeNode(parent);
+#endif
 	    RtreeRect rect2 = NodeCover(parent);
-	    if (isRectCoverChanged(&rect, &rect2)) { // bounding rect changed
+	    // Compare the parent's own cover before and after; comparing it
+	    // with the child's cover could stop while the parent still grew.
+	    if (ParentNeedsUpdate(&rect, &rect2)) { // bounding rect changed
 		UpdateParent(parent, rect2);
 	    } else {
 		 parent->unlock();
@@ -276,10 +856,11 @@ namespace cmpt740 {
 	}
     }
 
+    // The level is left alone: searches read it without the node lock
+    // to tell leaves from internal nodes, also while the node splits.
     void Rtree::InitNode(RtreeNode* node)
     {
 	node->count = 0;
-	node->level = -1;
     }
 
     void Rtree::InitRect(RtreeRect* rect)
@@ -305,9 +886,29 @@ namespace cmpt740 {
 		rect = CombineRect(&rect, &(node->records[index].rect));
 	    }
 	}
+#ifdef RTREE_BUFFERED
+	if (node->IsInternalNode()) {
+	    std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+	    for (size_t index = 0; index < buffer.size(); ++index) {
+		if (firstTime) {
+		    rect = buffer[index].rect;
+		    firstTime = false;
+		} else {
+		    rect = CombineRect(&rect, &buffer[index].rect);
+		}
+	    }
+	}
+#endif
 	return rect;
     }
 
+    // Record that a node's records changed, so cached query results that
+    // read it are dropped. Caller holds the node's write lock.
+    void Rtree::TouchNode(RtreeNode* node)
+    {
+	__sync_add_and_fetch(&node->version, 1);
+    }
+
     bool Rtree::isRectCoverChanged(RtreeRect* rectA, RtreeRect* rectB)
     {
 	for (int i = 0; i < DIMENSION; ++i) {
@@ -319,19 +920,51 @@ namespace cmpt740 {
 	return false;
     }
 
+    // Whether a change to a node, whose cover went from rectA to rectB,
+    // must be carried into the parent's record for it. Subtree aggregates
+    // change on every insert and delete, covers only when they move.
+    bool Rtree::ParentNeedsUpdate(RtreeRect* rectA, RtreeRect* rectB)
+    {
+#ifdef RTREE_AGGREGATE
+	return true;
+#else
+	return isRectCoverChanged(rectA, rectB);
+#endif
+    }
+
+#ifdef RTREE_AGGREGATE
+    // Store the totals of a node's records into the record pointing at it.
+    void Rtree::AggregateNode(RtreeNode* node, RtreeRecord* record)
+    {
+	record->agg_count = 0;
+	record->agg_sum = 0;
+	for (uint32_t index = 0; index < node->count; ++index) {
+	    record->agg_count += node->records[index].agg_count;
+	    record->agg_sum += node->records[index].agg_sum;
+	}
+    }
+#endif
+
     // Add a branch to a node.  Split the node if necessary.
     // Returns 0 if node not split.  Old node updated.
     // Returns 1 if node split, sets *new_node to address of new node.
     // Old node updated, becomes one of two.
-    bool Rtree::AddRecord(RtreeRecord* record, RtreeNode* node,
+    // lsn is the child's, kept by internal nodes only; leaves ignore it.
+    bool Rtree::AddRecord(RtreeRecord* record, uint64_t lsn, RtreeNode* node,
 			  RtreeNode** newNode )
     {
 	if (node->count < MAX_REC_NUM_PER_NODE) { // Split won't be necessary
 	    node->records[node->count] = *record;
+	    if (node->IsInternalNode())
+		Branch(node)->lsns[node->count] = lsn;
 	    node->count++;
+	    TouchNode(node);
+#ifdef RTREE_QUANTIZE_BITS
+	    QuantizeNode(node);
+#endif
 	    return false;
 	} else {
-	    SplitNode(node, record, newNode);
+	    SplitNode(node, record, lsn, newNode);
 	    return true;
 	}
     }
@@ -382,7 +1015,7 @@ namespace cmpt740 {
     // Divides the nodes branches and the extra one between two nodes.
     // Old node is one of the new ones, and one really new one is created.
     // Tries more than one method for choosing a partition, uses best result.
-    void Rtree::SplitNode(RtreeNode* node, RtreeRecord* record,
+    void Rtree::SplitNode(RtreeNode* node, RtreeRecord* record, uint64_t lsn,
 			  RtreeNode** newNode)
     {
 	PartitionVars localVars;
@@ -391,22 +1024,44 @@ namespace cmpt740 {
 
 	// Load all the branches into a buffer, initialize old node
 	level = node->level;
-	GetRecords(node, record, parVars);
+	STAT_ADD(splits[level < RTREE_STATS_LEVELS ? level
+			: RTREE_STATS_LEVELS - 1], 1);
+	TRACE_BEGIN(TRACE_SPLIT, level);
+	GetRecords(node, record, lsn, parVars);
 
 	// Find partition
 	ChoosePartition(parVars, MIN_REC_NUM_PER_NODE);
 
 	// Put branches from buffer into 2 nodes according to chosen partition
-	*newNode = new RtreeNode;
-	(*newNode)->level = node->level = level;
+	*newNode = NewNode(level);
 	(*newNode)->lsn = node->lsn;
-	node->lsn = ++global_lsn;
-	(*newNode)->wrlock();
+	node->lsn = NextLsn();
+#ifdef RTREE_SNAPSHOT
+	(*newNode)->image_epoch = epoch; // no snapshot has seen it
+#endif
+	WriteLock(*newNode);
 	LoadNodes(node, *newNode, parVars);
+	// Parent hints stay exact: the nodes DeleteRange drops are freed,
+	// and a hint lagging to the left could lead to one
+	if (level > 0) {
+	    for (uint32_t i = 0; i < (*newNode)->count; ++i)
+		(*newNode)->records[i].child->parent = *newNode;
+	}
 	(*newNode)->sibling = node->sibling;
 	(*newNode)->parent = node->parent;
 	node->sibling = *newNode;
 	node->parent = NULL;
+#ifdef RTREE_BUFFERED
+	if (level > 0)
+	    SplitBuffer(node, *newNode);
+#endif
+	TouchNode(node);
+	TouchNode(*newNode);
+#ifdef RTREE_QUANTIZE_BITS
+	QuantizeNode(node);
+	QuantizeNode(*newNode);
+#endif
+	TRACE_END(TRACE_SPLIT);
 	//	(*newNode)->unlock();
 	//	SaveNode(*newNode);
     }
@@ -424,7 +1079,7 @@ namespace cmpt740 {
     }
 
     // Load branch buffer with branches from full node plus the extra branch.
-    void Rtree::GetRecords(RtreeNode* node, RtreeRecord* record,
+    void Rtree::GetRecords(RtreeNode* node, RtreeRecord* record, uint64_t lsn,
 			   PartitionVars* parVars)
     {
 	int index;
@@ -433,6 +1088,12 @@ namespace cmpt740 {
 	    parVars->recordBuf[index] = node->records[index];
 	}
 	parVars->recordBuf[MAX_REC_NUM_PER_NODE] = *record;
+	if (node->IsInternalNode()) {
+	    for (index = 0; index < MAX_REC_NUM_PER_NODE; ++index) {
+		parVars->lsnBuf[index] = Branch(node)->lsns[index];
+	    }
+	    parVars->lsnBuf[MAX_REC_NUM_PER_NODE] = lsn;
+	}
 	parVars->recordCount = MAX_REC_NUM_PER_NODE + 1;
 
 	// Calculate rect containing all in the set
@@ -519,10 +1180,12 @@ namespace cmpt740 {
     {
 	for (int index = 0; index < parVars->total; ++index) {
 	    if (parVars->partition[index] == 0) {
-		AddRecord(&parVars->recordBuf[index], nodeA, NULL);
+		AddRecord(&parVars->recordBuf[index], parVars->lsnBuf[index],
+			  nodeA, NULL);
 	    }
 	    else if (parVars->partition[index] == 1) {
-		AddRecord(&parVars->recordBuf[index], nodeB, NULL);
+		AddRecord(&parVars->recordBuf[index], parVars->lsnBuf[index],
+			  nodeB, NULL);
 	    }
 	}
     }
@@ -543,7 +1206,9 @@ namespace cmpt740 {
 
     void Rtree::PickSeeds(PartitionVars* parVars)
     {
-	int seed0 = 0, seed1 = 0;
+	// Distinct even if no pair beats worst, as when volumes of large
+	// rects wrap around: a record classified twice is lost in the split
+	int seed0 = 0, seed1 = 1;
 	int64_t worst, waste;
 	int64_t area[MAX_REC_NUM_PER_NODE+1];
 
@@ -596,27 +1261,54 @@ namespace cmpt740 {
 
 	record.data = data;
 
-	DeleteRecord(&record, &root);
-	return false;
+	STAT_ADD(deletes, 1);
+	TRACE_BEGIN(TRACE_DELETE, 0);
+	uint64_t start = (recorder != NULL) ? OpRecorder::Now() : 0;
+	EnterWrite();
+#ifdef RTREE_BUFFERED
+	// Nothing moves between levels meanwhile, so the record is found
+	// wherever it is
+	HoldMoves();
+	bool ret = DeleteBuffered(&record);
+	if (DeleteRecord(&record, &root))
+	    ret = true;
+	ReleaseMoves();
+#else
+	bool ret = DeleteRecord(&record, &root);
+#endif
+	ExitWrite();
+	if (recorder != NULL)
+	    recorder->Record(OpRecorder::OP_DELETE, &record.rect, data, start,
+			     ret);
+	TRACE_END(TRACE_DELETE);
+	return ret;
     }
 
     bool Rtree::DeleteRecord(RtreeRecord* record, RtreeNode** node)
     {
 	bool ret = false;
 
-	RtreeNode* leaf = FindLeaf(*node, record, (*node)->lsn);
+	RtreeNode* top = *node; // read once, the root may grow meanwhile
+	RtreeNode* leaf = FindLeaf(top, record, top->lsn);
+	if (leaf == NULL)
+	    return false;
 	RtreeRect rect = NodeCover(leaf);
 
-	for (uint32_t index = 0; index < leaf->count; ++index) {
+	for (uint32_t index = 0; index < leaf->count; ) {
 	    if (Overlap(&record->rect, &(leaf->records[index].rect))) {
+		if (estimator != NULL)
+		    estimator->Remove(&leaf->records[index].rect);
+		// The last record moves into index, look at it next
 		DisconnectRecord(leaf, index);
 		ret = true;
+	    } else {
+		++index;
 	    }
 	}
 
 	RtreeRect rect2 = NodeCover(leaf);
 
-	if (isRectCoverChanged(&rect, &rect2)) { // bounding rect changed
+	if (ParentNeedsUpdate(&rect, &rect2)) { // bounding rect changed
 	    UpdateParent(leaf, rect2);
 	} else {
 	    leaf->unlock();
@@ -631,7 +1323,10 @@ namespace cmpt740 {
     {
 	// Remove element by swapping with the last element to prevent gaps
 	node->records[index] = node->records[node->count - 1];
+	if (node->IsInternalNode())
+	    Branch(node)->lsns[index] = Branch(node)->lsns[node->count - 1];
 	--node->count;
+	TouchNode(node);
     }
 
     // Decide whether two rectangles overlap.
@@ -646,6 +1341,85 @@ namespace cmpt740 {
 	return true;
     }
 
+    // Decide whether rectA is inside rectB.
+    bool Rtree::Inside(RtreeRect* rectA, RtreeRect* rectB)
+    {
+	for (int index = 0; index < DIMENSION; ++index) {
+	    if (rectA->min[index] < rectB->min[index] ||
+		rectA->max[index] > rectB->max[index]) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+#ifdef RTREE_QUANTIZE_BITS
+    // Rebuild the quantized child rectangles of an internal node.
+    // Each rectangle is rounded outward, so a quantized overlap test never
+    // drops a child that really overlaps. Caller holds the node's write lock.
+    void Rtree::QuantizeNode(RtreeNode* node)
+    {
+	if (node->IsLeaf() || node->count == 0)
+	    return;
+	RtreeBranch* branch = Branch(node);
+	branch->qcover = NodeCover(node);
+	for (int index = 0; index < DIMENSION; ++index) {
+	    uint64_t base = branch->qcover.min[index];
+	    uint64_t width = branch->qcover.max[index] - base;
+	    for (uint32_t i = 0; i < node->count; ++i) {
+		RtreeRect* rect = &node->records[i].rect;
+		if (width == 0) {
+		    branch->qrects[i].min[index] = 0;
+		    branch->qrects[i].max[index] = 0;
+		    continue;
+		}
+		// floor for min, ceil for max
+		branch->qrects[i].min[index] =
+		    ((rect->min[index] - base) * QUANTIZE_MAX) / width;
+		branch->qrects[i].max[index] =
+		    ((rect->max[index] - base) * QUANTIZE_MAX + width - 1) / width;
+	    }
+	}
+    }
+
+    // Map a query rectangle into the frame of a node's quantized rects.
+    // The query is rounded inward, which keeps QOverlap conservative: a
+    // child that overlaps the query still overlaps after quantization.
+    // Returns false if the query misses the node's cover entirely.
+    bool Rtree::QuantizeQuery(RtreeRect* rect, RtreeNode* node,
+			      RtreeQRect* qrect)
+    {
+	RtreeBranch* branch = Branch(node);
+	if (!Overlap(rect, &branch->qcover))
+	    return false;
+	for (int index = 0; index < DIMENSION; ++index) {
+	    uint64_t base = branch->qcover.min[index];
+	    uint64_t width = branch->qcover.max[index] - base;
+	    if (width == 0) {
+		qrect->min[index] = 0;
+		qrect->max[index] = 0;
+		continue;
+	    }
+	    uint64_t lo = std::max(rect->min[index], branch->qcover.min[index]);
+	    uint64_t hi = std::min(rect->max[index], branch->qcover.max[index]);
+	    qrect->min[index] = ((lo - base) * QUANTIZE_MAX + width - 1) / width;
+	    qrect->max[index] = ((hi - base) * QUANTIZE_MAX) / width;
+	}
+	return true;
+    }
+
+    bool Rtree::QOverlap(RtreeQRect* rectA, RtreeQRect* rectB)
+    {
+	for (int index = 0; index < DIMENSION; ++index) {
+	    if (rectA->min[index] > rectB->max[index] ||
+		rectB->min[index] > rectA->max[index]) {
+		return false;
+	    }
+	}
+	return true;
+    }
+#endif
+
     // Search
     std::vector<Rtree::RtreeRecord> Rtree::Search(uint32_t min[DIMENSION],
 						  uint32_t max[DIMENSION])
@@ -659,19 +1433,72 @@ namespace cmpt740 {
 
 	record.data = NULL;
 
-	return SearchRecord(&record);
+	STAT_ADD(searches, 1);
+	TRACE_BEGIN(TRACE_SEARCH, 0);
+	uint64_t start = (recorder != NULL) ? OpRecorder::Now() : 0;
+	std::vector<Rtree::RtreeRecord> results;
+	// Also a cached entry is checked against nodes DeleteRange may free
+	int phase = EnterRead();
+	if (cache == NULL) {
+	    results = SearchRecord(&record, NULL);
+	} else {
+	    uint64_t gen = generation;
+	    __sync_synchronize(); // before any node is read
+	    if (!cache->Lookup(tree_id, gen, &record.rect, results)) {
+		std::vector<RtreeNodeVersion> deps;
+		results = SearchRecord(&record, &deps);
+		cache->Insert(tree_id, gen, &record.rect, results, deps);
+	    }
+	}
+	ExitRead(phase);
+	if (recorder != NULL)
+	    recorder->Record(OpRecorder::OP_SEARCH, &record.rect, NULL, start,
+			     results.size());
+	TRACE_END(TRACE_SEARCH);
+	return results;
+    }
+
+    void Rtree::AttachResultCache(ResultCache* cache)
+    {
+	this->cache = cache;
     }
 
-    std::vector<Rtree::RtreeRecord> Rtree::SearchRecord(RtreeRecord* record)
+    // deps, if given, receives every node read and its version, parents
+    // before children.
+    std::vector<Rtree::RtreeRecord> Rtree::SearchRecord(RtreeRecord* record,
+							std::vector<RtreeNodeVersion>* deps)
     {
 	std::vector<Rtree::RtreeRecord> results;
+#ifdef RTREE_BUFFERED
+	uint64_t moves;
+	bool held = StartBufferedRead(&moves);
+#endif
+	SearchRecordInTree(record, results, deps);
+#ifdef RTREE_BUFFERED
+	while (RetryBufferedRead(moves, &held)) {
+	    results.clear();
+	    if (deps != NULL)
+		deps->clear();
+	    SearchRecordInTree(record, results, deps);
+	}
+#endif
+	return results;
+    }
+
+    void Rtree::SearchRecordInTree(RtreeRecord* record,
+				   std::vector<RtreeRecord>& results,
+				   std::vector<RtreeNodeVersion>* deps)
+    {
 	std::stack<Rtree::RtreeNodeLSN*> stk;
 	Rtree::RtreeNodeLSN* nodelsn = new Rtree::RtreeNodeLSN;
-	nodelsn->node = root;
-	nodelsn->lsn = root->lsn;
+	nodelsn->node = root; // read once, the root may grow meanwhile
+	nodelsn->lsn = nodelsn->node->lsn;
 	stk.push(nodelsn);
-	SearchRecordInNode(record, stk, results);
-	return results;
+	SearchRecordInNode(record, stk, results, deps);
+	while (!stk.empty()) { // left over after an early return
+	    delete stk.top();
+	    stk.pop();
+	}
     }
 
     // // Range query version
@@ -722,13 +1549,23 @@ namespace cmpt740 {
     // Point query version
     void Rtree::SearchRecordInNode(RtreeRecord* record,
     				   std::stack<Rtree::RtreeNodeLSN*>& stk,
-    				   std::vector<Rtree::RtreeRecord>& results)
+				   std::vector<Rtree::RtreeRecord>& results,
+				   std::vector<RtreeNodeVersion>* deps)
     {
+	RtreeNodeVersion dep;
 	while (!stk.empty()) {
     	    Rtree::RtreeNodeLSN* nodelsn = stk.top();
     	    stk.pop();
     	    Rtree::RtreeNode* node = nodelsn->node;
+	    uint64_t lsn = nodelsn->lsn;
+	    delete nodelsn;
+	    STAT_ADD(search_nodes, 1);
     	    if (node->level == 0) { // leaf node
+		if (deps != NULL) { // version first, then the records
+		    dep.node = node;
+		    dep.version = *(volatile uint64_t*)&node->version;
+		    deps->push_back(dep);
+		}
     	    	for(uint32_t index=0; index < node->count; ++index) {
     	    	    if(Overlap(&record->rect, &(node->records[index].rect))) {
     	    		results.push_back(node->records[index]);
@@ -737,21 +1574,48 @@ namespace cmpt740 {
     	    	}
     	    	continue;
     	    }
-    	    node->rdlock();
-    	    uint64_t lsn = nodelsn->lsn;
+	    ReadLock(node);
     	    while (node != NULL && lsn != node->lsn) {
+		STAT_ADD(sibling_chases, 1);
+		TRACE_INSTANT(TRACE_SIBLING_CHASE, node->level);
     	    	RtreeNode* prev = node;
     	    	node = node->sibling;
     	    	assert(node != NULL);
     	    	prev->unlock();
-    	    	node->rdlock();
+		ReadLock(node);
     	    	Rtree::RtreeNodeLSN* nl = new Rtree::RtreeNodeLSN;
     	    	nl->node = node;
     	    	nl->lsn = node->lsn;
     	    	stk.push(nl);
     	    }
+	    if (deps != NULL) {
+		dep.node = node;
+		dep.version = node->version;
+		deps->push_back(dep);
+	    }
+#ifdef RTREE_BUFFERED
+	    std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+	    for (size_t index = 0; index < buffer.size(); ++index) {
+		if (Overlap(&record->rect, &buffer[index].rect)) {
+		    results.push_back(buffer[index]);
+		    node->unlock();
+		    return;
+		}
+	    }
+#endif
+#ifdef RTREE_QUANTIZE_BITS
+	    RtreeQRect qrect;
+	    if (!QuantizeQuery(&record->rect, node, &qrect)) {
+		node->unlock();
+		continue;
+	    }
+#endif
     	    for(uint32_t index=0; index < node->count; ++index) {
+#ifdef RTREE_QUANTIZE_BITS
+		if (QOverlap(&qrect, &Branch(node)->qrects[index])) {
+#else
     	    	if(Overlap(&record->rect, &(node->records[index].rect))) {
+#endif
     	    	    // LoadNode(node->records[index].offset);
     	    	    RtreeNodeLSN* nodelsn = new RtreeNodeLSN;
     	    	    nodelsn->node = node->records[index].child;
@@ -763,96 +1627,1836 @@ namespace cmpt740 {
     	}
     }
 
-    // bool Rtree::Save(std::ofstream& out)
-    //     void Rtree::Save()
-    //     {
-    // 	std::queue<RtreeNode*> nodeque;
-    // //	hd.write((char*)root, sizeof(RtreeNode));
-    // 	SaveNode(root);
-    // 	nodeque.push(root);
-    // 	SaveRec(nodeque);
-    // //	hd.close();
-    //     }
-
-    // bool Rtree::SaveRec(std::ofstream& out, std::queue<RtreeNode*> nodeque)
-    // void Rtree::SaveRec(std::queue<RtreeNode*> nodeque)
-    // {
-    // 	int size = nodeque.size();
-    // 	for (int i = 0; i < size; ++i) {
-    // 	    RtreeNode* node = nodeque.front();
-    // 	    if(node->IsInternalNode()) {
-    // 		for(int index=0; index < node->count; ++index) {
-    // 		    node->records[index].offset = hd.tellp();
-    // 		    // hd.write((char*)node->records[index].child,
-    // 		    // 	      sizeof(RtreeNode));
-    // 		    SaveNode(node->records[index].child);
-    // 		    nodeque.push(node->records[index].child);
-    // 		}
-    // 	    }
-    // 	    nodeque.pop();
-    // 	}
-
-    // 	if (!nodeque.empty())
-    // 	    SaveRec(nodeque);
-    // }
+    struct Rtree::SearchJob {
+	Rtree* rtree;
+	RtreeRect rect;
+	ThreadPool* pool;
+	TaskGroup group;
+	// One result buffer per pool worker; slot 0 is shared by threads
+	// outside the pool and guarded by lock
+	std::vector<std::vector<Rtree::RtreeRecord> > buffers;
+	pthread_mutex_t lock;
+    };
+
+    struct Rtree::SearchTask {
+	SearchJob* job;
+	RtreeNode* node;
+	uint64_t lsn;
+    };
+
+    std::vector<Rtree::RtreeRecord> Rtree::ParallelSearch(uint32_t min[DIMENSION],
+							  uint32_t max[DIMENSION],
+							  ThreadPool* pool)
+    {
+	SearchJob job;
+	job.rtree = this;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    job.rect.max[i] = max[i];
+	    job.rect.min[i] = min[i];
+	}
+#ifdef RTREE_BUFFERED
+	if (pool == flush_pool)
+	    pool = NULL; // see AttachFlushPool
+#endif
+	job.pool = pool;
+	job.buffers.resize((pool != NULL) ? pool->Size() + 1 : 1);
+	pthread_mutex_init(&job.lock, NULL);
+
+	TRACE_BEGIN(TRACE_PARALLEL_SEARCH, 0);
+	// Covers the tasks too, the job ends with the call
+	int phase = EnterRead();
+#ifdef RTREE_BUFFERED
+	uint64_t moves;
+	bool held = StartBufferedRead(&moves);
+#endif
+	RtreeNode* node = root;
+	SearchSubtree(&job, node, node->lsn);
+	if (pool != NULL)
+	    pool->Wait(&job.group);
+#ifdef RTREE_BUFFERED
+	while (RetryBufferedRead(moves, &held)) {
+	    for (size_t i = 0; i < job.buffers.size(); ++i)
+		job.buffers[i].clear();
+	    node = root;
+	    SearchSubtree(&job, node, node->lsn);
+	    if (pool != NULL)
+		pool->Wait(&job.group);
+	}
+#endif
+	ExitRead(phase);
+	TRACE_END(TRACE_PARALLEL_SEARCH);
+	pthread_mutex_destroy(&job.lock);
+
+	// Merge the per-worker buffers
+	size_t total = 0;
+	for (size_t i = 0; i < job.buffers.size(); ++i) {
+	    total += job.buffers[i].size();
+	}
+	std::vector<Rtree::RtreeRecord> results;
+	results.reserve(total);
+	for (size_t i = 0; i < job.buffers.size(); ++i) {
+	    results.insert(results.end(), job.buffers[i].begin(),
+			   job.buffers[i].end());
+	}
+	return results;
+    }
 
-    void Rtree::Load()
+    void Rtree::SearchTaskRoutine(void* arg)
     {
-	root = LoadNode(root->offset);
+	SearchTask* task = (SearchTask*)arg;
+	task->job->rtree->SearchSubtree(task->job, task->node, task->lsn);
+	delete task;
     }
 
-    void Rtree::LoadRec(std::queue<RtreeNode*> nodeque)
+    // Search the subtree under node, as it was when its parent recorded
+    // lsn. If the node has split since, its records are spread over the
+    // right-link chain up to the piece still carrying lsn, so every piece
+    // is searched. Children at or above PARALLEL_SEARCH_TASK_LEVEL become
+    // tasks; lower subtrees are searched here.
+    void Rtree::SearchSubtree(SearchJob* job, RtreeNode* node, uint64_t lsn)
     {
-	int size = (int)nodeque.size();
-	for (int i = 0; i < size; ++i) {
-	    RtreeNode* node = nodeque.front();
-	    node = LoadNode(node->offset);
-	    if(node->IsInternalNode()) {
-		for(uint32_t index=0; index < node->count; ++index) {
-		    RtreeNode* child = new RtreeNode;
-		    nodeque.push(child);
-		    node->records[index].child = child;
+	int slot = (job->pool != NULL) ? job->pool->CurrentWorker() + 1 : 0;
+	std::vector<Rtree::RtreeRecord> local;
+	std::vector<Rtree::RtreeRecord>& results =
+	    (slot > 0) ? job->buffers[slot] : local;
+	std::stack<Rtree::RtreeNodeLSN> stk;
+	RtreeNodeLSN nodelsn;
+
+	nodelsn.node = node;
+	nodelsn.lsn = lsn;
+	stk.push(nodelsn);
+	while (!stk.empty()) {
+	    node = stk.top().node;
+	    lsn = stk.top().lsn;
+	    stk.pop();
+	    ReadLock(node);
+	    while (true) {
+		if (node->IsLeaf()) {
+		    for (uint32_t index = 0; index < node->count; ++index) {
+			if (Overlap(&job->rect, &node->records[index].rect))
+			    results.push_back(node->records[index]);
+		    }
+		} else {
+		    RtreeBranch* branch = Branch(node);
+#ifdef RTREE_BUFFERED
+		    for (size_t index = 0; index < branch->buffer.size(); ++index) {
+			if (Overlap(&job->rect, &branch->buffer[index].rect))
+			    results.push_back(branch->buffer[index]);
+		    }
+#endif
+#ifdef RTREE_QUANTIZE_BITS
+		    RtreeQRect qrect;
+		    bool hit = QuantizeQuery(&job->rect, node, &qrect);
+#endif
+		    for (uint32_t index = 0; index < node->count; ++index) {
+#ifdef RTREE_QUANTIZE_BITS
+			if (!hit || !QOverlap(&qrect, &branch->qrects[index]))
+			    continue;
+#else
+			if (!Overlap(&job->rect, &node->records[index].rect))
+			    continue;
+#endif
+			RtreeRecord* record = &node->records[index];
+			if (job->pool != NULL &&
+			    record->child->level >= PARALLEL_SEARCH_TASK_LEVEL) {
+			    SearchTask* task = new SearchTask;
+			    task->job = job;
+			    task->node = record->child;
+			    task->lsn = branch->lsns[index];
+			    job->pool->Submit(SearchTaskRoutine, task, &job->group);
+			} else {
+			    nodelsn.node = record->child;
+			    nodelsn.lsn = branch->lsns[index];
+			    stk.push(nodelsn);
+			}
+		    }
 		}
+		if (node->lsn == lsn || node->sibling == NULL)
+		    break;
+		RtreeNode* prev = node; // split since: follow the right-link
+		node = node->sibling;
+		prev->unlock();
+		ReadLock(node);
 	    }
-	    nodeque.pop();
+	    node->unlock();
 	}
 
-	if (!nodeque.empty())
-	    LoadRec(nodeque);
+	if (slot == 0 && !local.empty()) {
+	    pthread_mutex_lock(&job->lock);
+	    job->buffers[0].insert(job->buffers[0].end(), local.begin(),
+				   local.end());
+	    pthread_mutex_unlock(&job->lock);
+	}
     }
 
-    void Rtree::Dump()
+    uint64_t Rtree::Count(uint32_t min[DIMENSION], uint32_t max[DIMENSION])
     {
-	std::queue<RtreeNode*> nodeque;
-	if (root == NULL)
-	    Load();
-	nodeque.push(root);
-	NodeDump(nodeque);
+	RtreeRect rect;
+	uint64_t count, sum;
+
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.max[i] = max[i];
+	    rect.min[i] = min[i];
+	}
+	AggregateRange(&rect, &count, &sum);
+	return count;
     }
 
-    void Rtree::NodeDump(std::queue<RtreeNode*> nodeque)
+#ifdef RTREE_AGGREGATE
+    uint64_t Rtree::Sum(uint32_t min[DIMENSION], uint32_t max[DIMENSION])
     {
-	int size = (int)nodeque.size();
+	RtreeRect rect;
+	uint64_t count, sum;
 
-	for (int i = 0; i < size; ++i) {
-	    RtreeNode* node = nodeque.front(); /// Get the leftmost node
-	    std::cout << "---- level: " << node->level <<
-		", lsn: " << node->lsn << ", parent: " << node->parent << std::endl;
-	    for(uint32_t index = 0; index < node->count; ++index) {
-		node->records[index].rect.disp();
-		if (index < node->count - 1)
-		    std::cout << " -> ";
-		if(node->IsInternalNode()) {
-		    //		    LoadNode(node->records[index].offset);
-		    nodeque.push(node->records[index].child);
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.max[i] = max[i];
+	    rect.min[i] = min[i];
+	}
+	AggregateRange(&rect, &count, &sum);
+	return sum;
+    }
+#endif
+
+    // Count (and with RTREE_AGGREGATE, sum the weights of) the records
+    // overlapping rect, without copying any of them out. Right-link
+    // chains are followed as in SearchSubtree.
+    void Rtree::AggregateRange(RtreeRect* rect, uint64_t* count, uint64_t* sum)
+    {
+	int phase = EnterRead();
+#ifdef RTREE_BUFFERED
+	uint64_t moves;
+	bool held = StartBufferedRead(&moves);
+#endif
+	AggregateNodes(rect, count, sum);
+#ifdef RTREE_BUFFERED
+	while (RetryBufferedRead(moves, &held))
+	    AggregateNodes(rect, count, sum);
+#endif
+	ExitRead(phase);
+    }
+
+    void Rtree::AggregateNodes(RtreeRect* rect, uint64_t* count, uint64_t* sum)
+    {
+	std::stack<Rtree::RtreeNodeLSN> stk;
+	RtreeNodeLSN nodelsn;
+
+	*count = 0;
+	*sum = 0;
+	nodelsn.node = root;
+	nodelsn.lsn = nodelsn.node->lsn;
+	stk.push(nodelsn);
+	while (!stk.empty()) {
+	    RtreeNode* node = stk.top().node;
+	    uint64_t lsn = stk.top().lsn;
+	    stk.pop();
+	    ReadLock(node);
+	    while (true) {
+#ifdef RTREE_BUFFERED
+		if (node->IsInternalNode()) {
+		    std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+		    for (size_t index = 0; index < buffer.size(); ++index) {
+			if (Overlap(rect, &buffer[index].rect))
+			    ++*count;
+		    }
+		}
+#endif
+		for (uint32_t index = 0; index < node->count; ++index) {
+		    RtreeRecord* record = &node->records[index];
+		    if (!Overlap(rect, &record->rect))
+			continue;
+		    if (node->IsLeaf()) {
+			++*count;
+#ifdef RTREE_AGGREGATE
+			*sum += record->agg_sum;
+		    } else if (Inside(&record->rect, rect)) {
+			*count += record->agg_count;
+			*sum += record->agg_sum;
+#endif
+		    } else {
+			nodelsn.node = record->child;
+			nodelsn.lsn = Branch(node)->lsns[index];
+			stk.push(nodelsn);
+		    }
+		}
+		if (node->lsn == lsn || node->sibling == NULL)
+		    break;
+		RtreeNode* prev = node;
+		node = node->sibling;
+		prev->unlock();
+		ReadLock(node);
+	    }
+	    node->unlock();
+	}
+    }
+
+    std::vector<Rtree::RtreeRecord> Rtree::Query(uint32_t min[DIMENSION],
+						 uint32_t max[DIMENSION],
+						 QueryPredicate predicate)
+    {
+	RtreeRect rect;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.max[i] = max[i];
+	    rect.min[i] = min[i];
+	}
+
+	STAT_ADD(searches, 1);
+	TRACE_BEGIN(TRACE_SEARCH, 0);
+	std::vector<Rtree::RtreeRecord> results;
+	QueryRange(&rect, predicate, &results);
+	TRACE_END(TRACE_SEARCH);
+	return results;
+    }
+
+    bool Rtree::Exists(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+		       QueryPredicate predicate)
+    {
+	RtreeRect rect;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.max[i] = max[i];
+	    rect.min[i] = min[i];
+	}
+
+	STAT_ADD(searches, 1);
+	TRACE_BEGIN(TRACE_SEARCH, 0);
+	bool ret = QueryRange(&rect, predicate, NULL);
+	TRACE_END(TRACE_SEARCH);
+	return ret;
+    }
+
+    bool Rtree::Matches(RtreeRect* rect, RtreeRect* window,
+			QueryPredicate predicate)
+    {
+	switch (predicate) {
+	case QUERY_WITHIN:
+	    return Inside(rect, window);
+	case QUERY_CONTAINS:
+	    return Inside(window, rect);
+	default:
+	    return Overlap(rect, window);
+	}
+    }
+
+    // Collect the records matching predicate into results, or with
+    // results NULL stop at the first. Returns whether any matched.
+    bool Rtree::QueryRange(RtreeRect* rect, QueryPredicate predicate,
+			   std::vector<RtreeRecord>* results)
+    {
+	int phase = EnterRead();
+#ifdef RTREE_BUFFERED
+	uint64_t moves;
+	bool held = StartBufferedRead(&moves);
+#endif
+	bool found = QueryNodes(rect, predicate, results);
+#ifdef RTREE_BUFFERED
+	while (RetryBufferedRead(moves, &held)) {
+	    if (results != NULL)
+		results->clear();
+	    found = QueryNodes(rect, predicate, results);
+	}
+#endif
+	ExitRead(phase);
+	return found;
+    }
+
+    // Right-link chains are followed as in SearchSubtree.
+    bool Rtree::QueryNodes(RtreeRect* rect, QueryPredicate predicate,
+			   std::vector<RtreeRecord>* results)
+    {
+	std::stack<RtreeQueryEntry> stk;
+	RtreeQueryEntry entry;
+	bool found = false;
+
+	entry.node = root;
+	entry.lsn = entry.node->lsn;
+	entry.whole = false;
+	stk.push(entry);
+	while (!stk.empty() && !(found && results == NULL)) {
+	    RtreeNode* node = stk.top().node;
+	    uint64_t lsn = stk.top().lsn;
+	    bool whole = stk.top().whole;
+	    stk.pop();
+	    ReadLock(node);
+	    while (true) {
+		STAT_ADD(search_nodes, 1);
+#ifdef RTREE_BUFFERED
+		// Covered by the node's record in its parent, so inside the
+		// window too when the subtree is whole
+		if (node->IsInternalNode()) {
+		    std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+		    for (size_t index = 0; index < buffer.size(); ++index) {
+			RtreeRecord* record = &buffer[index];
+			if (!whole && !Matches(&record->rect, rect, predicate))
+			    continue;
+			found = true;
+			if (results == NULL)
+			    break;
+			results->push_back(*record);
+		    }
+		}
+#endif
+		for (uint32_t index = 0; index < node->count; ++index) {
+		    if (found && results == NULL)
+			break;
+		    RtreeRecord* record = &node->records[index];
+		    if (node->IsLeaf()) {
+			if (!whole && !Matches(&record->rect, rect, predicate))
+			    continue;
+			found = true;
+			if (results != NULL)
+			    results->push_back(*record);
+			continue;
+		    }
+		    entry.node = record->child;
+		    entry.lsn = Branch(node)->lsns[index];
+		    entry.whole = whole;
+		    if (!whole && predicate == QUERY_CONTAINS) {
+			// Whatever covers the window lies in a child that
+			// does
+			if (!Inside(rect, &record->rect))
+			    continue;
+		    } else if (!whole) {
+			if (!Overlap(rect, &record->rect))
+			    continue;
+			entry.whole = (predicate == QUERY_WITHIN &&
+				       Inside(&record->rect, rect));
+		    }
+		    stk.push(entry);
+		}
+		if (found && results == NULL)
+		    break;
+		if (node->lsn == lsn || node->sibling == NULL)
+		    break;
+		RtreeNode* prev = node;
+		node = node->sibling;
+		prev->unlock();
+		ReadLock(node);
+	    }
+	    node->unlock();
+	}
+	return found;
+    }
+
+    void Rtree::AttachEstimator(SelectivityEstimator* estimator)
+    {
+	this->estimator = estimator;
+    }
+
+    void Rtree::AttachRecorder(OpRecorder* recorder)
+    {
+	this->recorder = recorder;
+    }
+
+#ifdef RTREE_BUFFERED
+    struct Rtree::FlushTask {
+	Rtree* rtree;
+	RtreeNode* node;
+    };
+
+    void Rtree::AttachFlushPool(ThreadPool* pool)
+    {
+	if (flush_pool != NULL)
+	    flush_pool->Wait(flush_group);
+	flush_pool = pool;
+    }
+
+    void Rtree::Flush()
+    {
+	if (flush_pool != NULL)
+	    flush_pool->Wait(flush_group);
+	EnterWrite();
+	RtreeNode* top = root;
+	FlushSubtree(top, top->lsn);
+	ExitWrite();
+	if (flush_pool != NULL)
+	    flush_pool->Wait(flush_group);
+    }
+
+    // Flush node, then the children it flushed into. Splits below may
+    // move children to new right siblings of node, so as in
+    // SearchSubtree the right-link chain is followed up to the piece
+    // still carrying lsn.
+    void Rtree::FlushSubtree(RtreeNode* node, uint64_t lsn)
+    {
+	if (node->IsLeaf())
+	    return;
+	while (true) {
+	    FlushNode(node, false);
+	    std::vector<RtreeNodeLSN> children;
+	    RtreeNodeLSN child;
+	    ReadLock(node);
+	    for (uint32_t index = 0; index < node->count; ++index) {
+		child.node = node->records[index].child;
+		child.lsn = Branch(node)->lsns[index];
+		children.push_back(child);
+	    }
+	    node->unlock();
+	    for (size_t i = 0; i < children.size(); ++i)
+		FlushSubtree(children[i].node, children[i].lsn);
+	    ReadLock(node);
+	    RtreeNode* next = node->sibling;
+	    bool done = (node->lsn == lsn || next == NULL);
+	    node->unlock();
+	    if (done)
+		break;
+	    node = next;
+	}
+    }
+
+    // Append record to the root's buffer. A root that is still a leaf
+    // takes the record directly.
+    bool Rtree::BufferRecord(RtreeRecord* record)
+    {
+	RtreeNode* top;
+	while (true) {
+	    top = root;
+	    WriteLock(top);
+	    if (top == root) // the root grows under the old root's lock
+		break;
+	    top->unlock();
+	}
+	if (top->IsLeaf()) {
+	    top->unlock();
+	    return InsertRecord(record, &root);
+	}
+	RtreeBranch* branch = Branch(top);
+	branch->buffer.push_back(*record);
+	TouchNode(top);
+	size_t size = branch->buffer.size();
+	bool queue = (size >= NODE_BUFFER_SIZE && !branch->flush_queued);
+	if (queue)
+	    branch->flush_queued = true;
+	top->unlock();
+	if (queue) {
+	    ScheduleFlush(top);
+	} else if (size >= NODE_BUFFER_BACKLOG) {
+	    // The flushes fall behind: help rather than let the root's
+	    // buffer, which every query scans, grow without bound. The
+	    // helper carries the records all the way down, as the pool is
+	    // evidently short of threads
+	    FlushNode(top, true);
+	}
+	return true;
+    }
+
+    void Rtree::ScheduleFlush(RtreeNode* node)
+    {
+	if (flush_pool == NULL) {
+	    FlushNode(node, true);
+	    return;
+	}
+	FlushTask* task = new FlushTask;
+	task->rtree = this;
+	task->node = node;
+	flush_pool->Submit(FlushTaskRoutine, task, flush_group);
+    }
+
+    void Rtree::FlushTaskRoutine(void* arg)
+    {
+	FlushTask* task = (FlushTask*)arg;
+	task->rtree->EnterWrite();
+	task->rtree->FlushNode(task->node, false);
+	task->rtree->ExitWrite();
+	delete task;
+    }
+
+    // Move node's buffer one level down. Each record goes to the child
+    // PickRecord chooses. Children above the leaves take the records
+    // into their buffers, and their records in node grow to cover them,
+    // so node's own cover stays the same; leaves get them inserted, a
+    // whole group per leaf. DeleteRange keeps a node it drops until its
+    // queued flush has run, so a queued node is still there, if perhaps
+    // split or unlinked since. Flushes of other nodes may run
+    // meanwhile, and split node or its children. Children filled up are
+    // flushed in turn, right away with inline set, else through
+    // ScheduleFlush.
+    void Rtree::FlushNode(RtreeNode* node, bool inline_below)
+    {
+	std::vector<RtreeRecord> groups[MAX_REC_NUM_PER_NODE];
+	RtreeNode* children[MAX_REC_NUM_PER_NODE];
+	std::vector<RtreeNode*> full;
+
+	RtreeBranch* branch = Branch(node);
+	BeginMove();
+	WriteLock(node);
+	branch->flush_queued = false;
+	if (branch->buffer.empty()) {
+	    node->unlock();
+	    EndMove();
+	    return;
+	}
+	STAT_ADD(buffer_flushes, 1);
+	std::vector<RtreeRecord> pending;
+	pending.swap(branch->buffer);
+	int32_t level = node->level;
+	for (size_t i = 0; i < pending.size(); ++i) {
+	    int index = PickRecord(&pending[i].rect, node);
+	    if (level > 1) { // leaves grow their parent records themselves
+		RtreeRect* rect = &node->records[index].rect;
+		*rect = CombineRect(rect, &pending[i].rect);
+	    }
+	    groups[index].push_back(pending[i]);
+	}
+	uint32_t count = node->count;
+	for (uint32_t index = 0; index < count; ++index)
+	    children[index] = node->records[index].child;
+	TouchNode(node);
+#ifdef RTREE_QUANTIZE_BITS
+	QuantizeNode(node);
+#endif
+	node->unlock();
+
+	for (uint32_t index = 0; index < count; ++index) {
+	    if (groups[index].empty())
+		continue;
+	    RtreeNode* child = children[index];
+	    if (level == 1) {
+		FlushToLeaf(child, groups[index]);
+		continue;
+	    }
+	    RtreeBranch* below = Branch(child);
+	    WriteLock(child);
+	    RtreeRect rect = NodeCover(child);
+	    below->buffer.insert(below->buffer.end(), groups[index].begin(),
+				 groups[index].end());
+	    TouchNode(child);
+	    if (below->buffer.size() >= NODE_BUFFER_SIZE &&
+		!below->flush_queued) {
+		below->flush_queued = true;
+		full.push_back(child);
+	    }
+	    // A split of child since node was unlocked has set its record
+	    // to the cover the child had then
+	    RtreeRect rect2 = NodeCover(child);
+	    if (ParentNeedsUpdate(&rect, &rect2)) {
+		UpdateParent(child, rect2);
+	    } else {
+		child->unlock();
+	    }
+	}
+	EndMove();
+
+	for (size_t i = 0; i < full.size(); ++i) {
+	    if (inline_below)
+		FlushNode(full[i], true);
+	    else
+		ScheduleFlush(full[i]);
+	}
+    }
+
+    // Insert records into leaf, a run of them per lock. Once the leaf
+    // splits, each record goes to whichever of the nodes split off it
+    // grows least: the rest of the tree keeps its shape, which keeps the
+    // buffers of nodes still to be flushed where Flush looks for them.
+    void Rtree::FlushToLeaf(RtreeNode* leaf, std::vector<RtreeRecord>& records)
+    {
+	std::vector<RtreeNode*> halves(1, leaf);
+	size_t i = 0;
+	while (i < records.size()) {
+	    RtreeNode* node = halves[0];
+	    if (halves.size() > 1)
+		node = halves[PickHalf(&records[i].rect, halves)];
+	    WriteLock(node);
+	    RtreeRect rect = NodeCover(node);
+	    bool split = false;
+	    for (; i < records.size(); ++i) {
+		if (halves.size() > 1 &&
+		    halves[PickHalf(&records[i].rect, halves)] != node)
+		    break;
+		RtreeNode* newNode;
+		if (AddRecord(&records[i], 0, node, &newNode)) {
+		    halves.push_back(newNode);
+		    ExternParent(node, node->lsn, newNode, newNode->lsn);
+		    ++i;
+		    split = true;
+		    break;
+		}
+	    }
+	    if (!split) {
+		RtreeRect rect2 = NodeCover(node);
+		if (ParentNeedsUpdate(&rect, &rect2)) {
+		    UpdateParent(node, rect2);
+		} else {
+		    node->unlock();
 		}
 	    }
+	}
+    }
+
+    // Index of the node in nodes whose cover grows least to take rect
+    int Rtree::PickHalf(RtreeRect* rect, std::vector<RtreeNode*>& nodes)
+    {
+	int best = 0;
+	uint64_t bestIncr = 0;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+	    RtreeRect cover = NodeCover(nodes[i]);
+	    RtreeRect grown = CombineRect(&cover, rect);
+	    uint64_t increase = CalcRectVolume(&grown) - CalcRectVolume(&cover);
+	    if (i == 0 || increase < bestIncr) {
+		best = (int)i;
+		bestIncr = increase;
+	    }
+	}
+	return best;
+    }
+
+    // Deal the buffer of a split internal node out to the two halves,
+    // each record to the half whose cover grows least.
+    void Rtree::SplitBuffer(RtreeNode* nodeA, RtreeNode* nodeB)
+    {
+	std::vector<RtreeRecord> pending;
+	pending.swap(Branch(nodeA)->buffer);
+	RtreeRect coverA = NodeCover(nodeA);
+	RtreeRect coverB = NodeCover(nodeB);
+	uint64_t areaA = CalcRectVolume(&coverA);
+	uint64_t areaB = CalcRectVolume(&coverB);
+	for (size_t i = 0; i < pending.size(); ++i) {
+	    RtreeRect rectA = CombineRect(&coverA, &pending[i].rect);
+	    RtreeRect rectB = CombineRect(&coverB, &pending[i].rect);
+	    if (CalcRectVolume(&rectA) - areaA <=
+		CalcRectVolume(&rectB) - areaB) {
+		Branch(nodeA)->buffer.push_back(pending[i]);
+	    } else {
+		Branch(nodeB)->buffer.push_back(pending[i]);
+	    }
+	}
+    }
+
+    // Drop the buffered records overlapping record's rectangle, from the
+    // buffers of every node the rectangle overlaps. Caller holds moves
+    // back; a node splitting meanwhile deals its buffer out to a new
+    // right sibling, which is followed by lsn as in SearchSubtree.
+    bool Rtree::DeleteBuffered(RtreeRecord* record)
+    {
+	bool ret = false;
+	std::stack<RtreeNodeLSN> stk;
+	RtreeNodeLSN nodelsn;
+	nodelsn.node = root;
+	nodelsn.lsn = nodelsn.node->lsn;
+	stk.push(nodelsn);
+	while (!stk.empty()) {
+	    RtreeNode* node = stk.top().node;
+	    uint64_t lsn = stk.top().lsn;
+	    stk.pop();
+	    if (node->IsLeaf())
+		continue;
+	    WriteLock(node);
+	    while (true) {
+		std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+		size_t size = buffer.size();
+		for (size_t i = 0; i < buffer.size(); ) {
+		    if (Overlap(&record->rect, &buffer[i].rect)) {
+			if (estimator != NULL)
+			    estimator->Remove(&buffer[i].rect);
+			buffer[i] = buffer.back();
+			buffer.pop_back();
+		    } else {
+			++i;
+		    }
+		}
+		if (buffer.size() != size) {
+		    TouchNode(node);
+		    ret = true;
+		}
+		for (uint32_t index = 0; index < node->count; ++index) {
+		    if (!Overlap(&record->rect, &node->records[index].rect))
+			continue;
+		    nodelsn.node = node->records[index].child;
+		    nodelsn.lsn = Branch(node)->lsns[index];
+		    stk.push(nodelsn);
+		}
+		if (node->lsn == lsn || node->sibling == NULL)
+		    break;
+		RtreeNode* prev = node;
+		node = node->sibling;
+		prev->unlock();
+		WriteLock(node);
+	    }
+	    node->unlock();
+	}
+	return ret;
+    }
+
+    // Open a move of records between levels. Waits while a holder keeps
+    // moves back.
+    void Rtree::BeginMove()
+    {
+	while (true) {
+	    __sync_add_and_fetch(&moves_begun, 1);
+	    if (!move_holds)
+		return;
+	    // Counted as an empty move, so that the holder need not wait
+	    __sync_add_and_fetch(&moves_ended, 1);
+	    while (move_holds)
+		sched_yield();
+	}
+    }
+
+    void Rtree::EndMove()
+    {
+	__sync_add_and_fetch(&moves_ended, 1);
+    }
+
+    // Wait for the moves under way to end and keep new ones out until
+    // ReleaseMoves. Holders do not exclude each other.
+    void Rtree::HoldMoves()
+    {
+	__sync_add_and_fetch(&move_holds, 1);
+	while (true) {
+	    // Begun read first: equal counts then mean none was under way
+	    uint64_t begun = moves_begun;
+	    __sync_synchronize();
+	    if (moves_ended == begun)
+		break;
+	    sched_yield();
+	}
+	__sync_synchronize(); // before the buffers are read
+    }
+
+    void Rtree::ReleaseMoves()
+    {
+	__sync_synchronize();
+	__sync_sub_and_fetch(&move_holds, 1);
+    }
 
-	    std::cout << std::endl << std::endl;
+    // Start a read of the buffers. Returns whether moves were held back
+    // for it, as one was under way; else *moves tells RetryBufferedRead
+    // whether one began meanwhile.
+    bool Rtree::StartBufferedRead(uint64_t* moves)
+    {
+	*moves = moves_begun;
+	__sync_synchronize();
+	if (moves_ended == *moves)
+	    return false;
+	HoldMoves();
+	return true;
+    }
+
+    // End of a read begun with StartBufferedRead: true if a move
+    // overlapped it, and moves are now held back for reading again.
+    // A read is done twice at most.
+    bool Rtree::RetryBufferedRead(uint64_t moves, bool* held)
+    {
+	if (*held) {
+	    ReleaseMoves();
+	    *held = false;
+	    return false;
+	}
+	__sync_synchronize(); // after the buffers are read
+	if (moves_begun == moves)
+	    return false;
+	STAT_ADD(buffer_retries, 1);
+	HoldMoves();
+	*held = true;
+	return true;
+    }
+#endif
+
+    Rtree::OpSlot* Rtree::OpSlotOfThread()
+    {
+	if (op_slot < 0) {
+	    op_slot = __sync_fetch_and_add(&op_next_slot, 1)
+		% RTREE_STATS_SLOTS;
+	}
+	return &op_slots[op_slot];
+    }
+
+    // Announce a search or other read-only walk of the nodes, so that
+    // WaitReaders can wait for it. Returns the phase to leave.
+    int Rtree::EnterRead()
+    {
+	OpSlot* slot = OpSlotOfThread();
+	while (true) {
+	    int phase = read_phase;
+	    __sync_add_and_fetch(&slot->readers[phase], 1);
+	    if (read_phase == phase)
+		return phase;
+	    // Flipped meanwhile; the waiter may have missed us
+	    __sync_sub_and_fetch(&slot->readers[phase], 1);
+	}
+    }
+
+    void Rtree::ExitRead(int phase)
+    {
+	__sync_sub_and_fetch(&op_slots[op_slot].readers[phase], 1);
+    }
+
+    // Announce an insert, delete or flush, so that a holder can wait for
+    // it. A holder under way holds it back.
+    void Rtree::EnterWrite()
+    {
+	OpSlot* slot = OpSlotOfThread();
+	while (true) {
+	    __sync_add_and_fetch(&slot->writers, 1);
+	    if (!holding)
+		break;
+	    __sync_sub_and_fetch(&slot->writers, 1);
+	    while (holding)
+		sched_yield();
+	}
+    }
+
+    void Rtree::ExitWrite()
+    {
+	__sync_sub_and_fetch(&op_slots[op_slot].writers, 1);
+    }
+
+    // Wait for the writes under way to end and keep new ones out until
+    // ReleaseWriters. Caller holds quiesce_lock.
+    void Rtree::HoldWriters()
+    {
+	holding = 1;
+	__sync_synchronize();
+	for (int i = 0; i < RTREE_STATS_SLOTS; ++i) {
+	    while (op_slots[i].writers > 0)
+		sched_yield();
+	}
+    }
+
+    void Rtree::ReleaseWriters()
+    {
+	__sync_synchronize();
+	holding = 0;
+    }
+
+    // Wait for the reads that began before the call to end; the ones
+    // that begin meanwhile count in the other phase and are not waited
+    // for. Caller holds quiesce_lock.
+    void Rtree::WaitReaders()
+    {
+	int phase = read_phase;
+	__sync_synchronize();
+	read_phase = 1 - phase;
+	__sync_synchronize();
+	for (int i = 0; i < RTREE_STATS_SLOTS; ++i) {
+	    while (op_slots[i].readers[phase] > 0)
+		sched_yield();
+	}
+    }
+
+    bool Rtree::DeleteRange(uint32_t min[DIMENSION], uint32_t max[DIMENSION])
+    {
+	RtreeRect rect;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.min[i] = min[i];
+	    rect.max[i] = max[i];
+	}
+
+	STAT_ADD(deletes, 1);
+	TRACE_BEGIN(TRACE_DELETE, 0);
+	std::vector<RtreeNode*> dropped;
+	std::vector<RtreeNode*> freed;
+	pthread_mutex_lock(&quiesce_lock);
+	// With no write under way every parent record carries the lsn of
+	// its child, so the walk needs no right links, and nothing splits
+	// under it.
+	HoldWriters();
+#ifdef RTREE_BUFFERED
+	// A flush clears the flag of its node as it starts, and the writer
+	// running it is done by now
+	for (size_t i = 0; i < unflushed.size(); ) {
+	    if (Branch(unflushed[i])->flush_queued) {
+		++i;
+		continue;
+	    }
+	    freed.push_back(unflushed[i]);
+	    unflushed[i] = unflushed.back();
+	    unflushed.pop_back();
+	}
+	BeginMove();
+	std::vector<RtreeRecord> homeless;
+	bool ret = ClearNode(root, &rect, dropped, homeless);
+#else
+	bool ret = ClearNode(root, &rect, dropped);
+#endif
+	if (root->IsInternalNode() && root->count == 0) {
+	    // Nodes keep their level: an empty leaf takes over, and the old
+	    // root is dropped with the rest
+	    RtreeNode* leaf = NewNode(0);
+	    leaf->lsn = NextLsn();
+#ifdef RTREE_SNAPSHOT
+	    leaf->image_epoch = epoch; // no snapshot has seen it
+#endif
+#ifdef RTREE_BUFFERED
+	    WriteLock(root);
+	    std::vector<RtreeRecord>& buffer = Branch(root)->buffer;
+	    homeless.insert(homeless.end(), buffer.begin(), buffer.end());
+	    buffer.clear();
+	    TouchNode(root);
+	    root->unlock();
+#endif
+	    dropped.push_back(root);
+	    root = leaf;
+	    STAT_ADD(root_changes, 1);
+	}
+	// Fingers and cached results may point at the nodes dropped
+	__sync_add_and_fetch(&generation, 1);
+#ifdef RTREE_SNAPSHOT
+	uint64_t dropped_at = epoch; // no snapshot is pinned meanwhile
+#endif
+#ifdef RTREE_BUFFERED
+	// Buffered records of nodes left without children, outside the
+	// window: back into the tree
+	for (size_t i = 0; i < homeless.size(); ++i)
+	    InsertRecord(&homeless[i], &root);
+	EndMove();
+	// Flushes queued for the dropped nodes would move records into
+	// them; they wait until the nodes are emptied
+	HoldMoves();
+#endif
+	// Writers no longer reach the dropped subtrees: nothing links to
+	// them, the fingers are stale and the parent hints exact
+	ReleaseWriters();
+	for (size_t i = 0; i < dropped.size(); ++i)
+	    DropSubtree(dropped[i], freed);
+#ifdef RTREE_BUFFERED
+	ReleaseMoves();
+#endif
+	// Searches that read a parent before it lost a child may still
+	// visit the child
+	if (!freed.empty())
+	    WaitReaders();
+	pthread_mutex_unlock(&quiesce_lock);
+#ifdef RTREE_SNAPSHOT
+	RetireNodes(freed, dropped_at);
+#else
+	for (size_t i = 0; i < freed.size(); ++i)
+	    FreeNode(freed[i]);
+#endif
+	TRACE_END(TRACE_DELETE);
+	return ret;
+    }
+
+    // Remove the records of node's subtree inside rect. Children inside
+    // it are unlinked and added to dropped; children overlapping it are
+    // cleared in turn, then unlinked too if left empty, else their
+    // records in node shrink to their new cover. Writers are held back,
+    // so the node locks only keep searches out.
+#ifdef RTREE_BUFFERED
+    bool Rtree::ClearNode(RtreeNode* node, RtreeRect* rect,
+			  std::vector<RtreeNode*>& dropped,
+			  std::vector<RtreeRecord>& homeless)
+#else
+    bool Rtree::ClearNode(RtreeNode* node, RtreeRect* rect,
+			  std::vector<RtreeNode*>& dropped)
+#endif
+    {
+	bool ret = false;
+	WriteLock(node);
+	if (node->IsLeaf()) {
+	    for (uint32_t index = 0; index < node->count; ) {
+		if (Inside(&node->records[index].rect, rect)) {
+		    if (estimator != NULL)
+			estimator->Remove(&node->records[index].rect);
+		    // The last record moves into index, look at it next
+		    DisconnectRecord(node, index);
+		    ret = true;
+		} else {
+		    ++index;
+		}
+	    }
+	    node->unlock();
+	    return ret;
+	}
+
+#ifdef RTREE_BUFFERED
+	std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+	size_t size = buffer.size();
+	for (size_t i = 0; i < buffer.size(); ) {
+	    if (Inside(&buffer[i].rect, rect)) {
+		if (estimator != NULL)
+		    estimator->Remove(&buffer[i].rect);
+		buffer[i] = buffer.back();
+		buffer.pop_back();
+	    } else {
+		++i;
+	    }
+	}
+	if (buffer.size() != size) {
+	    TouchNode(node);
+	    ret = true;
+	}
+#endif
+	std::vector<RtreeNode*> children;
+	for (uint32_t index = 0; index < node->count; ) {
+	    RtreeRecord* record = &node->records[index];
+	    if (Inside(&record->rect, rect)) {
+		STAT_ADD(subtrees_dropped, 1);
+		dropped.push_back(record->child);
+		DisconnectRecord(node, index);
+		ret = true;
+		continue;
+	    }
+	    if (Overlap(&record->rect, rect))
+		children.push_back(record->child);
+	    ++index;
+	}
+#ifdef RTREE_QUANTIZE_BITS
+	if (ret)
+	    QuantizeNode(node);
+#endif
+	node->unlock();
+
+	bool changed = false;
+	for (size_t i = 0; i < children.size(); ++i) {
+#ifdef RTREE_BUFFERED
+	    if (ClearNode(children[i], rect, dropped, homeless))
+		changed = true;
+#else
+	    if (ClearNode(children[i], rect, dropped))
+		changed = true;
+#endif
+	}
+	if (!changed)
+	    return ret;
+
+	WriteLock(node);
+	for (uint32_t index = 0; index < node->count; ) {
+	    RtreeRecord* record = &node->records[index];
+	    RtreeNode* child = record->child;
+	    if (!Overlap(&record->rect, rect)) {
+		++index;
+		continue;
+	    }
+	    if (child->count == 0) {
+#ifdef RTREE_BUFFERED
+		if (child->IsInternalNode()) {
+		    std::vector<RtreeRecord>& below = Branch(child)->buffer;
+		    homeless.insert(homeless.end(), below.begin(), below.end());
+		    below.clear();
+		}
+#endif
+		dropped.push_back(child);
+		DisconnectRecord(node, index);
+		continue;
+	    }
+	    // NodeCover takes in the child's buffer as well
+	    record->rect = NodeCover(child);
+#ifdef RTREE_AGGREGATE
+	    AggregateNode(child, record);
+#endif
+	    ++index;
+	}
+	TouchNode(node);
+#ifdef RTREE_QUANTIZE_BITS
+	QuantizeNode(node);
+#endif
+	node->unlock();
+	return true;
+    }
+
+    // Empty a subtree unlinked by DeleteRange, taking its records out of
+    // the estimator, and add its nodes to freed. Nothing but searches
+    // under way, and with RTREE_SNAPSHOT the snapshots pinned before,
+    // can still reach them. A node whose flush is still queued goes to
+    // unflushed instead, for the flush to find.
+    void Rtree::DropSubtree(RtreeNode* node, std::vector<RtreeNode*>& freed)
+    {
+	WriteLock(node);
+	if (estimator != NULL && node->IsLeaf()) {
+	    for (uint32_t index = 0; index < node->count; ++index)
+		estimator->Remove(&node->records[index].rect);
+	}
+#ifdef RTREE_BUFFERED
+	if (node->IsInternalNode()) {
+	    std::vector<RtreeRecord>& buffer = Branch(node)->buffer;
+	    if (estimator != NULL) {
+		for (size_t i = 0; i < buffer.size(); ++i)
+		    estimator->Remove(&buffer[i].rect);
+	    }
+	    buffer.clear();
+	}
+#endif
+	std::vector<RtreeNode*> children;
+	if (node->IsInternalNode()) {
+	    for (uint32_t index = 0; index < node->count; ++index)
+		children.push_back(node->records[index].child);
+	}
+#ifdef RTREE_BUFFERED
+	bool queued = node->IsInternalNode() && Branch(node)->flush_queued;
+#endif
+	node->count = 0;
+	TouchNode(node);
+	node->unlock();
+	for (size_t i = 0; i < children.size(); ++i)
+	    DropSubtree(children[i], freed);
+#ifdef RTREE_BUFFERED
+	if (queued) {
+	    unflushed.push_back(node);
+	    return;
+	}
+#endif
+	freed.push_back(node);
+    }
+
+#ifdef RTREE_SNAPSHOT
+    const Rtree::Snapshot* Rtree::PinSnapshot()
+    {
+	pthread_mutex_lock(&quiesce_lock);
+	HoldWriters();
+
+	// No write is under way: the tree is whole, and every write from
+	// here on runs in the new epoch and saves what it changes
+	Snapshot* snapshot = new Snapshot;
+	snapshot->lsn = NextLsn();
+	snapshot->root = root;
+	pthread_mutex_lock(&snapshot_lock);
+	snapshots.push_back(snapshot);
+	if (pinned == 0)
+	    oldest = snapshot->lsn;
+	++pinned;
+	epoch = snapshot->lsn;
+	pthread_mutex_unlock(&snapshot_lock);
+	ReleaseWriters();
+	pthread_mutex_unlock(&quiesce_lock);
+	return snapshot;
+    }
+
+    void Rtree::ReleaseSnapshot(const Snapshot* snapshot)
+    {
+	pthread_mutex_lock(&snapshot_lock);
+	for (size_t i = 0; i < snapshots.size(); ++i) {
+	    if (snapshots[i] == snapshot) {
+		snapshots.erase(snapshots.begin() + i);
+		break;
+	    }
+	}
+	--pinned;
+	// Pinned in lsn order, the oldest is first
+	oldest = snapshots.empty() ? (uint64_t)-1 : snapshots[0]->lsn;
+	FreeRetired();
+	pthread_mutex_unlock(&snapshot_lock);
+	delete snapshot;
+
+	// Nodes no writer comes back to would keep their images for good:
+	// trim them all. Imaged nodes are added while this runs, never
+	// removed but here.
+	pthread_mutex_lock(&sweep_lock);
+	pthread_mutex_lock(&snapshot_lock);
+	std::vector<RtreeNode*> nodes(imaged_nodes);
+	pthread_mutex_unlock(&snapshot_lock);
+	std::vector<RtreeNode*> keep;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+	    RtreeNode* node = nodes[i];
+	    node->wrlock(); // not WriteLock: nothing changes to be saved
+	    TrimImages(node);
+	    if (node->images != NULL)
+		keep.push_back(node);
+	    else
+		node->imaged = false;
+	    node->unlock();
+	}
+	pthread_mutex_lock(&snapshot_lock);
+	keep.insert(keep.end(), imaged_nodes.begin() + nodes.size(),
+		    imaged_nodes.end());
+	imaged_nodes.swap(keep);
+	pthread_mutex_unlock(&snapshot_lock);
+	FreeRetiredNodes();
+	pthread_mutex_unlock(&sweep_lock);
+    }
+
+    // Keep the state of node that the snapshots pinned since its last
+    // image see, before the first change of the current epoch. Caller
+    // holds the node's write lock. The image is in place before any of
+    // the changes, which lets ReadImage copy the node itself unlocked.
+    void Rtree::SaveImage(RtreeNode* node)
+    {
+	RtreeNodeImage* image = new RtreeNodeImage;
+	image->level = node->level;
+	image->count = node->count;
+	image->lsn = node->lsn;
+	image->sibling = node->sibling;
+	for (uint32_t i = 0; i < node->count; ++i)
+	    image->records[i] = node->records[i];
+	image->from = node->image_epoch;
+	image->until = epoch;
+	image->next = node->images;
+	__sync_synchronize();
+	node->images = image;
+	node->image_epoch = epoch;
+	__sync_synchronize();
+	STAT_ADD(node_images, 1);
+
+	TrimImages(node);
+	if (!node->imaged) {
+	    node->imaged = true;
+	    pthread_mutex_lock(&snapshot_lock);
+	    imaged_nodes.push_back(node);
+	    pthread_mutex_unlock(&snapshot_lock);
+	}
+    }
+
+    // Unlink the images of node no pinned snapshot reads, those older
+    // than the oldest snapshot. A search may still be on its way to
+    // them, so they are retired rather than freed. Caller holds the
+    // node's write lock.
+    void Rtree::TrimImages(RtreeNode* node)
+    {
+	uint64_t limit = oldest;
+	RtreeNodeImage* volatile* link = &node->images;
+	while (*link != NULL && (*link)->until >= limit)
+	    link = &(*link)->next;
+	RtreeNodeImage* image = *link;
+	if (image == NULL)
+	    return;
+	*link = NULL;
+	pthread_mutex_lock(&snapshot_lock);
+	for (; image != NULL; image = image->next) {
+	    RetiredImage r;
+	    r.image = image;
+	    r.epoch = epoch;
+	    retired.push_back(r);
+	}
+	FreeRetired();
+	pthread_mutex_unlock(&snapshot_lock);
+    }
+
+    // Free the retired images no snapshot pinned before their retirement
+    // is left to read. Caller holds snapshot_lock.
+    void Rtree::FreeRetired()
+    {
+	size_t kept = 0;
+	for (size_t i = 0; i < retired.size(); ++i) {
+	    if (retired[i].epoch < oldest)
+		delete retired[i].image;
+	    else
+		retired[kept++] = retired[i];
+	}
+	retired.resize(kept);
+    }
+
+    // Free the nodes DeleteRange dropped at epoch, once no snapshot
+    // pinned before is left to read them. Takes nodes over.
+    void Rtree::RetireNodes(std::vector<RtreeNode*>& nodes, uint64_t epoch)
+    {
+	pthread_mutex_lock(&snapshot_lock);
+	if (!nodes.empty()) {
+	    retired_nodes.push_back(RetiredNodes());
+	    retired_nodes.back().nodes.swap(nodes);
+	    retired_nodes.back().epoch = epoch;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	// Not waiting out a sweep, which can take long: the nodes are then
+	// left to the next release or DeleteRange
+	if (pthread_mutex_trylock(&sweep_lock) == 0) {
+	    FreeRetiredNodes();
+	    pthread_mutex_unlock(&sweep_lock);
+	}
+    }
+
+    // Free the retired nodes no pinned snapshot reads, taking them off
+    // imaged_nodes. Caller holds sweep_lock, so no sweep is on them.
+    void Rtree::FreeRetiredNodes()
+    {
+	std::vector<RtreeNode*> nodes;
+	pthread_mutex_lock(&snapshot_lock);
+	size_t kept = 0;
+	for (size_t i = 0; i < retired_nodes.size(); ++i) {
+	    RetiredNodes& r = retired_nodes[i];
+	    if (r.epoch < oldest) {
+		nodes.insert(nodes.end(), r.nodes.begin(), r.nodes.end());
+	    } else {
+		retired_nodes[kept].nodes.swap(r.nodes);
+		retired_nodes[kept++].epoch = r.epoch;
+	    }
+	}
+	retired_nodes.resize(kept);
+	if (!nodes.empty()) {
+	    std::sort(nodes.begin(), nodes.end());
+	    kept = 0;
+	    for (size_t i = 0; i < imaged_nodes.size(); ++i) {
+		if (!std::binary_search(nodes.begin(), nodes.end(),
+					imaged_nodes[i]))
+		    imaged_nodes[kept++] = imaged_nodes[i];
+	    }
+	    imaged_nodes.resize(kept);
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	for (size_t i = 0; i < nodes.size(); ++i)
+	    FreeNode(nodes[i]);
+    }
+
+    // The state of node snapshot lsn sees: one of its images, or the
+    // node itself, copied into copy, if no write since the pin has
+    // changed it. The copy is taken without the lock and kept only if no
+    // image was saved meanwhile, as a writer saves one before it changes
+    // anything. NULL for a node made after the pin.
+    const Rtree::RtreeNodeImage* Rtree::ReadImage(RtreeNode* node,
+						  uint64_t lsn,
+						  RtreeNodeImage* copy)
+    {
+	while (true) {
+	    RtreeNodeImage* head = node->images;
+	    __sync_synchronize();
+	    if (head != NULL && head->until >= lsn) {
+		// Each image takes over where the next older one ends
+		RtreeNodeImage* image = head;
+		while (image->from >= lsn) {
+		    image = image->next;
+		    if (image == NULL)
+			return NULL;
+		}
+		return image;
+	    }
+	    copy->level = node->level;
+	    copy->count = node->count;
+	    copy->lsn = node->lsn;
+	    copy->sibling = node->sibling;
+	    if (copy->count > MAX_REC_NUM_PER_NODE) // torn, retried below
+		copy->count = MAX_REC_NUM_PER_NODE;
+	    for (uint32_t i = 0; i < copy->count; ++i)
+		copy->records[i] = node->records[i];
+	    __sync_synchronize();
+	    if (node->images == head)
+		return copy;
+	}
+    }
+
+    std::vector<Rtree::RtreeRecord> Rtree::Search(const Snapshot* snapshot,
+						  uint32_t min[DIMENSION],
+						  uint32_t max[DIMENSION])
+    {
+	RtreeRect rect;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.min[i] = min[i];
+	    rect.max[i] = max[i];
+	}
+
+	// A snapshot holds no split half done, so no right link is needed
+	std::vector<RtreeRecord> results;
+	std::vector<RtreeNode*> stk(1, snapshot->root);
+	RtreeNodeImage copy;
+	while (!stk.empty()) {
+	    RtreeNode* node = stk.back();
+	    stk.pop_back();
+	    const RtreeNodeImage* image = ReadImage(node, snapshot->lsn, &copy);
+	    if (image == NULL)
+		continue;
+	    for (uint32_t i = 0; i < image->count; ++i) {
+		const RtreeRecord* record = &image->records[i];
+		if (!Overlap(&rect, (RtreeRect*)&record->rect))
+		    continue;
+		if (image->level == 0)
+		    results.push_back(*record);
+		else
+		    stk.push_back(record->child);
+	    }
+	}
+	return results;
+    }
+#endif
+
+    void Rtree::Shape(std::vector<LevelShape>& shape, int budget)
+    {
+	int phase = EnterRead();
+	std::vector<RtreeNode*> nodes(1, root);
+	std::vector<RtreeNode*> children;
+	double count = 1;
+	unsigned int seed = 1;
+
+	shape.clear();
+	while (!nodes.empty()) {
+	    LevelShape level;
+	    uint64_t fanout = 0;
+	    double extent[DIMENSION] = { 0, };
+	    children.clear();
+	    for (size_t n = 0; n < nodes.size(); ++n) {
+		RtreeNode* node = nodes[n];
+		ReadLock(node);
+		level.level = node->level;
+		if (node->count > 0) {
+		    RtreeRect cover = NodeCover(node);
+		    for (int i = 0; i < DIMENSION; ++i) {
+			extent[i] += (double)cover.max[i] - cover.min[i] + 1;
+		    }
+		}
+		if (node->IsInternalNode()) {
+		    fanout += node->count;
+		    for (uint32_t index = 0; index < node->count; ++index) {
+			children.push_back(node->records[index].child);
+		    }
+		}
+		node->unlock();
+	    }
+	    level.nodes = count;
+	    for (int i = 0; i < DIMENSION; ++i) {
+		level.extent[i] = extent[i] / nodes.size();
+	    }
+	    shape.push_back(level);
+	    if (children.empty())
+		break;
+
+	    count = count * fanout / nodes.size();
+	    if ((int)children.size() > budget) {
+		for (int n = 0; n < budget; ++n) { // partial shuffle
+		    int pick = n + rand_r(&seed) % (children.size() - n);
+		    std::swap(children[n], children[pick]);
+		}
+		children.resize(budget);
+	    }
+	    nodes.swap(children);
+	}
+	ExitRead(phase);
+    }
+
+    struct Rtree::JoinJob {
+	Rtree* rtree;
+	Rtree* other;
+	JoinCallback callback;
+	void* arg;
+	ThreadPool* pool;
+	TaskGroup group;
+    };
+
+    struct Rtree::JoinTask {
+	JoinJob* job;
+	RtreeRecordLSN recA;
+	int levelA;
+	RtreeRecordLSN recB;
+	int levelB;
+    };
+
+    static bool CompareRecordMin(const Rtree::RtreeRecordLSN& recA,
+				 const Rtree::RtreeRecordLSN& recB)
+    {
+	return recA.record.rect.min[0] < recB.record.rect.min[0];
+    }
+
+    void Rtree::Join(Rtree* other, JoinCallback callback, void* arg,
+		     ThreadPool* pool)
+    {
+	JoinJob job;
+	job.rtree = this;
+	job.other = other;
+	job.callback = callback;
+	job.arg = arg;
+	job.pool = pool;
+
+	std::vector<RtreeRecordLSN> recsA, recsB;
+	int phaseA = EnterRead();
+	int phaseB = other->EnterRead();
+	RtreeNode* rootA = root;
+	RtreeNode* rootB = other->root;
+	int levelA = ReadNode(rootA, rootA->lsn, recsA);
+	int levelB = ReadNode(rootB, rootB->lsn, recsB);
+	JoinRecords(&job, recsA, levelA, recsB, levelB, pool != NULL);
+	if (pool != NULL)
+	    pool->Wait(&job.group);
+	other->ExitRead(phaseB);
+	ExitRead(phaseA);
+    }
+
+    // Copy out the records a node held when its parent recorded lsn,
+    // following the right-link chain if it has split since, each with
+    // the lsn of its child if any. Returns the level of the node.
+    int Rtree::ReadNode(RtreeNode* node, uint64_t lsn,
+			std::vector<RtreeRecordLSN>& records)
+    {
+	int level;
+	RtreeRecordLSN copy;
+	ReadLock(node);
+	while (true) {
+	    for (uint32_t index = 0; index < node->count; ++index) {
+		copy.record = node->records[index];
+		copy.lsn = node->IsInternalNode() ?
+		    Branch(node)->lsns[index] : 0;
+		records.push_back(copy);
+	    }
+	    if (node->lsn == lsn || node->sibling == NULL)
+		break;
+	    RtreeNode* prev = node;
+	    node = node->sibling;
+	    prev->unlock();
+	    ReadLock(node);
+	}
+	level = node->level;
+	node->unlock();
+	return level;
+    }
+
+    // Join two sets of sibling records with a plane sweep along the first
+    // dimension. Overlapping leaf pairs are reported; overlapping node
+    // pairs are descended, the higher side first when levels differ.
+    // With spawn set, every node pair becomes a task of the job.
+    void Rtree::JoinRecords(JoinJob* job, std::vector<RtreeRecordLSN>& recsA,
+			    int levelA, std::vector<RtreeRecordLSN>& recsB,
+			    int levelB, bool spawn)
+    {
+	std::sort(recsA.begin(), recsA.end(), CompareRecordMin);
+	std::sort(recsB.begin(), recsB.end(), CompareRecordMin);
+
+	size_t i = 0, j = 0;
+	while (i < recsA.size() && j < recsB.size()) {
+	    bool sweepA = (recsA[i].record.rect.min[0] <=
+			   recsB[j].record.rect.min[0]);
+	    RtreeRecordLSN* cur = sweepA ? &recsA[i] : &recsB[j];
+	    std::vector<RtreeRecordLSN>& others = sweepA ? recsB : recsA;
+	    for (size_t k = sweepA ? j : i; k < others.size() &&
+		     (others[k].record.rect.min[0] <=
+		      cur->record.rect.max[0]); ++k) {
+		if (!Overlap(&cur->record.rect, &others[k].record.rect))
+		    continue;
+		RtreeRecordLSN* recA = sweepA ? cur : &others[k];
+		RtreeRecordLSN* recB = sweepA ? &others[k] : cur;
+		if (levelA == 0 && levelB == 0) {
+		    job->callback(&recA->record, &recB->record, job->arg);
+		} else if (spawn) {
+		    JoinTask* task = new JoinTask;
+		    task->job = job;
+		    task->recA = *recA;
+		    task->levelA = levelA;
+		    task->recB = *recB;
+		    task->levelB = levelB;
+		    job->pool->Submit(JoinTaskRoutine, task, &job->group);
+		} else {
+		    JoinPair(job, recA, levelA, recB, levelB);
+		}
+	    }
+	    if (sweepA)
+		++i;
+	    else
+		++j;
+	}
+    }
+
+    // Descend one overlapping pair. Only children overlapping the other
+    // side's rectangle take part; a leaf record, or the lower side when
+    // levels differ, is joined as it is.
+    void Rtree::JoinPair(JoinJob* job, RtreeRecordLSN* recA, int levelA,
+			 RtreeRecordLSN* recB, int levelB)
+    {
+	std::vector<RtreeRecordLSN> recsA, recsB;
+	int childLevelA = levelA, childLevelB = levelB;
+
+	if (levelA > 0 && levelA >= levelB) {
+	    childLevelA = ReadNode(recA->record.child, recA->lsn, recsA);
+	    for (size_t k = 0; k < recsA.size(); ) {
+		if (Overlap(&recsA[k].record.rect, &recB->record.rect)) {
+		    ++k;
+		} else {
+		    recsA[k] = recsA.back();
+		    recsA.pop_back();
+		}
+	    }
+	} else {
+	    recsA.push_back(*recA);
+	}
+
+	if (levelB > 0 && levelB >= levelA) {
+	    childLevelB = job->other->ReadNode(recB->record.child, recB->lsn,
+					       recsB);
+	    for (size_t k = 0; k < recsB.size(); ) {
+		if (Overlap(&recsB[k].record.rect, &recA->record.rect)) {
+		    ++k;
+		} else {
+		    recsB[k] = recsB.back();
+		    recsB.pop_back();
+		}
+	    }
+	} else {
+	    recsB.push_back(*recB);
+	}
+
+	JoinRecords(job, recsA, childLevelA, recsB, childLevelB, false);
+    }
+
+    void Rtree::JoinTaskRoutine(void* arg)
+    {
+	JoinTask* task = (JoinTask*)arg;
+	JoinJob* job = task->job;
+	job->rtree->JoinPair(job, &task->recA, task->levelA,
+			     &task->recB, task->levelB);
+	delete task;
+    }
+
+    // bool Rtree::Save(std::ofstream& out)
+    //     void Rtree::Save()
+    //     {
+    // 	std::queue<RtreeNode*> nodeque;
+    // //	hd.write((char*)root, sizeof(RtreeNode));
+    // 	SaveNode(root);
+    // 	nodeque.push(root);
+    // 	SaveRec(nodeque);
+    // //	hd.close();
+    //     }
+
+    // bool Rtree::SaveRec(std::ofstream& out, std::queue<RtreeNode*> nodeque)
+    // void Rtree::SaveRec(std::queue<RtreeNode*> nodeque)
+    // {
+    // 	int size = nodeque.size();
+    // 	for (int i = 0; i < size; ++i) {
+    // 	    RtreeNode* node = nodeque.front();
+    // 	    if(node->IsInternalNode()) {
+    // 		for(int index=0; index < node->count; ++index) {
+    // 		    node->records[index].offset = hd.tellp();
+    // 		    // hd.write((char*)node->records[index].child,
+    // 		    // 	      sizeof(RtreeNode));
+    // 		    SaveNode(node->records[index].child);
+    // 		    nodeque.push(node->records[index].child);
+    // 		}
+    // 	    }
+    // 	    nodeque.pop();
+    // 	}
+
+    // 	if (!nodeque.empty())
+    // 	    SaveRec(nodeque);
+    // }
+
+    void Rtree::Load()
+    {
+	RtreeNode* node = LoadNode(root->offset);
+	if (node != NULL) {
+	    root = node;
+	    // Fingers still point into the old nodes
+	    tree_id = __sync_add_and_fetch(&next_tree_id, 1);
+	}
+    }
+
+    void Rtree::LoadRec(std::queue<RtreeNode*> nodeque)
+    {
+	int size = (int)nodeque.size();
+	for (int i = 0; i < size; ++i) {
+	    RtreeNode* node = nodeque.front();
+	    node = LoadNode(node->offset);
+	    if(node->IsInternalNode()) {
+		for(uint32_t index=0; index < node->count; ++index) {
+		    RtreeNode* child = NewNode(node->level - 1);
+		    nodeque.push(child);
+		    node->records[index].child = child;
+		}
+	    }
 	    nodeque.pop();
 	}
 
 	if (!nodeque.empty())
-	    NodeDump(nodeque);
+	    LoadRec(nodeque);
+    }
+
+    void Rtree::Dump()
+    {
+	if (root == NULL)
+	    Load();
+	AnalyzeJson(std::cout);
+    }
+
+    // Unlike CalcRectVolume, doubles do not overflow on large rectangles
+    double Rtree::RectVolume(RtreeRect* rect)
+    {
+	double volume = 1;
+	for (int i = 0; i < DIMENSION; ++i)
+	    volume *= (double)rect->max[i] - rect->min[i];
+	return volume;
+    }
+
+    // Volume of the union of rects[from..count) intersected with cover
+    // (NULL for none), by inclusion-exclusion over the subsets whose
+    // intersection is not empty.
+    double Rtree::UnionVolume(RtreeRect* rects, int count, int from,
+			      RtreeRect* cover)
+    {
+	double volume = 0;
+	for (int i = from; i < count; ++i) {
+	    RtreeRect inter = rects[i];
+	    if (cover != NULL) {
+		if (!Overlap(cover, &rects[i]))
+		    continue;
+		for (int d = 0; d < DIMENSION; ++d) {
+		    inter.min[d] = std::max(cover->min[d], rects[i].min[d]);
+		    inter.max[d] = std::min(cover->max[d], rects[i].max[d]);
+		}
+	    }
+	    double v = RectVolume(&inter);
+	    if (v == 0)
+		continue;
+	    volume += v - UnionVolume(rects, count, i + 1, &inter);
+	}
+	return volume;
+    }
+
+    void Rtree::Analyze(std::vector<LevelQuality>& levels)
+    {
+	levels.clear();
+	std::vector<RtreeNode*> level, next;
+	RtreeRect rects[MAX_REC_NUM_PER_NODE];
+	int phase = EnterRead();
+	level.push_back(root);
+	while (!level.empty()) {
+	    LevelQuality q;
+	    memset(&q, 0, sizeof(q));
+	    q.level = level[0]->level;
+	    uint64_t nonroot = 0;
+	    next.clear();
+	    for (size_t i = 0; i < level.size(); ++i) {
+		RtreeNode* node = level[i];
+		node->rdlock();
+		int count = node->count;
+		bool isroot = (node == root);
+		for (int j = 0; j < count; ++j) {
+		    rects[j] = node->records[j].rect;
+		    if (node->IsInternalNode())
+			next.push_back(node->records[j].child);
+		}
+		node->unlock();
+
+		q.nodes++;
+		q.entries += count;
+		if (!isroot) {
+		    nonroot++;
+		    if (count < MIN_REC_NUM_PER_NODE)
+			q.underfull++;
+		}
+		if (count == 0)
+		    continue;
+		RtreeRect cover = rects[0];
+		double sum = 0;
+		for (int j = 0; j < count; ++j) {
+		    cover = CombineRect(&cover, &rects[j]);
+		    sum += RectVolume(&rects[j]);
+		    for (int k = j + 1; k < count; ++k) {
+			if (!Overlap(&rects[j], &rects[k]))
+			    continue;
+			RtreeRect inter;
+			for (int d = 0; d < DIMENSION; ++d) {
+			    inter.min[d] = std::max(rects[j].min[d], rects[k].min[d]);
+			    inter.max[d] = std::min(rects[j].max[d], rects[k].max[d]);
+			}
+			q.overlap += RectVolume(&inter);
+		    }
+		}
+		double covered = UnionVolume(rects, count, 0, NULL);
+		double volume = RectVolume(&cover);
+		q.volume += volume;
+		q.excess += sum - covered;
+		q.dead_space += volume - covered;
+		for (int d = 0; d < DIMENSION; ++d)
+		    q.margin += (double)cover.max[d] - cover.min[d];
+	    }
+	    q.fill = (double)q.entries / (q.nodes * MAX_REC_NUM_PER_NODE);
+	    q.underfull = nonroot ? q.underfull / nonroot : 0;
+	    q.margin /= q.nodes;
+	    levels.push_back(q);
+	    level.swap(next);
+	}
+	ExitRead(phase);
+    }
+
+    void Rtree::AnalyzeJson(std::ostream& out)
+    {
+	std::vector<LevelQuality> levels;
+	Analyze(levels);
+	out << "{\"height\": " << levels.size() << ", \"levels\": [";
+	for (size_t i = 0; i < levels.size(); ++i) {
+	    LevelQuality& q = levels[i];
+	    out << (i ? ", " : "") << "{\"level\": " << q.level
+		<< ", \"nodes\": " << q.nodes
+		<< ", \"entries\": " << q.entries
+		<< ", \"fill\": " << q.fill
+		<< ", \"underfull\": " << q.underfull
+		<< ", \"volume\": " << q.volume
+		<< ", \"overlap\": " << q.overlap
+		<< ", \"excess\": " << q.excess
+		<< ", \"dead_space\": " << q.dead_space
+		<< ", \"margin\": " << q.margin << "}";
+	}
+	out << "]}" << std::endl;
     }
 }
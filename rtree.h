@@ -30,12 +30,23 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 
 //#include "mempool.h"
 
+// Contended lock acquisitions are timed for the profiler and the tracer
+#if defined(RTREE_LOCK_PROFILE) || defined(RTREE_TRACE)
+#define RTREE_TIME_LOCK_WAITS
+#endif
+
 namespace cmpt740 {
 
     class Mempool;
+    class ThreadPool;
+    struct TaskGroup;
+    class SelectivityEstimator;
+    class ResultCache;
+    class OpRecorder;
 
     namespace internal {
         #define LEAF_LEVEL 0
@@ -48,16 +59,52 @@ namespace cmpt740 {
 
         #define MAX_REC_NUM_PER_NODE 6
         #define MIN_REC_NUM_PER_NODE (MAX_REC_NUM_PER_NODE / 2)
+	// Lowest level whose children a parallel search hands out as tasks
+	#define PARALLEL_SEARCH_TASK_LEVEL 2
+	// Levels kept apart in per-level counters; higher ones share the last
+	#define RTREE_STATS_LEVELS 16
+	// Lock wait histogram buckets, bucket i holds waits < 2^i ns
+	#define LOCK_WAIT_BUCKETS 32
+	// Counter slots, threads beyond this share a slot
+	#define RTREE_STATS_SLOTS 64
+	// Buffered records that make an internal node flush to its children,
+	// and the root backlog at which inserting threads flush themselves
+	#define NODE_BUFFER_SIZE 64
+	#define NODE_BUFFER_BACKLOG (8 * NODE_BUFFER_SIZE)
+	// Node latch word: the writer bit, else the number of readers
+	#define RTREE_LATCH_WRITER (1ULL << 63)
+	// Failed attempts at a latch before the thread yields between them
+	#define RTREE_LATCH_SPINS 64
 	typedef void* data_t;
+
+	// In-memory mode: internal nodes keep their child rectangles
+	// quantized to RTREE_QUANTIZE_BITS (8 or 16) bits relative to the
+	// node's own cover, so searches touch fewer cache lines above the
+	// leaves.
+#ifdef RTREE_QUANTIZE_BITS
+#if RTREE_QUANTIZE_BITS == 8
+	typedef uint8_t qcoord_t;
+#elif RTREE_QUANTIZE_BITS == 16
+	typedef uint16_t qcoord_t;
+#else
+#error "RTREE_QUANTIZE_BITS must be 8 or 16"
+#endif
+	#define QUANTIZE_MAX ((1 << RTREE_QUANTIZE_BITS) - 1)
+#endif
+#if defined(RTREE_BUFFERED) && defined(RTREE_AGGREGATE)
+#error "RTREE_BUFFERED keeps no aggregates of buffered records"
+#endif
+#if defined(RTREE_BUFFERED) && defined(RTREE_SNAPSHOT)
+#error "RTREE_SNAPSHOT keeps no images of node buffers"
+#endif
     }
 
     using namespace internal;
 
     class Rtree {
     public:
-	static long global_lsn;
 	struct RtreeNode; // forward declaration
-    protected:
+
 	// Rtree rectangle
         struct RtreeRect {
 	    uint32_t max[DIMENSION];
@@ -71,28 +118,60 @@ namespace cmpt740 {
             }
         };
 
+#ifdef RTREE_QUANTIZE_BITS
+	// Rectangle quantized against the cover of the node holding it
+	struct RtreeQRect {
+	    qcoord_t min[DIMENSION];
+	    qcoord_t max[DIMENSION];
+	};
+#endif
+
     public:
-	// Rtree record
+#ifdef RTREE_SNAPSHOT
+	struct RtreeNodeImage; // forward declaration
+#endif
+
+	// Rtree record: a leaf entry, or the rectangle and child of an
+	// internal one, whose lsn the node keeps apart
         struct RtreeRecord {
 	    struct RtreeRect rect;
 	    union{
 	        RtreeNode* child;
 		data_t* data;
             };
-	    long offset;
-	    uint64_t lsn;
-	    RtreeRecord(){this->child = NULL; this->data = NULL; offset = -1;}
+#ifdef RTREE_AGGREGATE
+	    // Leaf: one entry and its weight. Internal: totals of the subtree.
+	    uint64_t agg_count;
+	    uint64_t agg_sum;
+	    RtreeRecord(){this->child = NULL; this->data = NULL;
+		agg_count = 1; agg_sum = 1;}
+#else
+	    RtreeRecord(){this->child = NULL; this->data = NULL;}
+#endif
         };
 
-	// Rtree node
+	// Rtree node, as leaves are laid out. Internal nodes are
+	// RtreeBranch, which adds what only they use.
         struct RtreeNode {
 	    int32_t level;
 	    uint32_t count;
 	    long offset;
 	    uint64_t lsn;
+	    uint64_t version; // bumped whenever the records change
+	    volatile uint64_t latch; // RTREE_LATCH_WRITER or the readers
+#ifdef RTREE_LOCK_PROFILE
+	    uint64_t lock_waits;   // contended acquisitions
+	    uint64_t lock_wait_ns; // time spent waiting in them
+#endif
 	    RtreeNode* parent;
 	    RtreeNode* sibling;
-	    pthread_rwlock_t lock;
+#ifdef RTREE_SNAPSHOT
+	    // Saved states, newest first, for the snapshots that must not
+	    // see the changes made since; see SaveImage
+	    RtreeNodeImage* volatile images;
+	    uint64_t image_epoch; // epoch of the last change that saved one
+	    bool imaged;          // listed in Rtree::imaged_nodes
+#endif
             struct RtreeRecord records[MAX_REC_NUM_PER_NODE];
             bool IsInternalNode() { return (level > 0); }
             bool IsLeaf() { return (level == 0); }
@@ -101,24 +180,113 @@ namespace cmpt740 {
 		count = 0;
 		offset = -1;
 		lsn = -1;
+		version = 0;
+#ifdef RTREE_LOCK_PROFILE
+		lock_waits = 0;
+		lock_wait_ns = 0;
+#endif
+		latch = 0;
 		parent = NULL;
 		sibling = NULL;
-		pthread_rwlock_init(&lock, NULL);
+#ifdef RTREE_SNAPSHOT
+		images = NULL;
+		image_epoch = 0;
+		imaged = false;
+#endif
             }
+	    // A spinning reader-writer latch. Readers come in while no
+	    // writer holds it, as with the default pthread rwlock.
+	    bool tryrdlock() {
+		uint64_t word = latch;
+		return ((word & RTREE_LATCH_WRITER) == 0 &&
+			__sync_bool_compare_and_swap(&latch, word, word + 1));
+	    }
+	    bool trywrlock() {
+		return (latch == 0 &&
+			__sync_bool_compare_and_swap(&latch, 0,
+						     RTREE_LATCH_WRITER));
+	    }
 	    void rdlock() {
-	        pthread_rwlock_rdlock(&lock);
+		for (int spins = 0; !tryrdlock(); ++spins) {
+		    if (spins >= RTREE_LATCH_SPINS)
+			sched_yield();
+		}
             }
 	    void wrlock() {
-	        pthread_rwlock_wrlock(&lock);
+		for (int spins = 0; !trywrlock(); ++spins) {
+		    if (spins >= RTREE_LATCH_SPINS)
+			sched_yield();
+		}
             }
+	    // Only a writer sets the writer bit, so seeing it means the
+	    // caller is the writer.
 	    void unlock() {
-	        pthread_rwlock_unlock(&lock);
-            }
-	    ~RtreeNode() {
-		pthread_rwlock_destroy(&lock);
+		if (latch & RTREE_LATCH_WRITER)
+		    __sync_lock_release(&latch);
+		else
+		    __sync_sub_and_fetch(&latch, 1);
             }
         };
 
+	// Internal node
+	struct RtreeBranch : public RtreeNode {
+	    // Lsn of records[i].child as of when the record was last
+	    // written; the child shows another one if it split since
+	    uint64_t lsns[MAX_REC_NUM_PER_NODE];
+#ifdef RTREE_QUANTIZE_BITS
+	    RtreeRect qcover; // cover the quantized rects are relative to
+	    RtreeQRect qrects[MAX_REC_NUM_PER_NODE];
+#endif
+#ifdef RTREE_BUFFERED
+	    // Records on their way down, covered by the node's cover like
+	    // its own records
+	    std::vector<RtreeRecord> buffer;
+	    bool flush_queued;
+#endif
+	    RtreeBranch() {
+		for (int i = 0; i < MAX_REC_NUM_PER_NODE; ++i)
+		    lsns[i] = 0;
+#ifdef RTREE_BUFFERED
+		flush_queued = false;
+#endif
+	    }
+	};
+
+#ifdef RTREE_SNAPSHOT
+	// A node as it was before the changes of epochs from+1 to until:
+	// what snapshots from+1 to until see of it
+	struct RtreeNodeImage {
+	    int32_t level;
+	    uint32_t count;
+	    uint64_t lsn;
+	    uint64_t from;
+	    uint64_t until;
+	    RtreeNode* sibling;
+	    RtreeNodeImage* next;
+	    RtreeRecord records[MAX_REC_NUM_PER_NODE];
+	};
+
+	// A pinned snapshot: the tree as the operations finished before
+	// PinSnapshot left it
+	struct Snapshot {
+	    uint64_t lsn;
+	    RtreeNode* root;
+	};
+#endif
+
+	// A node and the version it had when a query read it
+	struct RtreeNodeVersion {
+	    RtreeNode* node;
+	    uint64_t version;
+	};
+
+	// A record copied out of a node, with the lsn an internal node
+	// keeps for the child
+	struct RtreeRecordLSN {
+	    RtreeRecord record;
+	    uint64_t lsn;
+	};
+
     protected:
 
 	struct RtreeNodeLSN {
@@ -126,6 +294,22 @@ namespace cmpt740 {
 	    uint64_t lsn;
         };
 
+	// A node for QueryRange to visit; whole when every record below it
+	// matches without being tested
+	struct RtreeQueryEntry {
+	    RtreeNode* node;
+	    uint64_t lsn;
+	    bool whole;
+	};
+
+	struct SearchJob;  // one parallel range query
+	struct SearchTask; // a subtree of a parallel range query
+	struct JoinJob;    // one spatial join
+	struct JoinTask;   // a top-level node pair of a spatial join
+#ifdef RTREE_BUFFERED
+	struct FlushTask;  // one node buffer to push down
+#endif
+
 	// Variables for finding a split partition
 	struct PartitionVars
 	{
@@ -137,6 +321,7 @@ namespace cmpt740 {
 	    RtreeRect cover[2];
 	    uint64_t area[2];
 	    RtreeRecord recordBuf[MAX_REC_NUM_PER_NODE+1];
+	    uint64_t lsnBuf[MAX_REC_NUM_PER_NODE+1];
 	    int recordCount;
 	    RtreeRect coverSplit;
 	    uint64_t coverSplitArea;
@@ -144,36 +329,284 @@ namespace cmpt740 {
 
 
     public:
-	Rtree();
+	// filename is the backing file used by Save/Load; NULL keeps the
+	// tree purely in memory.
+	Rtree(const char* filename = "rtree.dat");
         virtual ~Rtree();
         bool Insert(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data);
+#ifdef RTREE_AGGREGATE
+	bool Insert(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data,
+		    uint64_t weight);
+#endif
 	bool Delete(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data);
+	// Remove every record inside the window; unlike Delete, records
+	// that only overlap it stay. Subtrees whose rectangle lies inside
+	// are unlinked whole, without being descended. Inserts and deletes
+	// are held back for the duration; searches keep running. Returns
+	// whether anything was removed. Not streamed to a recorder.
+	bool DeleteRange(uint32_t min[DIMENSION], uint32_t max[DIMENSION]);
 	std::vector<Rtree::RtreeRecord> Search(uint32_t min[DIMENSION],
 	                                       uint32_t max[DIMENSION]);
+	// Range query returning every overlapping record. Subtrees found in
+	// the upper levels are searched as tasks on pool; NULL runs the
+	// whole query on the calling thread.
+	std::vector<Rtree::RtreeRecord> ParallelSearch(uint32_t min[DIMENSION],
+						       uint32_t max[DIMENSION],
+						       ThreadPool* pool);
+
+	// How Query and Exists match a record's rectangle against the window
+	enum QueryPredicate {
+	    QUERY_OVERLAP,  // they share a point
+	    QUERY_WITHIN,   // the record lies inside the window
+	    QUERY_CONTAINS  // the record covers the window; for a point, pass
+			    // it as both min and max
+	};
+	// Every record matching predicate. Subtrees are pruned as tightly as
+	// the predicate allows: QUERY_CONTAINS only descends into children
+	// covering the window, and QUERY_WITHIN takes whole subtrees inside
+	// the window without testing their records.
+	std::vector<Rtree::RtreeRecord> Query(uint32_t min[DIMENSION],
+					      uint32_t max[DIMENSION],
+					      QueryPredicate predicate);
+	// Whether any record matches predicate; stops at the first.
+	bool Exists(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+		    QueryPredicate predicate = QUERY_OVERLAP);
+
+	// Number of records overlapping the window. With RTREE_AGGREGATE,
+	// subtrees inside the window are counted from their parent's record
+	// without being descended.
+	uint64_t Count(uint32_t min[DIMENSION], uint32_t max[DIMENSION]);
+#ifdef RTREE_AGGREGATE
+	// Total weight of the records overlapping the window.
+	uint64_t Sum(uint32_t min[DIMENSION], uint32_t max[DIMENSION]);
+#endif
+
+	// Shape of one level of the tree, see Shape()
+	struct LevelShape {
+	    int level;
+	    double nodes;              // number of nodes, estimated
+	    double extent[DIMENSION];  // average node extent
+	};
+	// Describe every level from the root down. Levels with more than
+	// budget nodes are sampled: budget random children of the sampled
+	// level above are inspected and the node count is scaled by the
+	// average fanout.
+	void Shape(std::vector<LevelShape>& shape, int budget);
+	// Counters summed over all threads. Only collected when built with
+	// RTREE_STATS, otherwise all zero.
+	struct RtreeStats {
+	    uint64_t searches;
+	    uint64_t search_nodes;    // nodes visited by Search
+	    uint64_t sibling_chases;  // right-links followed on lsn mismatch
+	    uint64_t inserts;
+	    uint64_t finger_inserts;  // inserts that skipped the descent
+	    uint64_t deletes;
+	    uint64_t subtrees_dropped; // unlinked whole by DeleteRange
+	    uint64_t splits[RTREE_STATS_LEVELS]; // by level of the split node
+	    uint64_t extern_parent;   // levels climbed by ExternParent
+	    uint64_t update_parent;   // levels climbed by UpdateParent
+	    uint64_t enlarge_down;    // parent records grown on descent
+	    uint64_t buffer_flushes;  // node buffers pushed down a level
+	    uint64_t buffer_retries;  // reads done again, a flush overlapping
+	    uint64_t node_images;     // node states saved for snapshots
+	    uint64_t root_changes;
+	    uint64_t read_locks;
+	    uint64_t write_locks;
+	};
+	RtreeStats GetStats();
+	void ResetStats();
+
+	// Node lock waits, only collected when built with
+	// RTREE_LOCK_PROFILE. Index 0 is read locks, 1 write locks; only
+	// acquisitions that found the lock taken are counted.
+	struct LockWaitStats {
+	    uint64_t waits[2][RTREE_STATS_LEVELS];
+	    uint64_t wait_ns[2][RTREE_STATS_LEVELS];
+	    uint64_t hist[2][RTREE_STATS_LEVELS][LOCK_WAIT_BUCKETS];
+	};
+	struct ContendedNode {
+	    RtreeNode* node;
+	    int level;
+	    uint64_t waits;
+	    uint64_t wait_ns;
+	};
+	LockWaitStats GetLockWaits();
+	// The n nodes with the longest total wait, longest first
+	void TopContendedNodes(std::vector<ContendedNode>& top, size_t n);
+	// Print the histograms and the top n nodes
+	void DumpLockProfile(size_t n = 10);
+	void ResetLockProfile();
+	// Serve Search from cache (NULL detaches). An entry stays valid
+	// while none of the nodes its query read has changed since.
+	void AttachResultCache(ResultCache* cache);
+	// Keep estimator up to date on Insert and Delete (NULL detaches).
+	// Records already in the tree are not added to it.
+	void AttachEstimator(SelectivityEstimator* estimator);
+	// Stream every Insert, Delete and Search to recorder (NULL
+	// detaches), for replay with testsuit/replay.
+	void AttachRecorder(OpRecorder* recorder);
+#ifdef RTREE_BUFFERED
+	// Buffer-tree mode: Insert appends to the root's buffer, and a full
+	// buffer is pushed one level down in bulk, the level above the
+	// leaves into the leaves. Searches, ParallelSearch, Count and Delete
+	// also look at the buffers on their way. Flushes run as tasks on pool
+	// (NULL flushes on the inserting thread). ParallelSearch given the
+	// same pool searches on the calling thread alone: waiting for its
+	// tasks it could pick up a flush, which may wait for the search.
+	void AttachFlushPool(ThreadPool* pool);
+	// Push the buffered records into the leaves; records inserted
+	// meanwhile may stay buffered. Join, Analyze, Shape and Save only
+	// see records that have reached the leaves.
+	void Flush();
+#endif
+#ifdef RTREE_SNAPSHOT
+	// Pin the tree as the operations finished so far left it. Waits for
+	// the inserts and deletes under way to end, and holds new ones back
+	// meanwhile. The snapshot is named by a fresh lsn; searching it
+	// takes no locks and never waits, and writers save a node's state
+	// once, the first time they change it after the pin.
+	const Snapshot* PinSnapshot();
+	// Node states only the released snapshot needed are freed.
+	void ReleaseSnapshot(const Snapshot* snapshot);
+	// Every record of the snapshot overlapping the window
+	std::vector<Rtree::RtreeRecord> Search(const Snapshot* snapshot,
+					       uint32_t min[DIMENSION],
+					       uint32_t max[DIMENSION]);
+#endif
+
+	// Called once per overlapping pair of a spatial join, from any
+	// thread of the pool: a is a record of this tree, b of the other.
+	typedef void (*JoinCallback)(RtreeRecord* a, RtreeRecord* b, void* arg);
+	// Synchronized-traversal spatial join with another tree. Node pairs
+	// whose rectangles do not overlap are pruned; pairs below the roots
+	// are spread over pool (NULL joins on the calling thread).
+	void Join(Rtree* other, JoinCallback callback, void* arg,
+		  ThreadPool* pool);
+
+	// Quality of one level of the tree, see Analyze()
+	struct LevelQuality {
+	    int level;
+	    uint64_t nodes;
+	    uint64_t entries;
+	    double fill;        // average entries per node over the maximum
+	    double underfull;   // fraction of non-root nodes below the minimum
+	    double volume;      // total volume of the node covers
+	    double overlap;     // pairwise intersections of entries in a node
+	    double excess;      // entry volume covered more than once
+	    double dead_space;  // node volume covered by none of its entries
+	    double margin;      // average sum of the node cover extents
+	};
+	// Per-level statistics, root first. Nodes are read one at a time
+	// under their read lock, so writers keep running; nodes split
+	// during the walk may be missed or counted twice.
+	void Analyze(std::vector<LevelQuality>& levels);
+	// Analyze() as a JSON object
+	void AnalyzeJson(std::ostream& out);
 
 	void Save();
 	void Load();
+	// AnalyzeJson() to stdout
         void Dump();
 
     protected:
+	uint64_t NextLsn();
+	void ReadLock(RtreeNode* node);
+	void WriteLock(RtreeNode* node);
+#ifdef RTREE_TIME_LOCK_WAITS
+	void RecordLockWait(RtreeNode* node, int mode, uint64_t start,
+			    uint64_t end);
+#endif
+#ifdef RTREE_STATS
+	struct StatsSlot {
+	    RtreeStats stats;
+	    char pad[64]; // keep slots of different threads apart
+	};
+	RtreeStats* StatsOfThread();
+#endif
+	// Operations under way on the threads sharing a slot. Readers count
+	// in the half of the current read phase, see WaitReaders.
+	struct OpSlot {
+	    volatile long readers[2];
+	    volatile long writers;
+	    char pad[64]; // keep slots of different threads apart
+	};
+	OpSlot* OpSlotOfThread();
+	int EnterRead();
+	void ExitRead(int phase);
+	void EnterWrite();
+	void ExitWrite();
+	void HoldWriters();
+	void ReleaseWriters();
+	void WaitReaders();
+#ifdef RTREE_BUFFERED
+	bool ClearNode(RtreeNode* node, RtreeRect* rect,
+		       std::vector<RtreeNode*>& dropped,
+		       std::vector<RtreeRecord>& homeless);
+#else
+	bool ClearNode(RtreeNode* node, RtreeRect* rect,
+		       std::vector<RtreeNode*>& dropped);
+#endif
+	void DropSubtree(RtreeNode* node, std::vector<RtreeNode*>& freed);
+#ifdef RTREE_SNAPSHOT
+	struct RetiredImage {
+	    RtreeNodeImage* image;
+	    uint64_t epoch; // snapshots up to this one may still read it
+	};
+	struct RetiredNodes {
+	    std::vector<RtreeNode*> nodes; // dropped by one DeleteRange
+	    uint64_t epoch; // snapshots up to this one may still read them
+	};
+	void SaveImage(RtreeNode* node);
+	void TrimImages(RtreeNode* node);
+	void FreeRetired();
+	void RetireNodes(std::vector<RtreeNode*>& nodes, uint64_t epoch);
+	void FreeRetiredNodes();
+	const RtreeNodeImage* ReadImage(RtreeNode* node, uint64_t lsn,
+					RtreeNodeImage* copy);
+#endif
 	void Reset();
         void FreeNode(RtreeNode* node);
         void RemoveAllRec(RtreeNode* node);
 	void InitNode(RtreeNode* node);
 	void InitRect(RtreeRect* rect);
 	bool InsertRecord(RtreeRecord* record, RtreeNode** node);
+	RtreeNode* FingerLeaf(RtreeRecord* record);
+	void SetFinger(RtreeNode* leaf);
 	RtreeNode* FindLeaf(RtreeNode* node, RtreeRecord* record, uint64_t lsn);
+#ifdef RTREE_PREENLARGE
+	RtreeNode* FindLeafEnlarging(RtreeNode* node, RtreeRecord* record,
+				     uint64_t lsn, bool* covered);
+#endif
 	void ExternParent(RtreeNode* p, uint64_t p_lsn,
 	                  RtreeNode* q, uint64_t q_lsn);
 	void UpdateParent(RtreeNode* node, RtreeRect rect);
 	RtreeRect NodeCover(RtreeNode* node);
+	void TouchNode(RtreeNode* node);
 	bool isRectCoverChanged(RtreeRect* rectA, RtreeRect* rectB);
-	bool AddRecord(RtreeRecord* record, RtreeNode* node, RtreeNode** newNode);
+	bool ParentNeedsUpdate(RtreeRect* rectA, RtreeRect* rectB);
+#ifdef RTREE_AGGREGATE
+	void AggregateNode(RtreeNode* node, RtreeRecord* record);
+#endif
+	void AggregateRange(RtreeRect* rect, uint64_t* count, uint64_t* sum);
+	void AggregateNodes(RtreeRect* rect, uint64_t* count, uint64_t* sum);
+	bool QueryNodes(RtreeRect* rect, QueryPredicate predicate,
+			std::vector<RtreeRecord>* results);
+	bool QueryRange(RtreeRect* rect, QueryPredicate predicate,
+			std::vector<RtreeRecord>* results);
+	bool Matches(RtreeRect* rect, RtreeRect* window,
+		     QueryPredicate predicate);
+	static RtreeBranch* Branch(RtreeNode* node) {
+	    return static_cast<RtreeBranch*>(node);
+	}
+	RtreeNode* NewNode(int32_t level);
+	bool AddRecord(RtreeRecord* record, uint64_t lsn, RtreeNode* node,
+		       RtreeNode** newNode);
 	int PickRecord(RtreeRect* rect, RtreeNode* node);
 	RtreeRect CombineRect(RtreeRect* rectA, RtreeRect* rectB);
-	void SplitNode(RtreeNode* node, RtreeRecord* record, RtreeNode** newNode);
+	void SplitNode(RtreeNode* node, RtreeRecord* record, uint64_t lsn,
+		       RtreeNode** newNode);
 	uint64_t CalcRectVolume(RtreeRect* rect);
-	void GetRecords(RtreeNode* node, RtreeRecord* record,
+	void GetRecords(RtreeNode* node, RtreeRecord* record, uint64_t lsn,
 			PartitionVars* parVars);
 	void ChoosePartition(PartitionVars* parVars, int minFill);
 	void LoadNodes(RtreeNode* nodeA, RtreeNode* nodeB, PartitionVars* parVars);
@@ -183,11 +616,33 @@ namespace cmpt740 {
 
 	bool Overlap(RtreeRect* rectA, RtreeRect* rectB);
 	bool Inside(RtreeRect* rectA, RtreeRect* rectB);
-	std::vector<Rtree::RtreeRecord> SearchRecord(RtreeRecord* record);
+#ifdef RTREE_QUANTIZE_BITS
+	void QuantizeNode(RtreeNode* node);
+	bool QuantizeQuery(RtreeRect* rect, RtreeNode* node, RtreeQRect* qrect);
+	bool QOverlap(RtreeQRect* rectA, RtreeQRect* rectB);
+#endif
+	std::vector<Rtree::RtreeRecord> SearchRecord(RtreeRecord* record,
+						     std::vector<RtreeNodeVersion>* deps);
+	void SearchRecordInTree(RtreeRecord* record,
+				std::vector<Rtree::RtreeRecord>& results,
+				std::vector<RtreeNodeVersion>* deps);
 	void SearchRecordInNode(RtreeRecord* record,
 	                        std::stack<Rtree::RtreeNodeLSN*>& stk,
-	                        std::vector<Rtree::RtreeRecord>& results);
-	void NodeDump(std::queue<RtreeNode*> nodeque);
+				std::vector<Rtree::RtreeRecord>& results,
+				std::vector<RtreeNodeVersion>* deps);
+	static void SearchTaskRoutine(void* arg);
+	void SearchSubtree(SearchJob* job, RtreeNode* node, uint64_t lsn);
+	int ReadNode(RtreeNode* node, uint64_t lsn,
+		     std::vector<RtreeRecordLSN>& records);
+	void JoinRecords(JoinJob* job, std::vector<RtreeRecordLSN>& recsA,
+			 int levelA, std::vector<RtreeRecordLSN>& recsB,
+			 int levelB, bool spawn);
+	void JoinPair(JoinJob* job, RtreeRecordLSN* recA, int levelA,
+		      RtreeRecordLSN* recB, int levelB);
+	static void JoinTaskRoutine(void* arg);
+	static double RectVolume(RtreeRect* rect);
+	double UnionVolume(RtreeRect* rects, int count, int from,
+			   RtreeRect* cover);
 
 	void SaveRoot(RtreeNode* node);
 	long SaveNode(RtreeNode* node);
@@ -197,10 +652,77 @@ namespace cmpt740 {
 
 	bool DeleteRecord(RtreeRecord* record, RtreeNode** node);
 	void DisconnectRecord(RtreeNode* node, int index);
+#ifdef RTREE_BUFFERED
+	bool BufferRecord(RtreeRecord* record);
+	void ScheduleFlush(RtreeNode* node);
+	static void FlushTaskRoutine(void* arg);
+	void FlushSubtree(RtreeNode* node, uint64_t lsn);
+	void FlushNode(RtreeNode* node, bool inline_below);
+	void FlushToLeaf(RtreeNode* leaf, std::vector<RtreeRecord>& records);
+	int PickHalf(RtreeRect* rect, std::vector<RtreeNode*>& nodes);
+	void SplitBuffer(RtreeNode* nodeA, RtreeNode* nodeB);
+	bool DeleteBuffered(RtreeRecord* record);
+	void BeginMove();
+	void EndMove();
+	void HoldMoves();
+	void ReleaseMoves();
+	bool StartBufferedRead(uint64_t* moves);
+	bool RetryBufferedRead(uint64_t moves, bool* held);
+#endif
 
     private:
         RtreeNode* root;
 	Mempool* mempool;
+	uint64_t tree_lsn; // LSN counter, private to each tree
+	uint64_t tree_id;  // unique over the process, names the tree in fingers
+	SelectivityEstimator* estimator;
+	ResultCache* cache;
+	OpRecorder* recorder;
+#ifdef RTREE_BUFFERED
+	ThreadPool* flush_pool;
+	TaskGroup* flush_group;
+	// Records move between levels only between BeginMove and EndMove,
+	// many moves at once. A query never waits for them: it reads the
+	// buffers freely and is done again, holding new moves back, if one
+	// overlapped it and so may have shown it a record twice or not at
+	// all.
+	volatile uint64_t moves_begun;
+	volatile uint64_t moves_ended;
+	volatile int move_holds;
+#endif
+	// Operations announce themselves in slots. Holding raises holding
+	// and waits for the writers to leave, so that every insert and
+	// delete lies wholly before or after what the holder does.
+	OpSlot* op_slots;
+	volatile int read_phase;
+	volatile int holding;
+	pthread_mutex_t quiesce_lock; // one holder at a time
+	// Bumped by DeleteRange before it frees nodes, invalidates the
+	// insert fingers and the cached results
+	volatile uint64_t generation;
+#ifdef RTREE_BUFFERED
+	// Nodes DeleteRange dropped while a flush of theirs was queued,
+	// freed by a later DeleteRange once the flush has run; see
+	// DropSubtree. Under quiesce_lock.
+	std::vector<RtreeNode*> unflushed;
+#endif
+#ifdef RTREE_SNAPSHOT
+	volatile uint64_t epoch;  // lsn of the latest snapshot pinned
+	volatile uint64_t oldest; // lsn of the oldest pinned, or -1
+	volatile long pinned;
+	std::vector<Snapshot*> snapshots;
+	std::vector<RtreeNode*> imaged_nodes;
+	std::vector<RetiredImage> retired;
+	std::vector<RetiredNodes> retired_nodes;
+	pthread_mutex_t sweep_lock;    // one sweep of imaged_nodes at a time
+	pthread_mutex_t snapshot_lock; // snapshots, imaged_nodes, retired*
+#endif
+#ifdef RTREE_STATS
+	StatsSlot* stats;
+#endif
+#ifdef RTREE_LOCK_PROFILE
+	LockWaitStats* lock_waits;
+#endif
     };
 }
 
@@ -0,0 +1,177 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sharded_rtree.h"
+
+namespace cmpt740 {
+
+    static bool RectOverlap(Rtree::RtreeRect* rectA, Rtree::RtreeRect* rectB)
+    {
+	for (int index = 0; index < DIMENSION; ++index) {
+	    if (rectA->min[index] > rectB->max[index] ||
+		rectB->min[index] > rectA->max[index]) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    ShardedRtree::ShardedRtree(uint32_t min[DIMENSION],
+			       uint32_t max[DIMENSION],
+			       int cells[DIMENSION], int nthreads,
+			       const char* prefix)
+    {
+	int total = 1;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    space.min[i] = min[i];
+	    space.max[i] = max[i];
+	    this->cells[i] = (cells[i] > 0) ? cells[i] : 1;
+	    total *= this->cells[i];
+	}
+
+	for (int n = 0; n < total; ++n) {
+	    Shard* shard = new Shard;
+	    if (prefix != NULL) {
+		char filename[256];
+		snprintf(filename, sizeof(filename), "%s.%d", prefix, n);
+		shard->rtree = new Rtree(filename);
+	    } else {
+		shard->rtree = new Rtree(NULL);
+	    }
+	    for (int i = 0; i < DIMENSION; ++i) { // empty cover
+		shard->cover.min[i] = UINT32_MAX;
+		shard->cover.max[i] = 0;
+	    }
+	    shards.push_back(shard);
+	}
+	pool = new ThreadPool(nthreads);
+    }
+
+    ShardedRtree::~ShardedRtree()
+    {
+	delete pool;
+	for (size_t n = 0; n < shards.size(); ++n) {
+	    delete shards[n]->rtree;
+	    delete shards[n];
+	}
+    }
+
+    // The shard owning the center of a rectangle.
+    ShardedRtree::Shard* ShardedRtree::ShardOf(uint32_t min[DIMENSION],
+					       uint32_t max[DIMENSION])
+    {
+	int n = 0;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    uint64_t center = ((uint64_t)min[i] + max[i]) / 2;
+	    uint64_t width = (uint64_t)space.max[i] - space.min[i] + 1;
+	    uint64_t cell = 0;
+	    if (center > space.max[i])
+		cell = cells[i] - 1;
+	    else if (center > space.min[i])
+		cell = (center - space.min[i]) * cells[i] / width;
+	    n = n * cells[i] + (int)cell;
+	}
+	return shards[n];
+    }
+
+    // Grow a shard cover without locking; each bound is moved with CAS.
+    void ShardedRtree::ExtendCover(Shard* shard, uint32_t min[DIMENSION],
+				   uint32_t max[DIMENSION])
+    {
+	for (int i = 0; i < DIMENSION; ++i) {
+	    uint32_t cur;
+	    while ((cur = shard->cover.min[i]) > min[i] &&
+		   !__sync_bool_compare_and_swap(&shard->cover.min[i],
+						 cur, min[i]));
+	    while ((cur = shard->cover.max[i]) < max[i] &&
+		   !__sync_bool_compare_and_swap(&shard->cover.max[i],
+						 cur, max[i]));
+	}
+    }
+
+    bool ShardedRtree::Insert(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+			      data_t* data)
+    {
+	Shard* shard = ShardOf(min, max);
+	// Cover first, so a query that can see the record sees the shard
+	ExtendCover(shard, min, max);
+	return shard->rtree->Insert(min, max, data);
+    }
+
+    bool ShardedRtree::Delete(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+			      data_t* data)
+    {
+	return ShardOf(min, max)->rtree->Delete(min, max, data);
+    }
+
+    void ShardedRtree::SearchRoutine(void* arg)
+    {
+	SearchTask* task = (SearchTask*)arg;
+	task->results = task->shard->rtree->Search(task->rect.min,
+						   task->rect.max);
+    }
+
+    std::vector<Rtree::RtreeRecord> ShardedRtree::Search(uint32_t min[DIMENSION],
+							 uint32_t max[DIMENSION])
+    {
+	Rtree::RtreeRect rect;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    rect.min[i] = min[i];
+	    rect.max[i] = max[i];
+	}
+
+	std::vector<SearchTask> tasks;
+	for (size_t n = 0; n < shards.size(); ++n) {
+	    if (RectOverlap(&rect, &shards[n]->cover)) {
+		SearchTask task;
+		task.shard = shards[n];
+		task.rect = rect;
+		tasks.push_back(task);
+	    }
+	}
+
+	if (tasks.empty())
+	    return std::vector<Rtree::RtreeRecord>();
+	if (tasks.size() == 1) {
+	    SearchRoutine(&tasks[0]);
+	    return tasks[0].results;
+	}
+
+	// Fan out; the calling thread takes the first shard itself
+	TaskGroup group;
+	for (size_t n = 1; n < tasks.size(); ++n) {
+	    pool->Submit(SearchRoutine, &tasks[n], &group);
+	}
+	SearchRoutine(&tasks[0]);
+	pool->Wait(&group);
+
+	std::vector<Rtree::RtreeRecord> results;
+	for (size_t n = 0; n < tasks.size(); ++n) {
+	    results.insert(results.end(), tasks[n].results.begin(),
+			   tasks[n].results.end());
+	}
+	return results;
+    }
+}
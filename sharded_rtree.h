@@ -0,0 +1,78 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#ifndef _SHARDED_RTREE_H_
+#define _SHARDED_RTREE_H_
+
+#include <vector>
+#include "rtree.h"
+#include "threadpool.h"
+
+namespace cmpt740 {
+
+    // A spatial index made of independent Rtree shards laid out on a grid.
+    // A record lives in the shard owning the center of its rectangle;
+    // queries fan out in parallel to the shards whose cover they overlap.
+    // Shards share nothing: each has its own root, LSN counter and file.
+    class ShardedRtree {
+    public:
+	// space: the region split into cells[i] slices along dimension i.
+	// prefix: shard files are named "<prefix>.<n>"; NULL keeps shards
+	// in memory. nthreads: query fan-out workers.
+	ShardedRtree(uint32_t min[DIMENSION], uint32_t max[DIMENSION],
+		     int cells[DIMENSION], int nthreads,
+		     const char* prefix = NULL);
+	virtual ~ShardedRtree();
+	bool Insert(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data);
+	bool Delete(uint32_t min[DIMENSION], uint32_t max[DIMENSION], data_t* data);
+	std::vector<Rtree::RtreeRecord> Search(uint32_t min[DIMENSION],
+					       uint32_t max[DIMENSION]);
+	int ShardCount() { return (int)shards.size(); }
+
+    protected:
+	struct Shard {
+	    Rtree* rtree;
+	    // Cover of everything ever inserted; only grows, so it is a
+	    // conservative bound after deletes.
+	    Rtree::RtreeRect cover;
+	};
+
+	struct SearchTask {
+	    Shard* shard;
+	    Rtree::RtreeRect rect;
+	    std::vector<Rtree::RtreeRecord> results;
+	};
+
+	static void SearchRoutine(void* arg);
+	Shard* ShardOf(uint32_t min[DIMENSION], uint32_t max[DIMENSION]);
+	void ExtendCover(Shard* shard, uint32_t min[DIMENSION],
+			 uint32_t max[DIMENSION]);
+
+    private:
+	Rtree::RtreeRect space;
+	int cells[DIMENSION];
+	std::vector<Shard*> shards;
+	ThreadPool* pool;
+    };
+}
+
+#endif
@@ -0,0 +1,218 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../rtree.h"
+#include "util.h"
+#include "workload.h"
+
+// Throughput of Insert, Search (first hit), ParallelSearch without a
+// pool (every hit) and Delete, in wall-clock time. Every phase is run
+// warmup times unmeasured, then reps times; each run of the insert phase
+// starts from an empty tree. One CSV line per measured run.
+
+enum Phase { PHASE_INSERT, PHASE_SEARCH, PHASE_RANGE, PHASE_DELETE };
+static const char* phase_names[] = { "insert", "search", "range", "delete" };
+
+struct BenchConfig {
+    WorkloadDistribution dist;
+    size_t records;
+    size_t queries;
+    double selectivity;
+    uint32_t space;
+    uint32_t extent;
+    int threads;
+    int warmup;
+    int reps;
+    uint64_t seed;
+};
+
+struct BenchThread {
+    Phase phase;
+    cmpt740::Rtree* rtree;
+    const std::vector<WorkloadRect>* rects;
+    size_t begin, end;
+    pthread_barrier_t* barrier;
+    uint64_t results;
+};
+
+static void* bench_routine(void* arg)
+{
+    BenchThread* t = (BenchThread*)arg;
+    const std::vector<WorkloadRect>& rects = *t->rects;
+    t->results = 0;
+    pthread_barrier_wait(t->barrier);
+    for (size_t i = t->begin; i < t->end; ++i) {
+	uint32_t* min = (uint32_t*)rects[i].min;
+	uint32_t* max = (uint32_t*)rects[i].max;
+	switch (t->phase) {
+	case PHASE_INSERT:
+	    t->rtree->Insert(min, max, NULL);
+	    break;
+	case PHASE_SEARCH:
+	    t->results += t->rtree->Search(min, max).size();
+	    break;
+	case PHASE_RANGE:
+	    t->results += t->rtree->ParallelSearch(min, max, NULL).size();
+	    break;
+	case PHASE_DELETE:
+	    t->results += t->rtree->Delete(min, max, NULL);
+	    break;
+	}
+    }
+    pthread_barrier_wait(t->barrier);
+    return NULL;
+}
+
+// Run one phase over rects on nthreads threads, returning wall-clock
+// seconds between the start and end barriers.
+static double run_phase(Phase phase, cmpt740::Rtree* rtree,
+			const std::vector<WorkloadRect>& rects, int nthreads,
+			uint64_t* results)
+{
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<BenchThread> args(nthreads);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; ++i) {
+	args[i].phase = phase;
+	args[i].rtree = rtree;
+	args[i].rects = &rects;
+	args[i].begin = rects.size() * i / nthreads;
+	args[i].end = rects.size() * (i + 1) / nthreads;
+	args[i].barrier = &barrier;
+	pthread_create(&threads[i], NULL, bench_routine, &args[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    unsigned long start = start_timer();
+    pthread_barrier_wait(&barrier);
+    unsigned long end = start_timer();
+    *results = 0;
+    for (int i = 0; i < nthreads; ++i) {
+	pthread_join(threads[i], NULL);
+	*results += args[i].results;
+    }
+    pthread_barrier_destroy(&barrier);
+    return (end - start) / 1000000.0;
+}
+
+static void report(const BenchConfig& c, Phase phase, int rep, size_t ops,
+		   double seconds, uint64_t results)
+{
+    printf("%s,%zu,%d,%g,%s,%d,%zu,%.6f,%.0f,%.2f\n",
+	   Workload::Name(c.dist), c.records, c.threads, c.selectivity,
+	   phase_names[phase], rep, ops, seconds,
+	   seconds > 0 ? ops / seconds : 0.0,
+	   ops > 0 ? (double)results / ops : 0.0);
+    fflush(stdout);
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-d uniform|gaussian|zipf|diagonal|aspect]"
+	    " [-n records] [-q queries] [-s selectivity] [-S space]"
+	    " [-e extent] [-t threads] [-w warmup] [-r reps] [-x seed]\n",
+	    prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig c;
+    c.dist = WORKLOAD_UNIFORM;
+    c.records = 100000;
+    c.queries = 10000;
+    c.selectivity = 0.0001;
+    c.space = 1 << 20;
+    c.extent = 256;
+    c.threads = 1;
+    c.warmup = 1;
+    c.reps = 3;
+    c.seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:q:s:S:e:t:w:r:x:")) != -1) {
+	switch (opt) {
+	case 'd':
+	    if (!Workload::Parse(optarg, &c.dist))
+		usage(argv[0]);
+	    break;
+	case 'n': c.records = strtoul(optarg, NULL, 10); break;
+	case 'q': c.queries = strtoul(optarg, NULL, 10); break;
+	case 's': c.selectivity = atof(optarg); break;
+	case 'S': c.space = strtoul(optarg, NULL, 10); break;
+	case 'e': c.extent = strtoul(optarg, NULL, 10); break;
+	case 't': c.threads = atoi(optarg); break;
+	case 'w': c.warmup = atoi(optarg); break;
+	case 'r': c.reps = atoi(optarg); break;
+	case 'x': c.seed = strtoull(optarg, NULL, 10); break;
+	default: usage(argv[0]);
+	}
+    }
+    if (c.threads < 1 || c.reps < 1 || c.warmup < 0)
+	usage(argv[0]);
+
+    Workload workload(c.space, c.seed);
+    std::vector<WorkloadRect> data, windows;
+    workload.Generate(c.dist, c.records, c.extent, data);
+    workload.Queries(data, c.selectivity, c.queries, windows);
+
+    printf("distribution,records,threads,selectivity,phase,rep,ops,"
+	   "seconds,ops_per_sec,results_per_op\n");
+
+    uint64_t results;
+    cmpt740::Rtree* rtree = NULL;
+    for (int rep = -c.warmup; rep < c.reps; ++rep) {
+	delete rtree;
+	rtree = new cmpt740::Rtree(NULL);
+	double t = run_phase(PHASE_INSERT, rtree, data, c.threads, &results);
+	if (rep >= 0)
+	    report(c, PHASE_INSERT, rep, data.size(), t, results);
+    }
+    for (int p = PHASE_SEARCH; p <= PHASE_RANGE; ++p) {
+	for (int rep = -c.warmup; rep < c.reps; ++rep) {
+	    double t = run_phase((Phase)p, rtree, windows, c.threads,
+				 &results);
+	    if (rep >= 0)
+		report(c, (Phase)p, rep, windows.size(), t, results);
+	}
+    }
+    // Deletes empty the tree, so every run gets a fresh copy untimed
+    for (int rep = -c.warmup; rep < c.reps; ++rep) {
+	if (rep > -c.warmup) {
+	    delete rtree;
+	    rtree = new cmpt740::Rtree(NULL);
+	    run_phase(PHASE_INSERT, rtree, data, c.threads, &results);
+	}
+	double t = run_phase(PHASE_DELETE, rtree, data, c.threads, &results);
+	if (rep >= 0)
+	    report(c, PHASE_DELETE, rep, data.size(), t, results);
+    }
+    delete rtree;
+    return 0;
+}
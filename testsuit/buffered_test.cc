@@ -0,0 +1,230 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Searches running against inserts and deletes must return every record
+// inserted before they began and not deleted before they ended, none
+// deleted before they began, and none twice. Built with RTREE_BUFFERED
+// the records pass through the node buffers while flushes run on their
+// own pool; without it the same checks cover the plain tree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <set>
+#include <vector>
+
+#include "../rtree.h"
+#include "../threadpool.h"
+
+#define NUM_WRITERS   3
+#define NUM_SEARCHERS 2
+#define NUM_RECORDS   20000 // per writer
+#define NUM_QUERIES   150   // per searcher
+#define DELETE_GAP    5     // every 5th record is deleted again
+
+enum { ABSENT, INSERTING, INSERTED, DELETING, DELETED };
+
+struct TestRecord {
+    uint32_t min[DIMENSION];
+    uint32_t max[DIMENSION];
+    volatile int state;
+};
+
+static cmpt740::Rtree* rtree;
+static cmpt740::ThreadPool* search_pool;
+static cmpt740::ThreadPool* flush_pool;
+static TestRecord records[NUM_WRITERS * NUM_RECORDS];
+static volatile long failures = 0;
+
+static cmpt740::data_t* DataOf(int id)
+{
+    return (cmpt740::data_t*)(uintptr_t)(id + 1);
+}
+
+static void* WriteRoutine(void* arg)
+{
+    int first = (int)(long)arg * NUM_RECORDS;
+    for (int i = 0; i < NUM_RECORDS; ++i) {
+	TestRecord* record = &records[first + i];
+	record->state = INSERTING;
+	__sync_synchronize();
+	rtree->Insert(record->min, record->max, DataOf(first + i));
+	__sync_synchronize();
+	record->state = INSERTED;
+	if (i % DELETE_GAP == DELETE_GAP - 1) {
+	    TestRecord* victim = &records[first + i - 2];
+	    victim->state = DELETING;
+	    __sync_synchronize();
+	    // Delete only looks in the leaf the insert path leads to, and
+	    // may miss a record placed elsewhere
+	    bool deleted = rtree->Delete(victim->min, victim->max, NULL);
+	    __sync_synchronize();
+	    victim->state = deleted ? DELETED : INSERTED;
+	}
+    }
+    return NULL;
+}
+
+static bool Overlaps(TestRecord* record, uint32_t min[DIMENSION],
+		     uint32_t max[DIMENSION])
+{
+    for (int d = 0; d < DIMENSION; ++d) {
+	if (record->min[d] > max[d] || record->max[d] < min[d])
+	    return false;
+    }
+    return true;
+}
+
+static void Check(const char* what, std::vector<int>& before,
+		  std::vector<cmpt740::Rtree::RtreeRecord>& results,
+		  uint32_t min[DIMENSION], uint32_t max[DIMENSION])
+{
+    int total = NUM_WRITERS * NUM_RECORDS;
+    std::vector<int> after(total);
+    __sync_synchronize();
+    for (int id = 0; id < total; ++id)
+	after[id] = records[id].state;
+
+    std::set<int> seen;
+    for (size_t i = 0; i < results.size(); ++i) {
+	int id = (int)(uintptr_t)results[i].data - 1;
+	if (id < 0 || id >= total) {
+	    printf("%s: unknown record %d\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	    continue;
+	}
+	if (!seen.insert(id).second) {
+	    printf("%s: record %d returned twice\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	}
+	if (after[id] == ABSENT || before[id] == DELETED) {
+	    printf("%s: record %d returned, state %d..%d\n", what, id,
+		   before[id], after[id]);
+	    __sync_add_and_fetch(&failures, 1);
+	}
+    }
+    for (int id = 0; id < total; ++id) {
+	if (before[id] != INSERTED || after[id] != INSERTED)
+	    continue;
+	if (Overlaps(&records[id], min, max) && seen.count(id) == 0) {
+	    printf("%s: record %d missed\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	}
+    }
+}
+
+static void* SearchRoutine(void* arg)
+{
+    unsigned int seed = (unsigned int)(long)arg + 1;
+    int total = NUM_WRITERS * NUM_RECORDS;
+    std::vector<int> before(total);
+    for (int q = 0; q < NUM_QUERIES; ++q) {
+	uint32_t min[DIMENSION], max[DIMENSION];
+	for (int d = 0; d < DIMENSION; ++d) {
+	    min[d] = rand_r(&seed) % 600000;
+	    max[d] = min[d] + 400000;
+	}
+	min[0] = rand_r(&seed) % (total * 8);
+	max[0] = min[0] + total / 2;
+
+	for (int id = 0; id < total; ++id)
+	    before[id] = records[id].state;
+	__sync_synchronize();
+	std::vector<cmpt740::Rtree::RtreeRecord> results;
+	const char* what;
+	switch (q % 3) {
+	case 0:
+	    what = "Query";
+	    results = rtree->Query(min, max, cmpt740::Rtree::QUERY_OVERLAP);
+	    break;
+	case 1:
+	    what = "ParallelSearch";
+	    results = rtree->ParallelSearch(min, max, search_pool);
+	    break;
+	default:
+	    // Not allowed to run on the flush pool, see AttachFlushPool
+	    what = "ParallelSearch on the flush pool";
+	    results = rtree->ParallelSearch(min, max, flush_pool);
+	    break;
+	}
+	Check(what, before, results, min, max);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    srand(7);
+    for (int id = 0; id < NUM_WRITERS * NUM_RECORDS; ++id) {
+	TestRecord* record = &records[id];
+	// Distinct in the first dimension, so that a delete takes out
+	// its own record only
+	record->min[0] = record->max[0] = id * 8;
+	for (int d = 1; d < DIMENSION; ++d) {
+	    record->min[d] = rand() % 1000000;
+	    record->max[d] = record->min[d] + rand() % 100;
+	}
+	record->state = ABSENT;
+    }
+
+    rtree = new cmpt740::Rtree;
+    search_pool = new cmpt740::ThreadPool(2);
+    flush_pool = new cmpt740::ThreadPool(2);
+#ifdef RTREE_BUFFERED
+    rtree->AttachFlushPool(flush_pool);
+#endif
+
+    pthread_t writers[NUM_WRITERS];
+    pthread_t searchers[NUM_SEARCHERS];
+    for (long i = 0; i < NUM_WRITERS; ++i)
+	pthread_create(&writers[i], NULL, WriteRoutine, (void*)i);
+    for (long i = 0; i < NUM_SEARCHERS; ++i)
+	pthread_create(&searchers[i], NULL, SearchRoutine, (void*)i);
+    for (int i = 0; i < NUM_WRITERS; ++i)
+	pthread_join(writers[i], NULL);
+    for (int i = 0; i < NUM_SEARCHERS; ++i)
+	pthread_join(searchers[i], NULL);
+
+    // Quiet now: Count and a full search agree with the survivors
+    uint32_t min[DIMENSION], max[DIMENSION];
+    for (int d = 0; d < DIMENSION; ++d) {
+	min[d] = 0;
+	max[d] = 0xffffffff;
+    }
+    uint64_t expect = 0;
+    for (int id = 0; id < NUM_WRITERS * NUM_RECORDS; ++id) {
+	if (records[id].state == INSERTED)
+	    ++expect;
+    }
+    uint64_t count = rtree->Count(min, max);
+    size_t found = rtree->ParallelSearch(min, max, search_pool).size();
+    if (count != expect || found != expect) {
+	printf("after the writers: Count %lu, ParallelSearch %lu, "
+	       "expected %lu\n", (unsigned long)count, (unsigned long)found,
+	       (unsigned long)expect);
+	++failures;
+    }
+
+    delete rtree;
+    delete search_pool;
+    delete flush_pool;
+    printf("%s, %ld failures\n", failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
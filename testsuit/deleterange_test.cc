@@ -0,0 +1,280 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// DeleteRange against inserts and searches. Each operation takes a tick
+// as it begins and as it ends. A record whose insert ended before a
+// DeleteRange around it began is gone after it; one whose insert began
+// after the last such DeleteRange ended stays. Searches must return the
+// records inserted before they began that no DeleteRange around them
+// touched before they ended, none taken out before they began, and none
+// twice. The windows are stripes along the first dimension, wide enough
+// that whole subtrees are dropped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <set>
+#include <vector>
+
+#include "../rtree.h"
+#include "../threadpool.h"
+
+#define NUM_WRITERS   3
+#define NUM_SEARCHERS 2
+#define NUM_RECORDS   40000 // per writer
+#define MAX_RANGES    400
+#define STRIPE        (NUM_WRITERS * NUM_RECORDS / 16) // records per stripe
+
+#define NEVER UINT64_MAX
+
+struct TestRecord {
+    uint32_t min[DIMENSION];
+    uint32_t max[DIMENSION];
+    volatile uint64_t begin; // ticks of the insert
+    volatile uint64_t end;
+};
+
+struct Range {
+    uint32_t min; // along the first dimension, the others are whole
+    uint32_t max;
+    volatile uint64_t begin; // NEVER until taken
+    volatile uint64_t end;
+};
+
+static cmpt740::Rtree* rtree;
+static cmpt740::ThreadPool* search_pool;
+static cmpt740::ThreadPool* flush_pool;
+static TestRecord records[NUM_WRITERS * NUM_RECORDS];
+static Range ranges[MAX_RANGES];
+static volatile int num_ranges = 0;
+static volatile uint64_t ticks = 0;
+static volatile long writers_done = 0;
+static volatile long failures = 0;
+
+static uint64_t Tick()
+{
+    return __sync_add_and_fetch(&ticks, 1);
+}
+
+static bool Covers(Range* range, TestRecord* record)
+{
+    return range->min <= record->min[0] && record->min[0] <= range->max;
+}
+
+static void* WriteRoutine(void* arg)
+{
+    // Interleaved, so that every stripe keeps growing
+    for (int id = (int)(long)arg; id < NUM_WRITERS * NUM_RECORDS;
+	 id += NUM_WRITERS) {
+	TestRecord* record = &records[id];
+	record->begin = Tick();
+	rtree->Insert(record->min, record->max,
+		      (cmpt740::data_t*)(uintptr_t)(id + 1));
+	record->end = Tick();
+    }
+    __sync_add_and_fetch(&writers_done, 1);
+    return NULL;
+}
+
+static void* DeleteRoutine(void* arg)
+{
+    unsigned int seed = 5;
+    uint32_t min[DIMENSION], max[DIMENSION];
+    for (int d = 1; d < DIMENSION; ++d) {
+	min[d] = 0;
+	max[d] = UINT32_MAX;
+    }
+    while (writers_done < NUM_WRITERS && num_ranges < MAX_RANGES) {
+	usleep(1000);
+	Range* range = &ranges[num_ranges];
+	range->min = rand_r(&seed) % (NUM_WRITERS * NUM_RECORDS) * 8;
+	range->max = range->min + STRIPE * 8;
+	range->begin = NEVER;
+	range->end = NEVER;
+	// Listed before it begins, so that a check finds every range that
+	// began before its search ended
+	__sync_synchronize();
+	__sync_add_and_fetch(&num_ranges, 1);
+	range->begin = Tick();
+	min[0] = range->min;
+	max[0] = range->max;
+	rtree->DeleteRange(min, max);
+	range->end = Tick();
+    }
+    return NULL;
+}
+
+// Whether record must be in a search that ran from begin to end, and
+// whether it may be
+static void Expect(TestRecord* record, uint64_t begin, uint64_t end,
+		   bool* must, bool* may)
+{
+    *must = (record->end < begin);
+    *may = (record->begin < end);
+    int count = num_ranges;
+    for (int i = 0; i < count; ++i) {
+	Range* range = &ranges[i];
+	if (!Covers(range, record))
+	    continue;
+	if (range->end < record->begin) // gone before the insert
+	    continue;
+	if (range->begin < end)
+	    *must = false;
+	if (range->end < begin && range->begin > record->end)
+	    *may = false;
+    }
+}
+
+static bool Overlaps(TestRecord* record, uint32_t min[DIMENSION],
+		     uint32_t max[DIMENSION])
+{
+    for (int d = 0; d < DIMENSION; ++d) {
+	if (record->min[d] > max[d] || record->max[d] < min[d])
+	    return false;
+    }
+    return true;
+}
+
+static void Check(const char* what, uint64_t begin, uint64_t end,
+		  std::vector<cmpt740::Rtree::RtreeRecord>& results,
+		  uint32_t min[DIMENSION], uint32_t max[DIMENSION])
+{
+    int total = NUM_WRITERS * NUM_RECORDS;
+    std::set<int> seen;
+    bool must, may;
+    for (size_t i = 0; i < results.size(); ++i) {
+	int id = (int)(uintptr_t)results[i].data - 1;
+	if (id < 0 || id >= total) {
+	    printf("%s: unknown record %d\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	    continue;
+	}
+	if (!seen.insert(id).second) {
+	    printf("%s: record %d returned twice\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	}
+	Expect(&records[id], begin, end, &must, &may);
+	if (!may) {
+	    printf("%s: record %d returned, taken out before\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	}
+    }
+    for (int id = 0; id < total; ++id) {
+	if (!Overlaps(&records[id], min, max) || seen.count(id) != 0)
+	    continue;
+	Expect(&records[id], begin, end, &must, &may);
+	if (must) {
+	    printf("%s: record %d missed\n", what, id);
+	    __sync_add_and_fetch(&failures, 1);
+	}
+    }
+}
+
+static void* SearchRoutine(void* arg)
+{
+    unsigned int seed = (unsigned int)(long)arg + 1;
+    int total = NUM_WRITERS * NUM_RECORDS;
+    for (int q = 0; writers_done < NUM_WRITERS; ++q) {
+	uint32_t min[DIMENSION], max[DIMENSION];
+	for (int d = 0; d < DIMENSION; ++d) {
+	    min[d] = rand_r(&seed) % 600000;
+	    max[d] = min[d] + 400000;
+	}
+	min[0] = rand_r(&seed) % (total * 8);
+	max[0] = min[0] + STRIPE * 8;
+
+	uint64_t begin = Tick();
+	std::vector<cmpt740::Rtree::RtreeRecord> results;
+	const char* what;
+	if (q % 2 == 0) {
+	    what = "Query";
+	    results = rtree->Query(min, max, cmpt740::Rtree::QUERY_OVERLAP);
+	} else {
+	    what = "ParallelSearch";
+	    results = rtree->ParallelSearch(min, max, search_pool);
+	}
+	uint64_t end = Tick();
+	Check(what, begin, end, results, min, max);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    srand(13);
+    for (int id = 0; id < NUM_WRITERS * NUM_RECORDS; ++id) {
+	TestRecord* record = &records[id];
+	record->min[0] = record->max[0] = id * 8;
+	for (int d = 1; d < DIMENSION; ++d) {
+	    record->min[d] = rand() % 1000000;
+	    record->max[d] = record->min[d] + rand() % 100;
+	}
+	record->begin = NEVER;
+	record->end = NEVER;
+    }
+
+    rtree = new cmpt740::Rtree;
+    search_pool = new cmpt740::ThreadPool(2);
+    flush_pool = new cmpt740::ThreadPool(2);
+#ifdef RTREE_BUFFERED
+    rtree->AttachFlushPool(flush_pool);
+#endif
+
+    pthread_t writers[NUM_WRITERS];
+    pthread_t searchers[NUM_SEARCHERS];
+    pthread_t deleter;
+    for (long i = 0; i < NUM_WRITERS; ++i)
+	pthread_create(&writers[i], NULL, WriteRoutine, (void*)i);
+    for (long i = 0; i < NUM_SEARCHERS; ++i)
+	pthread_create(&searchers[i], NULL, SearchRoutine, (void*)i);
+    pthread_create(&deleter, NULL, DeleteRoutine, NULL);
+    for (int i = 0; i < NUM_WRITERS; ++i)
+	pthread_join(writers[i], NULL);
+    for (int i = 0; i < NUM_SEARCHERS; ++i)
+	pthread_join(searchers[i], NULL);
+    pthread_join(deleter, NULL);
+
+    // Quiet now: a full search holds exactly the records that must stay
+    // and may
+    uint32_t min[DIMENSION], max[DIMENSION];
+    for (int d = 0; d < DIMENSION; ++d) {
+	min[d] = 0;
+	max[d] = UINT32_MAX;
+    }
+    uint64_t now = Tick();
+    std::vector<cmpt740::Rtree::RtreeRecord> results =
+	rtree->ParallelSearch(min, max, search_pool);
+    Check("after the writers", now, now, results, min, max);
+    uint64_t count = rtree->Count(min, max);
+    if (count != results.size()) {
+	printf("after the writers: Count %lu, ParallelSearch %lu\n",
+	       (unsigned long)count, (unsigned long)results.size());
+	++failures;
+    }
+
+    delete rtree;
+    delete search_pool;
+    delete flush_pool;
+    printf("%d ranges deleted, %lu records left, %s, %ld failures\n",
+	   (int)num_ranges, (unsigned long)results.size(),
+	   failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <string.h>
+
+#include "histogram.h"
+
+#define HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Reset()
+{
+    memset(counts, 0, sizeof(counts));
+    count = sum = max = 0;
+}
+
+// Values below 2^SUB_BITS map to themselves. Above, a value keeps its
+// top SUB_BITS bits: the bucket is shift * HALF + (value >> shift).
+int LatencyHistogram::BucketOf(uint64_t value)
+{
+    if (value < (1ULL << HISTOGRAM_SUB_BITS))
+	return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HISTOGRAM_SUB_BITS - 1);
+    return shift * HALF + (int)(value >> shift);
+}
+
+uint64_t LatencyHistogram::BucketTop(int bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+	return bucket;
+    int shift = bucket / HALF - 1;
+    uint64_t mantissa = bucket - shift * HALF;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t value)
+{
+    counts[BucketOf(value)]++;
+    count++;
+    sum += value;
+    if (value > max)
+	max = value;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	counts[i] += other.counts[i];
+    count += other.count;
+    sum += other.sum;
+    if (other.max > max)
+	max = other.max;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+    if (count == 0)
+	return 0;
+    uint64_t rank = (uint64_t)(p * count + 0.5);
+    if (rank < 1)
+	rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+	seen += counts[i];
+	if (seen >= rank)
+	    return BucketTop(i) < max ? BucketTop(i) : max;
+    }
+    return max;
+}
@@ -0,0 +1,61 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+// Sub-buckets per power of two are 2^(HISTOGRAM_SUB_BITS - 1), which
+// bounds the relative error of a reported value to about 3%.
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_BUCKETS ((66 - HISTOGRAM_SUB_BITS) << (HISTOGRAM_SUB_BITS - 1))
+
+// HDR-style histogram of non-negative values: exact below
+// 2^HISTOGRAM_SUB_BITS, log-linear above. Not thread-safe; keep one per
+// thread and Merge them.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+    void Record(uint64_t value);
+    void Merge(const LatencyHistogram& other);
+    void Reset();
+    // Smallest recorded value v such that a fraction p (0..1) of the
+    // values is <= v, within bucket precision
+    uint64_t Percentile(double p) const;
+    uint64_t Max() const { return max; }
+    uint64_t Count() const { return count; }
+    double Mean() const { return count ? (double)sum / count : 0; }
+
+protected:
+    static int BucketOf(uint64_t value);
+    static uint64_t BucketTop(int bucket);
+
+private:
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+#endif
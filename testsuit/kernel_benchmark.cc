@@ -0,0 +1,347 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../rtree.h"
+#include "util.h"
+#include "workload.h"
+
+// ns/op of the geometric kernels and the split path. Node contents come
+// from Workload data packed into nodes of spatially close records (sort
+// on the first axis, then cut), and covers of those for internal nodes.
+// Numbers only mean something in an optimized build
+// (cmake -DCMAKE_BUILD_TYPE=Release).
+//
+// Kernels working on an RtreeNode are limited to MAX_REC_NUM_PER_NODE
+// entries, so their fanouts run up to that. The overlap and cover scans
+// also run over wider entry arrays, with scalar, branchless and
+// vectorized variants side by side.
+
+#define KERNEL_MIN_NS 20000000ULL // run every kernel at least this long
+
+using cmpt740::Rtree;
+typedef Rtree::RtreeRect Rect;
+
+// Exposes the protected kernels
+class KernelRtree : public Rtree {
+public:
+    KernelRtree() : Rtree(NULL) {}
+    using Rtree::PartitionVars;
+    using Rtree::Overlap;
+    using Rtree::CombineRect;
+    using Rtree::CalcRectVolume;
+    using Rtree::PickRecord;
+    using Rtree::PickSeeds;
+    using Rtree::InitParVars;
+    using Rtree::ChoosePartition;
+    using Rtree::GetRecords;
+    using Rtree::SplitNode;
+};
+
+static volatile uint64_t sink;
+
+static bool CompareFirstAxis(const Rect& a, const Rect& b)
+{
+    return a.min[0] < b.min[0];
+}
+
+static bool CompareSecondAxis(const Rect& a, const Rect& b)
+{
+    return a.min[DIMENSION - 1] < b.min[DIMENSION - 1];
+}
+
+// Rectangles as one array per dimension and bound, for the vectorized
+// scans
+struct RectColumns {
+    std::vector<uint32_t> min[DIMENSION];
+    std::vector<uint32_t> max[DIMENSION];
+    void Load(const Rect* rects, int n)
+    {
+	for (int d = 0; d < DIMENSION; ++d) {
+	    min[d].resize(n);
+	    max[d].resize(n);
+	    for (int i = 0; i < n; ++i) {
+		min[d][i] = rects[i].min[d];
+		max[d][i] = rects[i].max[d];
+	    }
+	}
+    }
+};
+
+static bool overlap_branchless(const Rect* a, const Rect* b)
+{
+    bool ok = true;
+    for (int d = 0; d < DIMENSION; ++d)
+	ok &= (a->min[d] <= b->max[d]) & (b->min[d] <= a->max[d]);
+    return ok;
+}
+
+// Count of the n columnar rects overlapping q
+static int overlap_scan_columns(const RectColumns& c, int n, const Rect* q)
+{
+    int hits = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // SSE2 only compares signed words: flip the sign bits first
+    const __m128i flip = _mm_set1_epi32((int)0x80000000);
+    for (; i + 4 <= n; i += 4) {
+	__m128i miss = _mm_setzero_si128();
+	for (int d = 0; d < DIMENSION; ++d) {
+	    __m128i mn = _mm_xor_si128(flip,
+		_mm_loadu_si128((const __m128i*)&c.min[d][i]));
+	    __m128i mx = _mm_xor_si128(flip,
+		_mm_loadu_si128((const __m128i*)&c.max[d][i]));
+	    __m128i qmin = _mm_xor_si128(flip, _mm_set1_epi32(q->min[d]));
+	    __m128i qmax = _mm_xor_si128(flip, _mm_set1_epi32(q->max[d]));
+	    miss = _mm_or_si128(miss, _mm_cmpgt_epi32(mn, qmax));
+	    miss = _mm_or_si128(miss, _mm_cmpgt_epi32(qmin, mx));
+	}
+	hits += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(miss)));
+    }
+#endif
+    for (; i < n; ++i) {
+	bool ok = true;
+	for (int d = 0; d < DIMENSION; ++d)
+	    ok &= (c.min[d][i] <= q->max[d]) & (q->min[d] <= c.max[d][i]);
+	hits += ok;
+    }
+    return hits;
+}
+
+// Cover of n columnar rects, written so the compiler can vectorize it
+static Rect cover_columns(const RectColumns& c, int n)
+{
+    Rect r;
+    for (int d = 0; d < DIMENSION; ++d) {
+	uint32_t lo = 0xffffffffU, hi = 0;
+	const uint32_t* mn = &c.min[d][0];
+	const uint32_t* mx = &c.max[d][0];
+	for (int i = 0; i < n; ++i) {
+	    lo = mn[i] < lo ? mn[i] : lo;
+	    hi = mx[i] > hi ? mx[i] : hi;
+	}
+	r.min[d] = lo;
+	r.max[d] = hi;
+    }
+    return r;
+}
+
+// Repeat body until KERNEL_MIN_NS have passed, then print ns per op
+// (ops_per_round operations per round)
+#define MEASURE(name, fanout, variant, ops_per_round, body)		\
+    do {								\
+	uint64_t ops = 0;						\
+	unsigned long long start = now_nsec(), now;			\
+	do {								\
+	    for (int round = 0; round < 64; ++round) {			\
+		body;							\
+	    }								\
+	    ops += 64 * (uint64_t)(ops_per_round);			\
+	    now = now_nsec();						\
+	} while (now - start < KERNEL_MIN_NS);				\
+	printf("%s,%d,%s,%.2f\n", name, (int)(fanout), variant,	\
+	       (double)(now - start) / ops);				\
+    } while (0)
+
+int main(int argc, char *argv[])
+{
+    KernelRtree tree;
+    Workload workload(1 << 20, 1);
+    std::vector<WorkloadRect> data;
+    workload.Generate(WORKLOAD_UNIFORM, 1 << 16, 256, data);
+
+    // Leaves: runs of nearby records, packed sort-tile-recursive style;
+    // internal nodes: covers of consecutive leaves
+    std::vector<Rect> leaf_rects(data.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+	for (int d = 0; d < DIMENSION; ++d) {
+	    leaf_rects[i].min[d] = data[i].min[d];
+	    leaf_rects[i].max[d] = data[i].max[d];
+	}
+    }
+    std::sort(leaf_rects.begin(), leaf_rects.end(), CompareFirstAxis);
+    size_t slice = MAX_REC_NUM_PER_NODE
+	* (size_t)sqrt((double)leaf_rects.size() / MAX_REC_NUM_PER_NODE);
+    for (size_t i = 0; i < leaf_rects.size(); i += slice)
+	std::sort(leaf_rects.begin() + i,
+		  leaf_rects.begin() + std::min(i + slice, leaf_rects.size()),
+		  CompareSecondAxis);
+    const int NODES = 1024;
+    std::vector<Rect> inner_rects(leaf_rects.size() / MAX_REC_NUM_PER_NODE);
+    for (size_t i = 0; i < inner_rects.size(); ++i) {
+	Rect cover = leaf_rects[i * MAX_REC_NUM_PER_NODE];
+	for (int j = 1; j < MAX_REC_NUM_PER_NODE; ++j)
+	    cover = tree.CombineRect(&cover,
+				     &leaf_rects[i * MAX_REC_NUM_PER_NODE + j]);
+	inner_rects[i] = cover;
+    }
+    // Probes: other records of the data set
+    std::vector<Rect> probes(leaf_rects.begin(), leaf_rects.begin() + NODES);
+    std::random_shuffle(probes.begin(), probes.end());
+
+    printf("kernel,fanout,variant,ns_per_op\n");
+    uint64_t acc = 0;
+
+    // Single-pair kernels
+    MEASURE("Overlap", 2, "scalar", NODES, {
+	for (int i = 0; i < NODES; ++i)
+	    acc += tree.Overlap(&inner_rects[i], &probes[i]);
+    });
+    MEASURE("Overlap", 2, "branchless", NODES, {
+	for (int i = 0; i < NODES; ++i)
+	    acc += overlap_branchless(&inner_rects[i], &probes[i]);
+    });
+    MEASURE("CombineRect", 2, "scalar", NODES, {
+	for (int i = 0; i < NODES; ++i)
+	    acc += tree.CombineRect(&inner_rects[i], &probes[i]).max[0];
+    });
+    MEASURE("CalcRectVolume", 1, "scalar", NODES, {
+	for (int i = 0; i < NODES; ++i)
+	    acc += tree.CalcRectVolume(&inner_rects[i]);
+    });
+
+    // Scans over a node's entries, at several widths
+    int widths[] = { 4, MAX_REC_NUM_PER_NODE, 16, 64, 256 };
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w) {
+	int n = widths[w];
+	int groups = (int)inner_rects.size() / n;
+	std::vector<RectColumns> columns(groups);
+	for (int g = 0; g < groups; ++g)
+	    columns[g].Load(&inner_rects[g * n], n);
+	// The variants have to agree before their timings mean anything
+	for (int g = 0; g < groups; ++g) {
+	    int hits = 0;
+	    for (int i = 0; i < n; ++i)
+		hits += tree.Overlap(&inner_rects[g * n + i], &probes[g % NODES]);
+	    if (hits != overlap_scan_columns(columns[g], n, &probes[g % NODES])) {
+		fprintf(stderr, "vector overlap scan disagrees at fanout %d\n", n);
+		return 1;
+	    }
+	}
+	MEASURE("OverlapScan", n, "scalar", groups * n, {
+	    for (int g = 0; g < groups; ++g)
+		for (int i = 0; i < n; ++i)
+		    acc += tree.Overlap(&inner_rects[g * n + i],
+					&probes[g % NODES]);
+	});
+	MEASURE("OverlapScan", n, "branchless", groups * n, {
+	    for (int g = 0; g < groups; ++g)
+		for (int i = 0; i < n; ++i)
+		    acc += overlap_branchless(&inner_rects[g * n + i],
+					      &probes[g % NODES]);
+	});
+	MEASURE("OverlapScan", n, "vector", groups * n, {
+	    for (int g = 0; g < groups; ++g)
+		acc += overlap_scan_columns(columns[g], n, &probes[g % NODES]);
+	});
+	MEASURE("CoverScan", n, "scalar", groups * n, {
+	    for (int g = 0; g < groups; ++g) {
+		Rect cover = inner_rects[g * n];
+		for (int i = 1; i < n; ++i)
+		    cover = tree.CombineRect(&cover, &inner_rects[g * n + i]);
+		acc += cover.max[0];
+	    }
+	});
+	MEASURE("CoverScan", n, "vector", groups * n, {
+	    for (int g = 0; g < groups; ++g)
+		acc += cover_columns(columns[g], n).max[0];
+	});
+    }
+
+    // Node kernels, on nodes filled with fanout internal entries
+    std::vector<Rtree::RtreeBranch*> nodes(NODES);
+    Rtree::RtreeRecord record;
+    for (int fanout = 2; fanout <= MAX_REC_NUM_PER_NODE; ++fanout) {
+	for (int i = 0; i < NODES; ++i) {
+	    if (nodes[i] == NULL)
+		nodes[i] = new Rtree::RtreeBranch;
+	    nodes[i]->level = 1;
+	    nodes[i]->count = fanout;
+	    for (int j = 0; j < fanout; ++j)
+		nodes[i]->records[j].rect =
+		    inner_rects[(i * MAX_REC_NUM_PER_NODE + j)
+				% inner_rects.size()];
+	}
+	MEASURE("PickRecord", fanout, "scalar", NODES, {
+	    for (int i = 0; i < NODES; ++i)
+		acc += tree.PickRecord(&probes[i], nodes[i]);
+	});
+
+	// A split sees fanout + 1 entries
+	KernelRtree::PartitionVars vars;
+	MEASURE("PickSeeds", fanout + 1, "scalar", NODES, {
+	    for (int i = 0; i < NODES; ++i) {
+		for (int j = 0; j < fanout; ++j)
+		    vars.recordBuf[j] = nodes[i]->records[j];
+		vars.recordBuf[fanout].rect = probes[i];
+		vars.recordCount = fanout + 1;
+		vars.coverSplitArea = 0;
+		tree.InitParVars(&vars, fanout + 1, (fanout + 1) / 2);
+		tree.PickSeeds(&vars);
+		acc += vars.partition[0];
+	    }
+	});
+	MEASURE("ChoosePartition", fanout + 1, "scalar", NODES, {
+	    for (int i = 0; i < NODES; ++i) {
+		for (int j = 0; j < fanout; ++j)
+		    vars.recordBuf[j] = nodes[i]->records[j];
+		vars.recordBuf[fanout].rect = probes[i];
+		vars.recordCount = fanout + 1;
+		vars.coverSplitArea = 0;
+		tree.ChoosePartition(&vars, (fanout + 1) / 2);
+		acc += vars.partition[0];
+	    }
+	});
+    }
+
+    // Full SplitNode of a full node, new node allocation included
+    Rtree::RtreeBranch* full = new Rtree::RtreeBranch;
+    MEASURE("SplitNode", MAX_REC_NUM_PER_NODE + 1, "scalar", NODES, {
+	for (int i = 0; i < NODES; ++i) {
+	    full->level = 1;
+	    full->count = MAX_REC_NUM_PER_NODE;
+	    for (int j = 0; j < MAX_REC_NUM_PER_NODE; ++j)
+		full->records[j] = nodes[i]->records[j];
+	    record.rect = probes[i];
+	    Rtree::RtreeNode* created;
+	    tree.SplitNode(full, &record, 0, &created);
+	    acc += created->count;
+	    created->unlock();
+	    delete static_cast<Rtree::RtreeBranch*>(created);
+	}
+    });
+
+    sink = acc;
+    for (int i = 0; i < NODES; ++i)
+	delete nodes[i];
+    delete full;
+    return 0;
+}
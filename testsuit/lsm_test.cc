@@ -0,0 +1,280 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// LsmRtree against a reference multiset. A small level 0 makes every
+// few hundred writes go through Freeze, Convert and Compact. One thread
+// checks each Search against the reference. Several threads then write
+// disjoint records at once while another checks that every component
+// holds only writes older than those of the components before it, which
+// dropping tombstones by position relies on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "../lsm_rtree.h"
+
+#define MEMTABLE_SIZE 300
+#define NUM_OPS       60000
+#define NUM_WRITERS   4
+#define WRITER_OPS    20000
+
+struct Key {
+    uint32_t min[DIMENSION];
+    uint32_t max[DIMENSION];
+    uintptr_t data;
+
+    bool operator<(const Key& other) const {
+	for (int i = 0; i < DIMENSION; ++i) {
+	    if (min[i] != other.min[i])
+		return min[i] < other.min[i];
+	    if (max[i] != other.max[i])
+		return max[i] < other.max[i];
+	}
+	return data < other.data;
+    }
+};
+
+typedef std::map<Key, int> Reference; // live inserts of each record
+
+// Reads the components for CheckOrder
+class CheckedLsmRtree : public cmpt740::LsmRtree {
+public:
+    CheckedLsmRtree(uint32_t memtable) : LsmRtree(memtable) {}
+    bool CheckOrder();
+};
+
+static long failures = 0;
+static CheckedLsmRtree* lsm;
+static volatile int writing;
+
+// Oldest and newest write still held by each component must not overlap
+// those of its neighbours.
+bool CheckedLsmRtree::CheckOrder()
+{
+    uint32_t min[DIMENSION], max[DIMENSION];
+    for (int i = 0; i < DIMENSION; ++i) {
+	min[i] = 0;
+	max[i] = UINT32_MAX;
+    }
+    bool ok = true;
+    uint64_t newer = UINT64_MAX; // oldest write of the newer components
+    Version* version = Acquire();
+    for (size_t n = 0; n < version->components.size(); ++n) {
+	Component* component = version->components[n];
+	std::vector<uint64_t> seqs;
+	if (component->memtable != NULL) {
+	    std::vector<cmpt740::Rtree::RtreeRecord> records =
+		component->memtable->ParallelSearch(min, max, NULL);
+	    for (size_t i = 0; i < records.size(); ++i)
+		seqs.push_back(((Entry*)records[i].data)->seq);
+	} else {
+	    for (size_t i = 0; i < component->run->entries.size(); ++i)
+		seqs.push_back(component->run->entries[i].seq);
+	}
+	if (seqs.empty())
+	    continue;
+	uint64_t oldest = *std::min_element(seqs.begin(), seqs.end());
+	uint64_t newest = *std::max_element(seqs.begin(), seqs.end());
+	if (newest >= newer) {
+	    printf("component %lu holds write %lu, a newer one %lu\n",
+		   (unsigned long)n, (unsigned long)newest,
+		   (unsigned long)newer);
+	    ok = false;
+	}
+	newer = std::min(newer, oldest);
+    }
+    Release(version);
+    return ok;
+}
+
+static Key RandomKey()
+{
+    Key key;
+    for (int i = 0; i < DIMENSION; ++i) {
+	key.min[i] = rand() % 1000;
+	key.max[i] = key.min[i] + rand() % 20;
+    }
+    key.data = rand() % 3;
+    return key;
+}
+
+static Key KeyOf(cmpt740::Rtree::RtreeRecord& record)
+{
+    Key key;
+    for (int i = 0; i < DIMENSION; ++i) {
+	key.min[i] = record.rect.min[i];
+	key.max[i] = record.rect.max[i];
+    }
+    key.data = (uintptr_t)record.data;
+    return key;
+}
+
+static bool Overlaps(const Key& key, uint32_t min[DIMENSION],
+		     uint32_t max[DIMENSION])
+{
+    for (int i = 0; i < DIMENSION; ++i) {
+	if (key.min[i] > max[i] || min[i] > key.max[i])
+	    return false;
+    }
+    return true;
+}
+
+// The multiset of records Search returns must be the reference's
+static bool Matches(Reference& reference, uint32_t min[DIMENSION],
+		    uint32_t max[DIMENSION])
+{
+    std::vector<cmpt740::Rtree::RtreeRecord> results = lsm->Search(min, max);
+    std::vector<Key> found;
+    for (size_t i = 0; i < results.size(); ++i)
+	found.push_back(KeyOf(results[i]));
+    std::vector<Key> expected;
+    for (Reference::iterator it = reference.begin(); it != reference.end();
+	 ++it) {
+	if (Overlaps(it->first, min, max))
+	    expected.insert(expected.end(), it->second, it->first);
+    }
+    std::sort(found.begin(), found.end());
+    if (found.size() != expected.size())
+	return false;
+    for (size_t i = 0; i < found.size(); ++i) {
+	if (found[i] < expected[i] || expected[i] < found[i])
+	    return false;
+    }
+    return true;
+}
+
+static void* WriteRoutine(void* arg)
+{
+    long id = (long)arg;
+    unsigned int seed = (unsigned int)id + 1;
+    Reference* reference = new Reference;
+    for (int op = 0; op < WRITER_OPS; ++op) {
+	// The data tells the writers apart
+	Key key;
+	for (int i = 0; i < DIMENSION; ++i) {
+	    key.min[i] = rand_r(&seed) % 1000;
+	    key.max[i] = key.min[i] + rand_r(&seed) % 20;
+	}
+	key.data = id * 4 + rand_r(&seed) % 4;
+	if (rand_r(&seed) % 3 != 0) {
+	    lsm->Insert(key.min, key.max, (cmpt740::data_t*)key.data);
+	    ++(*reference)[key];
+	} else {
+	    lsm->Delete(key.min, key.max, (cmpt740::data_t*)key.data);
+	    reference->erase(key);
+	}
+    }
+    return reference;
+}
+
+static void* CheckRoutine(void* arg)
+{
+    long checks = 0;
+    while (writing) {
+	if (!lsm->CheckOrder())
+	    ++failures;
+	++checks;
+    }
+    printf("%ld order checks while writing\n", checks);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t min[DIMENSION], max[DIMENSION];
+
+    // One thread, checked against the reference all along
+    srand(1);
+    lsm = new CheckedLsmRtree(MEMTABLE_SIZE);
+    Reference reference;
+    std::vector<Key> keys;
+    for (int op = 0; op < NUM_OPS; ++op) {
+	int choice = rand() % 10;
+	if (choice < 6) {
+	    Key key = RandomKey();
+	    lsm->Insert(key.min, key.max, (cmpt740::data_t*)key.data);
+	    ++reference[key];
+	    keys.push_back(key);
+	} else if (choice < 9) {
+	    // Mostly records written before, some never written
+	    Key key = (keys.empty() || rand() % 4 == 0) ?
+		RandomKey() : keys[rand() % keys.size()];
+	    lsm->Delete(key.min, key.max, (cmpt740::data_t*)key.data);
+	    reference.erase(key);
+	} else {
+	    for (int i = 0; i < DIMENSION; ++i) {
+		min[i] = rand() % 1000;
+		max[i] = min[i] + rand() % 300;
+	    }
+	    if (!Matches(reference, min, max)) {
+		printf("search %d differs from the reference\n", op);
+		++failures;
+	    }
+	}
+	if (op % 20000 == 0)
+	    lsm->Flush();
+    }
+    for (int i = 0; i < DIMENSION; ++i) {
+	min[i] = 0;
+	max[i] = UINT32_MAX;
+    }
+    lsm->Flush();
+    if (!Matches(reference, min, max) || !lsm->CheckOrder()) {
+	printf("after Flush the tree differs from the reference\n");
+	++failures;
+    }
+    delete lsm;
+
+    // Writers at once, each on records of its own
+    lsm = new CheckedLsmRtree(MEMTABLE_SIZE);
+    writing = 1;
+    pthread_t writers[NUM_WRITERS];
+    pthread_t checker;
+    for (long i = 0; i < NUM_WRITERS; ++i)
+	pthread_create(&writers[i], NULL, WriteRoutine, (void*)i);
+    pthread_create(&checker, NULL, CheckRoutine, NULL);
+    reference.clear();
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+	void* result;
+	pthread_join(writers[i], &result);
+	Reference* own = (Reference*)result;
+	reference.insert(own->begin(), own->end());
+	delete own;
+    }
+    writing = 0;
+    pthread_join(checker, NULL);
+    if (!Matches(reference, min, max) || !lsm->CheckOrder()) {
+	printf("after the writers the tree differs from the reference\n");
+	++failures;
+    }
+    lsm->Flush();
+    if (!Matches(reference, min, max) || !lsm->CheckOrder()) {
+	printf("after Flush the tree differs from the reference\n");
+	++failures;
+    }
+    delete lsm;
+
+    printf("%s, %ld failures\n", failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../rtree.h"
+#include "../recorder.h"
+#include "../threadpool.h"
+#include "util.h"
+#include "histogram.h"
+#include "workload.h"
+
+// YCSB-style driver: threads pick reads (Search on a window), inserts,
+// deletes and updates (delete plus re-insert at a moved position) by the
+// given ratios until the duration is over. Prints throughput for every
+// interval while running, then latency percentiles per operation.
+// -R records every operation, preload included, for testsuit/replay.
+// -F sets the buffer flush threads of an RTREE_BUFFERED build, 0 flushes
+// on the inserting threads.
+
+enum OpType { OP_READ, OP_INSERT, OP_DELETE, OP_UPDATE, OP_NUM };
+static const char* op_names[OP_NUM] = { "read", "insert", "delete", "update" };
+
+struct MixConfig {
+    WorkloadDistribution dist;
+    int ratio[OP_NUM];       // relative weights
+    int threads;
+    double duration;         // seconds
+    double interval;         // seconds between throughput lines
+    size_t preload;
+    size_t inserts;          // fresh records each thread may insert
+    double selectivity;
+    uint32_t space;
+    uint32_t extent;
+    uint64_t seed;
+    const char* record;      // trace file, or NULL
+    int flushers;            // buffer flush threads (RTREE_BUFFERED)
+};
+
+struct MixThread {
+    int id;
+    MixConfig* config;
+    cmpt740::Rtree* rtree;
+    std::vector<WorkloadRect> live;    // records this thread owns in the tree
+    std::vector<WorkloadRect> fresh;   // records it has yet to insert
+    const std::vector<WorkloadRect>* windows;
+    LatencyHistogram latency[OP_NUM];
+    volatile uint64_t ops;
+    uint64_t delete_misses;
+};
+
+static volatile bool mix_stop = false;
+
+static void* mix_routine(void* arg)
+{
+    MixThread* t = (MixThread*)arg;
+    MixConfig* c = t->config;
+    unsigned int seed = (unsigned int)(c->seed * 7919 + t->id);
+    int total = 0;
+    for (int i = 0; i < OP_NUM; ++i)
+	total += c->ratio[i];
+
+    while (!mix_stop) {
+	int pick = rand_r(&seed) % total;
+	int op = 0;
+	while (pick >= c->ratio[op])
+	    pick -= c->ratio[op++];
+	if ((op == OP_DELETE || op == OP_UPDATE) && t->live.empty())
+	    op = OP_INSERT;
+	if (op == OP_INSERT && t->fresh.empty())
+	    op = OP_READ;
+
+	unsigned long long start = now_nsec();
+	switch (op) {
+	case OP_READ: {
+	    const WorkloadRect& w =
+		(*t->windows)[rand_r(&seed) % t->windows->size()];
+	    t->rtree->Search((uint32_t*)w.min, (uint32_t*)w.max);
+	    break;
+	}
+	case OP_INSERT: {
+	    WorkloadRect r = t->fresh.back();
+	    t->fresh.pop_back();
+	    t->rtree->Insert(r.min, r.max, NULL);
+	    t->live.push_back(r);
+	    break;
+	}
+	case OP_DELETE:
+	case OP_UPDATE: {
+	    size_t k = rand_r(&seed) % t->live.size();
+	    WorkloadRect r = t->live[k];
+	    if (!t->rtree->Delete(r.min, r.max, NULL))
+		t->delete_misses++;
+	    if (op == OP_DELETE) {
+		t->live[k] = t->live.back();
+		t->live.pop_back();
+		break;
+	    }
+	    // Move by up to one extent along every axis
+	    for (int d = 0; d < DIMENSION; ++d) {
+		uint32_t delta = rand_r(&seed) % (c->extent + 1);
+		if (r.max[d] + delta < c->space) {
+		    r.min[d] += delta;
+		    r.max[d] += delta;
+		}
+	    }
+	    t->rtree->Insert(r.min, r.max, NULL);
+	    t->live[k] = r;
+	    break;
+	}
+	}
+	t->latency[op].Record(now_nsec() - start);
+	t->ops = t->ops + 1;
+    }
+    return NULL;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-d uniform|gaussian|zipf|diagonal|aspect]"
+	    " [-m read:insert:delete:update] [-t threads] [-T seconds]"
+	    " [-i interval] [-n preload] [-s selectivity] [-e extent]"
+	    " [-x seed] [-R trace] [-F flushers]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    MixConfig c;
+    c.dist = WORKLOAD_UNIFORM;
+    c.ratio[OP_READ] = 90;
+    c.ratio[OP_INSERT] = 5;
+    c.ratio[OP_DELETE] = 0;
+    c.ratio[OP_UPDATE] = 5;
+    c.threads = 4;
+    c.duration = 10;
+    c.interval = 1;
+    c.preload = 100000;
+    c.selectivity = 0.0001;
+    c.space = 1 << 20;
+    c.extent = 256;
+    c.seed = 1;
+    c.record = NULL;
+    c.flushers = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:m:t:T:i:n:s:e:x:R:F:")) != -1) {
+	switch (opt) {
+	case 'd':
+	    if (!Workload::Parse(optarg, &c.dist))
+		usage(argv[0]);
+	    break;
+	case 'm':
+	    if (sscanf(optarg, "%d:%d:%d:%d", &c.ratio[OP_READ],
+		       &c.ratio[OP_INSERT], &c.ratio[OP_DELETE],
+		       &c.ratio[OP_UPDATE]) != OP_NUM)
+		usage(argv[0]);
+	    break;
+	case 't': c.threads = atoi(optarg); break;
+	case 'T': c.duration = atof(optarg); break;
+	case 'i': c.interval = atof(optarg); break;
+	case 'n': c.preload = strtoul(optarg, NULL, 10); break;
+	case 's': c.selectivity = atof(optarg); break;
+	case 'e': c.extent = strtoul(optarg, NULL, 10); break;
+	case 'x': c.seed = strtoull(optarg, NULL, 10); break;
+	case 'R': c.record = optarg; break;
+	case 'F': c.flushers = atoi(optarg); break;
+	default: usage(argv[0]);
+	}
+    }
+    int total = 0;
+    for (int i = 0; i < OP_NUM; ++i) {
+	if (c.ratio[i] < 0)
+	    usage(argv[0]);
+	total += c.ratio[i];
+    }
+    if (total == 0 || c.threads < 1 || c.duration <= 0 || c.interval <= 0 ||
+	c.flushers < 0)
+	usage(argv[0]);
+
+    // Enough fresh records that inserts do not run dry for a while
+    c.inserts = c.preload / c.threads + 100000;
+    Workload workload(c.space, c.seed);
+    std::vector<WorkloadRect> data, windows;
+    workload.Generate(c.dist, c.preload + c.inserts * c.threads, c.extent,
+		      data);
+    std::vector<WorkloadRect> preloaded(data.begin(),
+					data.begin() + c.preload);
+    workload.Queries(preloaded, c.selectivity, 10000, windows);
+
+    cmpt740::Rtree rtree(NULL);
+#ifdef RTREE_BUFFERED
+    cmpt740::ThreadPool* flush_pool = NULL;
+    if (c.flushers > 0) {
+	flush_pool = new cmpt740::ThreadPool(c.flushers);
+	rtree.AttachFlushPool(flush_pool);
+    }
+#endif
+    cmpt740::OpRecorder recorder;
+    if (c.record != NULL) {
+	if (!recorder.Open(c.record))
+	    return 1;
+	rtree.AttachRecorder(&recorder);
+    }
+    std::vector<MixThread*> threads(c.threads);
+    for (int i = 0; i < c.threads; ++i) {
+	MixThread* t = new MixThread;
+	t->id = i;
+	t->config = &c;
+	t->rtree = &rtree;
+	t->windows = &windows;
+	t->ops = 0;
+	t->delete_misses = 0;
+	threads[i] = t;
+    }
+    for (size_t i = 0; i < c.preload; ++i) {
+	rtree.Insert(data[i].min, data[i].max, NULL);
+	threads[i % c.threads]->live.push_back(data[i]);
+    }
+    for (size_t i = c.preload; i < data.size(); ++i)
+	threads[(i - c.preload) / c.inserts]->fresh.push_back(data[i]);
+
+    std::vector<pthread_t> tids(c.threads);
+    unsigned long long begin = now_nsec();
+    for (int i = 0; i < c.threads; ++i)
+	pthread_create(&tids[i], NULL, mix_routine, threads[i]);
+
+    printf("seconds,ops,ops_per_sec\n");
+    uint64_t last_ops = 0;
+    unsigned long long last = begin;
+    while (true) {
+	usleep((useconds_t)(c.interval * 1000000));
+	unsigned long long now = now_nsec();
+	uint64_t ops = 0;
+	for (int i = 0; i < c.threads; ++i)
+	    ops += threads[i]->ops;
+	printf("%.2f,%lu,%.0f\n", (now - begin) / 1e9,
+	       (unsigned long)(ops - last_ops),
+	       (ops - last_ops) / ((now - last) / 1e9));
+	fflush(stdout);
+	last_ops = ops;
+	last = now;
+	if (now - begin >= c.duration * 1e9)
+	    break;
+    }
+    mix_stop = true;
+    for (int i = 0; i < c.threads; ++i)
+	pthread_join(tids[i], NULL);
+    double seconds = (now_nsec() - begin) / 1e9;
+#ifdef RTREE_BUFFERED
+    rtree.AttachFlushPool(NULL); // waits for the queued flushes
+    delete flush_pool;
+#endif
+    if (c.record != NULL) {
+	rtree.AttachRecorder(NULL);
+	recorder.Close();
+    }
+
+    LatencyHistogram merged[OP_NUM];
+    uint64_t misses = 0;
+    for (int i = 0; i < c.threads; ++i) {
+	for (int op = 0; op < OP_NUM; ++op)
+	    merged[op].Merge(threads[i]->latency[op]);
+	misses += threads[i]->delete_misses;
+	delete threads[i];
+    }
+    printf("\nop,count,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    for (int op = 0; op < OP_NUM; ++op) {
+	LatencyHistogram& h = merged[op];
+	if (h.Count() == 0)
+	    continue;
+	printf("%s,%lu,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f\n", op_names[op],
+	       (unsigned long)h.Count(), h.Count() / seconds, h.Mean() / 1e3,
+	       h.Percentile(0.5) / 1e3, h.Percentile(0.99) / 1e3,
+	       h.Percentile(0.999) / 1e3, h.Max() / 1e3);
+    }
+    printf("delete_misses,%lu\n", (unsigned long)misses);
+    return 0;
+}
@@ -0,0 +1,110 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf_counters.h"
+
+static const char* perf_names[PERF_COUNTER_NUM] = {
+    "cache_misses", "llc_misses", "instructions", "context_switches"
+};
+
+#ifdef __linux__
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // This thread only, on whatever CPU it runs
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+    for (int i = 0; i < PERF_COUNTER_NUM; ++i) {
+	fds[i] = -1;
+	values[i] = 0;
+    }
+#ifdef __linux__
+    fds[PERF_CACHE_MISSES] = perf_open(PERF_TYPE_HARDWARE,
+				       PERF_COUNT_HW_CACHE_MISSES);
+    fds[PERF_LLC_MISSES] = perf_open(PERF_TYPE_HW_CACHE,
+				     PERF_COUNT_HW_CACHE_LL
+				     | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				     | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    fds[PERF_INSTRUCTIONS] = perf_open(PERF_TYPE_HARDWARE,
+				       PERF_COUNT_HW_INSTRUCTIONS);
+    fds[PERF_CONTEXT_SWITCHES] = perf_open(PERF_TYPE_SOFTWARE,
+					   PERF_COUNT_SW_CONTEXT_SWITCHES);
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int i = 0; i < PERF_COUNTER_NUM; ++i) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+    }
+}
+
+void PerfCounters::Start()
+{
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_NUM; ++i) {
+	if (fds[i] < 0)
+	    continue;
+	ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void PerfCounters::Stop()
+{
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_NUM; ++i) {
+	if (fds[i] < 0)
+	    continue;
+	ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+	    values[i] = 0;
+    }
+#endif
+}
+
+const char* PerfCounters::Name(PerfCounterType type)
+{
+    return perf_names[type];
+}
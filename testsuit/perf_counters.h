@@ -0,0 +1,55 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+enum PerfCounterType {
+    PERF_CACHE_MISSES = 0,
+    PERF_LLC_MISSES,
+    PERF_INSTRUCTIONS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTER_NUM
+};
+
+// Hardware and software counters of the calling thread, read through
+// perf_event_open(2). Counters the kernel or the machine does not offer
+// (or any, off Linux) are reported as unavailable rather than failing.
+class PerfCounters {
+public:
+    PerfCounters();  // opens the counters, disabled
+    ~PerfCounters();
+    void Start();    // reset and enable
+    void Stop();
+    bool Available(PerfCounterType type) const { return fds[type] >= 0; }
+    uint64_t Value(PerfCounterType type) const { return values[type]; }
+    static const char* Name(PerfCounterType type);
+
+private:
+    int fds[PERF_COUNTER_NUM];
+    uint64_t values[PERF_COUNTER_NUM];
+};
+
+#endif
@@ -26,6 +26,7 @@
 #include <cstdlib>
 
 #include "../rtree.h"
+#include "util.h"
 
 #define NUM_TOTAL_OPS     40000
 
@@ -82,7 +83,7 @@ void* delete_routine(void* arg)
 int main(int argc, char *argv[])
 {
     cmpt740::Rtree* rtree = new cmpt740::Rtree;
-    clock_t start, end;
+    unsigned long start, end; // wall-clock microseconds
 
     std::cout << "===============================================" << std::endl;
     std::cout << "                  Single Thread                " << std::endl;
@@ -90,7 +91,7 @@ int main(int argc, char *argv[])
 
     std::cout << "----------Insert Result----------" << std::endl;
     uint32_t min[DIMENSION], max[DIMENSION];
-    start = clock();
+    start = start_timer();
     for (int i = 0; i < NUM_TOTAL_OPS; i++) {
     	for (int j = 0; j < DIMENSION; ++j) {
 	    // max[j] = min[j] = rand() % NUM_TOTAL_OPS;
@@ -98,18 +99,18 @@ int main(int argc, char *argv[])
     	}
     	rtree->Insert(min, max, NULL);
     }
-    end = clock();
+    end = start_timer();
     std::cout << "Time elapsed: "
-    	      << ((float)(end - start))/CLOCKS_PER_SEC << "s, ";
+	      << ((float)(end - start))/1000000 << "s, ";
     std::cout << "insert count: " << NUM_TOTAL_OPS << ", ";
     std::cout << "average throughput: "
     	      << (long)((float)NUM_TOTAL_OPS /
-    			(((float)(end - start))/CLOCKS_PER_SEC))
+			(((float)(end - start))/1000000))
     	      << " ops per sec" << std::endl << std::endl;
 
 
     std::cout << "----------Search Result----------" << std::endl;
-    start = clock();
+    start = start_timer();
     for (int i = 0; i < NUM_TOTAL_OPS; i++) {
     	for (int j = 0; j < DIMENSION; ++j) {
     	    max[j] = min[j] = rand() % NUM_TOTAL_OPS;
@@ -117,17 +118,17 @@ int main(int argc, char *argv[])
     	}
     	rtree->Search(min, max);
     }
-    end = clock();
+    end = start_timer();
     std::cout << "Time elapsed: "
-    	      << ((float)(end - start))/CLOCKS_PER_SEC << "s, ";
+	      << ((float)(end - start))/1000000 << "s, ";
     std::cout << "delete count: " << NUM_TOTAL_OPS << ", ";
     std::cout << "average throughput: "
     	      << (long)((float)NUM_TOTAL_OPS /
-    			(((float)(end - start))/CLOCKS_PER_SEC))
+			(((float)(end - start))/1000000))
     	      << " ops per sec" << std::endl << std::endl;
 
     std::cout << "----------Delete Result----------" << std::endl;
-    start = clock();
+    start = start_timer();
     for (int i = 0; i < NUM_TOTAL_OPS; i++) {
     	for (int j = 0; j < DIMENSION; ++j) {
     	    max[j] = min[j] = rand() % NUM_TOTAL_OPS;
@@ -135,13 +136,13 @@ int main(int argc, char *argv[])
     	}
     	rtree->Delete(min, max, NULL);
     }
-    end = clock();
+    end = start_timer();
     std::cout << "Time elapsed: "
-    	      << ((float)(end - start))/CLOCKS_PER_SEC << "s, ";
+	      << ((float)(end - start))/1000000 << "s, ";
     std::cout << "delete count: " << NUM_TOTAL_OPS << ", ";
     std::cout << "average throughput: "
     	      << (long)((float)NUM_TOTAL_OPS /
-    			(((float)(end - start))/CLOCKS_PER_SEC))
+			(((float)(end - start))/1000000))
     	      << " ops per sec" << std::endl << std::endl;
 
     delete rtree;
@@ -160,7 +161,7 @@ int main(int argc, char *argv[])
 
     pthread_t insert_threads[NUM_THREADS];
     std::cout << "----------Insert Result----------" << std::endl;
-    start = clock();
+    start = start_timer();
     for (int i = 0; i < NUM_THREADS; ++i) {
     	//	printf("In main: creating thread %d\n", i);
     	struct rtree_args* p1 = new struct rtree_args;
@@ -177,18 +178,18 @@ int main(int argc, char *argv[])
     	pthread_join(insert_threads[i], &status);
     }
 
-    end = clock();
+    end = start_timer();
     std::cout << "Time elapsed: "
-    	      << ((float)(end - start))/CLOCKS_PER_SEC << "s, ";
+	      << ((float)(end - start))/1000000 << "s, ";
     std::cout << "insert count: " << NUM_TOTAL_OPS << ", ";
     std::cout << "average throughput: "
     	      << (long)((float)NUM_TOTAL_OPS /
-    			(((float)(end - start))/CLOCKS_PER_SEC))
+			(((float)(end - start))/1000000))
     	      << " ops per sec" << std::endl << std::endl;
 
     pthread_t search_threads[NUM_THREADS];
     std::cout << "----------Search Result----------" << std::endl;
-    start = clock();
+    start = start_timer();
     for (int i = 0; i < NUM_THREADS; ++i) {
     	//	printf("In main: creating thread %d\n", i);
     	struct rtree_args* p2 = new struct rtree_args;
@@ -205,19 +206,19 @@ int main(int argc, char *argv[])
     	pthread_join(search_threads[i], &status);
     }
 
-    end = clock();
+    end = start_timer();
 
     std::cout << "Time elapsed: "
-	<< ((float)(end - start))/CLOCKS_PER_SEC << "s, ";
+	<< ((float)(end - start))/1000000 << "s, ";
     std::cout << "search count: " << NUM_TOTAL_OPS << ", ";
     std::cout << "average throughput: "
 	<< (long)((float)NUM_TOTAL_OPS /
-			  (((float)(end - start))/CLOCKS_PER_SEC))
+			  (((float)(end - start))/1000000))
 	<< " ops per sec" << std::endl << std::endl;
 
     pthread_t delete_threads[NUM_THREADS];
     std::cout << "----------Delete Result----------" << std::endl;
-    start = clock();
+    start = start_timer();
     for (int i = 0; i < NUM_THREADS; ++i) {
     	//	printf("In main: creating thread %d\n", i);
     	struct rtree_args* p3 = new struct rtree_args;
@@ -234,13 +235,13 @@ int main(int argc, char *argv[])
 	pthread_join(delete_threads[i], &status);
     }
 
-    end = clock();
+    end = start_timer();
     std::cout << "Time elapsed: "
-	<< ((float)(end - start))/CLOCKS_PER_SEC << "s, ";
+	<< ((float)(end - start))/1000000 << "s, ";
     std::cout << "delete count: " << NUM_TOTAL_OPS << ", ";
     std::cout << "average throughput: "
 	<< (long)((float)NUM_TOTAL_OPS /
-			  (((float)(end - start))/CLOCKS_PER_SEC))
+			  (((float)(end - start))/1000000))
 	<< " ops per sec" << std::endl << std::endl;
 
     delete rtree2;
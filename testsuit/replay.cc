@@ -0,0 +1,205 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../rtree.h"
+#include "../recorder.h"
+#include "util.h"
+#include "histogram.h"
+
+// Re-executes a trace written by OpRecorder on a fresh in-memory tree.
+// By default every operation runs on one thread in start order; -c gives
+// each recorded thread its own replay thread, which runs that thread's
+// operations in order. -o keeps the recorded start times (latency is
+// then taken from the scheduled start, so falling behind shows up in it),
+// otherwise operations are issued back to back. Data pointers are passed
+// back as recorded: the tree only stores them.
+
+typedef cmpt740::OpRecorder::OpRecord OpRecord;
+static const char* op_names[] = { "insert", "delete", "search" };
+#define REPLAY_OPS 3
+
+struct ReplayThread {
+    cmpt740::Rtree* rtree;
+    std::vector<const OpRecord*> ops;
+    bool timed;
+    unsigned long long begin; // replay time of recorded start 0
+    pthread_barrier_t* barrier;
+    LatencyHistogram latency[REPLAY_OPS];
+    uint64_t mismatches; // results different from the recorded ones
+};
+
+static void* replay_routine(void* arg)
+{
+    ReplayThread* t = (ReplayThread*)arg;
+    if (t->barrier != NULL)
+	pthread_barrier_wait(t->barrier);
+    if (t->begin == 0)
+	t->begin = now_nsec();
+
+    for (size_t i = 0; i < t->ops.size(); ++i) {
+	const OpRecord* r = t->ops[i];
+	unsigned long long start;
+	if (t->timed) {
+	    start = t->begin + r->start;
+	    unsigned long long now = now_nsec();
+	    if (now < start && start - now > 100000)
+		usleep((useconds_t)((start - now - 50000) / 1000));
+	    while (now_nsec() < start)
+		sched_yield();
+	} else {
+	    start = now_nsec();
+	}
+
+	uint32_t min[DIMENSION], max[DIMENSION];
+	for (int d = 0; d < DIMENSION; ++d) {
+	    min[d] = r->min[d];
+	    max[d] = r->max[d];
+	}
+	cmpt740::data_t* data = (cmpt740::data_t*)(uintptr_t)r->data;
+	uint32_t result = 0;
+	switch (r->op) {
+	case cmpt740::OpRecorder::OP_INSERT:
+	    result = t->rtree->Insert(min, max, data);
+	    break;
+	case cmpt740::OpRecorder::OP_DELETE:
+	    result = t->rtree->Delete(min, max, data);
+	    break;
+	case cmpt740::OpRecorder::OP_SEARCH:
+	    result = t->rtree->Search(min, max).size();
+	    break;
+	default:
+	    continue;
+	}
+	t->latency[r->op].Record(now_nsec() - start);
+	if (result != r->result)
+	    t->mismatches++;
+    }
+    return NULL;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-c] [-o] trace\n"
+	    "  -c  one thread per recorded thread (default: single thread)\n"
+	    "  -o  keep the recorded timing (default: as fast as possible)\n",
+	    prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    bool concurrent = false;
+    bool timed = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "co")) != -1) {
+	switch (opt) {
+	case 'c': concurrent = true; break;
+	case 'o': timed = true; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1)
+	usage(argv[0]);
+
+    std::vector<OpRecord> records;
+    if (!cmpt740::OpRecorder::Load(argv[optind], records))
+	return 1;
+    if (records.empty()) {
+	fprintf(stderr, "%s holds no operations\n", argv[optind]);
+	return 1;
+    }
+
+    int nthreads = 1;
+    if (concurrent) {
+	for (size_t i = 0; i < records.size(); ++i) {
+	    if (records[i].thread >= nthreads)
+		nthreads = records[i].thread + 1;
+	}
+    }
+
+    cmpt740::Rtree rtree(NULL);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    std::vector<ReplayThread*> threads(nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+	ReplayThread* t = new ReplayThread;
+	t->rtree = &rtree;
+	t->timed = timed;
+	t->begin = 0;
+	t->barrier = &barrier;
+	t->mismatches = 0;
+	threads[i] = t;
+    }
+    for (size_t i = 0; i < records.size(); ++i)
+	threads[concurrent ? records[i].thread : 0]->ops.push_back(&records[i]);
+
+    std::vector<pthread_t> tids(nthreads);
+    for (int i = 0; i < nthreads; ++i)
+	pthread_create(&tids[i], NULL, replay_routine, threads[i]);
+    // Give every thread the same origin so recorded times line up
+    unsigned long long begin = now_nsec() + 1000000;
+    for (int i = 0; i < nthreads; ++i)
+	threads[i]->begin = timed ? begin : 0;
+    pthread_barrier_wait(&barrier);
+    if (!timed)
+	begin = now_nsec();
+    for (int i = 0; i < nthreads; ++i)
+	pthread_join(tids[i], NULL);
+    double seconds = (now_nsec() - begin) / 1e9;
+    pthread_barrier_destroy(&barrier);
+
+    const OpRecord& last = records.back();
+    printf("trace,%s\nops,%lu\nthreads,%d\nrecorded_seconds,%.3f\n"
+	   "replay_seconds,%.3f\nops_per_sec,%.0f\n", argv[optind],
+	   (unsigned long)records.size(), nthreads,
+	   (last.start + last.duration) / 1e9, seconds,
+	   records.size() / seconds);
+
+    LatencyHistogram merged[REPLAY_OPS];
+    uint64_t mismatches = 0;
+    for (int i = 0; i < nthreads; ++i) {
+	for (int op = 0; op < REPLAY_OPS; ++op)
+	    merged[op].Merge(threads[i]->latency[op]);
+	mismatches += threads[i]->mismatches;
+	delete threads[i];
+    }
+    printf("result_mismatches,%lu\n", (unsigned long)mismatches);
+    printf("\nop,count,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    for (int op = 0; op < REPLAY_OPS; ++op) {
+	LatencyHistogram& h = merged[op];
+	if (h.Count() == 0)
+	    continue;
+	printf("%s,%lu,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f\n", op_names[op],
+	       (unsigned long)h.Count(), h.Count() / seconds, h.Mean() / 1e3,
+	       h.Percentile(0.5) / 1e3, h.Percentile(0.99) / 1e3,
+	       h.Percentile(0.999) / 1e3, h.Max() / 1e3);
+    }
+    return 0;
+}
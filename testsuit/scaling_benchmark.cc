@@ -0,0 +1,224 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "../rtree.h"
+#include "util.h"
+#include "workload.h"
+#include "perf_counters.h"
+
+// Sweeps 1..N threads, each pinned to its own CPU (wrapping around when
+// there are fewer CPUs), over a read-only, a write-only and a mixed
+// phase. The same total number of operations is split over the threads
+// at every step, so speedup is throughput over the 1-thread run. Per-op
+// counters are summed over the threads; "-" marks one the kernel or
+// machine does not provide.
+
+enum Phase { PHASE_READ, PHASE_WRITE, PHASE_MIXED, PHASE_NUM };
+static const char* phase_names[PHASE_NUM] = { "read", "write", "mixed" };
+
+struct ScaleThread {
+    Phase phase;
+    int cpu;                // -1 to leave unpinned
+    int read_percent;       // mixed phase only
+    cmpt740::Rtree* rtree;
+    const std::vector<WorkloadRect>* windows;
+    const std::vector<WorkloadRect>* fresh;
+    size_t begin, end;      // slice of the operations
+    pthread_barrier_t* barrier;
+    uint64_t counters[PERF_COUNTER_NUM];
+    bool available[PERF_COUNTER_NUM];
+};
+
+static void* scale_routine(void* arg)
+{
+    ScaleThread* t = (ScaleThread*)arg;
+    if (t->cpu >= 0) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    PerfCounters perf;
+    unsigned int seed = (unsigned int)t->begin;
+    const std::vector<WorkloadRect>& windows = *t->windows;
+    const std::vector<WorkloadRect>& fresh = *t->fresh;
+
+    pthread_barrier_wait(t->barrier);
+    perf.Start();
+    for (size_t i = t->begin; i < t->end; ++i) {
+	bool read = (t->phase == PHASE_READ)
+	    || (t->phase == PHASE_MIXED
+		&& (int)(rand_r(&seed) % 100) < t->read_percent);
+	if (read) {
+	    const WorkloadRect& w = windows[i % windows.size()];
+	    t->rtree->Search((uint32_t*)w.min, (uint32_t*)w.max);
+	} else {
+	    const WorkloadRect& r = fresh[i % fresh.size()];
+	    t->rtree->Insert((uint32_t*)r.min, (uint32_t*)r.max, NULL);
+	}
+    }
+    perf.Stop();
+    pthread_barrier_wait(t->barrier);
+
+    for (int c = 0; c < PERF_COUNTER_NUM; ++c) {
+	t->available[c] = perf.Available((PerfCounterType)c);
+	t->counters[c] = perf.Value((PerfCounterType)c);
+    }
+    return NULL;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-t max_threads] [-o ops] [-n preload]"
+	    " [-m read_percent] [-d uniform|gaussian|zipf|diagonal|aspect]"
+	    " [-s selectivity] [-u (unpinned)] [-x seed]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = 0;
+    size_t ops = 200000;
+    size_t preload = 100000;
+    int read_percent = 90;
+    double selectivity = 0.0001;
+    bool pin = true;
+    uint64_t seed = 1;
+    WorkloadDistribution dist = WORKLOAD_UNIFORM;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:o:n:m:d:s:ux:")) != -1) {
+	switch (opt) {
+	case 't': max_threads = atoi(optarg); break;
+	case 'o': ops = strtoul(optarg, NULL, 10); break;
+	case 'n': preload = strtoul(optarg, NULL, 10); break;
+	case 'm': read_percent = atoi(optarg); break;
+	case 'd':
+	    if (!Workload::Parse(optarg, &dist))
+		usage(argv[0]);
+	    break;
+	case 's': selectivity = atof(optarg); break;
+	case 'u': pin = false; break;
+	case 'x': seed = strtoull(optarg, NULL, 10); break;
+	default: usage(argv[0]);
+	}
+    }
+
+    // CPUs this process may run on, in order
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+	for (int c = 0; c < CPU_SETSIZE; ++c) {
+	    if (CPU_ISSET(c, &allowed))
+		cpus.push_back(c);
+	}
+    }
+    if (max_threads <= 0)
+	max_threads = cpus.empty() ? 1 : (int)cpus.size();
+    if (ops == 0 || read_percent < 0 || read_percent > 100)
+	usage(argv[0]);
+
+    Workload workload(1 << 20, seed);
+    std::vector<WorkloadRect> data, fresh, windows;
+    workload.Generate(dist, preload, 256, data);
+    workload.Generate(dist, ops, 256, fresh);
+    workload.Queries(data, selectivity, 10000, windows);
+
+    printf("phase,threads,seconds,ops_per_sec,speedup");
+    for (int c = 0; c < PERF_COUNTER_NUM; ++c)
+	printf(",%s_per_op", PerfCounters::Name((PerfCounterType)c));
+    printf("\n");
+
+    std::string curves;
+    for (int p = 0; p < PHASE_NUM; ++p) {
+	double base = 0;
+	for (int n = 1; n <= max_threads; ++n) {
+	    // Every run starts from the same preloaded tree
+	    cmpt740::Rtree rtree(NULL);
+	    for (size_t i = 0; i < data.size(); ++i)
+		rtree.Insert(data[i].min, data[i].max, NULL);
+
+	    std::vector<pthread_t> tids(n);
+	    std::vector<ScaleThread> args(n);
+	    pthread_barrier_t barrier;
+	    pthread_barrier_init(&barrier, NULL, n + 1);
+	    for (int i = 0; i < n; ++i) {
+		args[i].phase = (Phase)p;
+		args[i].cpu = (pin && !cpus.empty())
+		    ? cpus[i % cpus.size()] : -1;
+		args[i].read_percent = read_percent;
+		args[i].rtree = &rtree;
+		args[i].windows = &windows;
+		args[i].fresh = &fresh;
+		args[i].begin = ops * i / n;
+		args[i].end = ops * (i + 1) / n;
+		args[i].barrier = &barrier;
+		pthread_create(&tids[i], NULL, scale_routine, &args[i]);
+	    }
+	    pthread_barrier_wait(&barrier);
+	    unsigned long long start = now_nsec();
+	    pthread_barrier_wait(&barrier);
+	    double seconds = (now_nsec() - start) / 1e9;
+	    for (int i = 0; i < n; ++i)
+		pthread_join(tids[i], NULL);
+	    pthread_barrier_destroy(&barrier);
+
+	    double rate = ops / seconds;
+	    if (n == 1)
+		base = rate;
+	    double speedup = rate / base;
+	    printf("%s,%d,%.6f,%.0f,%.2f", phase_names[p], n, seconds, rate,
+		   speedup);
+	    for (int c = 0; c < PERF_COUNTER_NUM; ++c) {
+		uint64_t sum = 0;
+		bool available = true;
+		for (int i = 0; i < n; ++i) {
+		    sum += args[i].counters[c];
+		    available = available && args[i].available[c];
+		}
+		if (available)
+		    printf(",%.3f", (double)sum / ops);
+		else
+		    printf(",-");
+	    }
+	    printf("\n");
+	    fflush(stdout);
+
+	    char line[128];
+	    snprintf(line, sizeof(line), "%-6s %3d %6.2fx ", phase_names[p],
+		     n, speedup);
+	    curves += line;
+	    curves += std::string((size_t)(speedup * 10 + 0.5), '#');
+	    curves += "\n";
+	}
+    }
+    printf("\n%s", curves.c_str());
+    return 0;
+}
@@ -0,0 +1,251 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Snapshots pinned while writers insert and delete must hold the records
+// present at the pin: every one whose insert had ended and whose delete
+// had not begun, none that was not inserted yet or deleted already. A
+// snapshot keeps returning the same records however the tree changes
+// after, whichever other snapshots are released meanwhile, and a window
+// on it returns the part of it the window overlaps. Only built with
+// RTREE_SNAPSHOT does it run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+
+#include "../rtree.h"
+
+#ifdef RTREE_SNAPSHOT
+
+#define NUM_WRITERS   3
+#define NUM_RECORDS   40000 // per writer
+#define DELETE_GAP    3     // every 3rd record is deleted again
+#define MAX_PINNED    4
+
+enum { ABSENT, INSERTING, INSERTED, DELETING, DELETED };
+
+struct TestRecord {
+    uint32_t min[DIMENSION];
+    uint32_t max[DIMENSION];
+    volatile int state;
+};
+
+struct Pinned {
+    const cmpt740::Rtree::Snapshot* snapshot;
+    std::vector<int> ids; // sorted, as first read
+};
+
+static cmpt740::Rtree* rtree;
+static TestRecord records[NUM_WRITERS * NUM_RECORDS];
+static volatile long writers_done = 0;
+static long failures = 0;
+
+static void* WriteRoutine(void* arg)
+{
+    int first = (int)(long)arg * NUM_RECORDS;
+    for (int i = 0; i < NUM_RECORDS; ++i) {
+	TestRecord* record = &records[first + i];
+	record->state = INSERTING;
+	__sync_synchronize();
+	rtree->Insert(record->min, record->max,
+		      (cmpt740::data_t*)(uintptr_t)(first + i + 1));
+	__sync_synchronize();
+	record->state = INSERTED;
+	if (i % DELETE_GAP == DELETE_GAP - 1) {
+	    TestRecord* victim = &records[first + i - 1];
+	    victim->state = DELETING;
+	    __sync_synchronize();
+	    // Delete may miss a record outside the leaf the insert path
+	    // leads to; the record is then still there
+	    bool deleted = rtree->Delete(victim->min, victim->max, NULL);
+	    __sync_synchronize();
+	    victim->state = deleted ? DELETED : INSERTED;
+	}
+    }
+    __sync_add_and_fetch(&writers_done, 1);
+    return NULL;
+}
+
+static std::vector<int> Ids(std::vector<cmpt740::Rtree::RtreeRecord>& results)
+{
+    std::vector<int> ids(results.size());
+    for (size_t i = 0; i < results.size(); ++i)
+	ids[i] = (int)(uintptr_t)results[i].data - 1;
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+static bool Overlaps(TestRecord* record, uint32_t min[DIMENSION],
+		     uint32_t max[DIMENSION])
+{
+    for (int d = 0; d < DIMENSION; ++d) {
+	if (record->min[d] > max[d] || record->max[d] < min[d])
+	    return false;
+    }
+    return true;
+}
+
+// Pin a snapshot and check it against the states before and after
+static Pinned Pin()
+{
+    int total = NUM_WRITERS * NUM_RECORDS;
+    std::vector<int> before(total), after(total);
+    for (int id = 0; id < total; ++id)
+	before[id] = records[id].state;
+    __sync_synchronize();
+    Pinned pinned;
+    pinned.snapshot = rtree->PinSnapshot();
+    __sync_synchronize();
+    for (int id = 0; id < total; ++id)
+	after[id] = records[id].state;
+
+    uint32_t min[DIMENSION], max[DIMENSION];
+    for (int d = 0; d < DIMENSION; ++d) {
+	min[d] = 0;
+	max[d] = UINT32_MAX;
+    }
+    std::vector<cmpt740::Rtree::RtreeRecord> results =
+	rtree->Search(pinned.snapshot, min, max);
+    pinned.ids = Ids(results);
+
+    std::vector<bool> in(total, false);
+    for (size_t i = 0; i < pinned.ids.size(); ++i) {
+	int id = pinned.ids[i];
+	if (id < 0 || id >= total || in[id]) {
+	    printf("snapshot holds record %d twice or unknown\n", id);
+	    ++failures;
+	    continue;
+	}
+	in[id] = true;
+	if (after[id] == ABSENT || before[id] == DELETED) {
+	    printf("snapshot holds record %d, state %d..%d\n", id,
+		   before[id], after[id]);
+	    ++failures;
+	}
+    }
+    for (int id = 0; id < total; ++id) {
+	if (before[id] == INSERTED && after[id] == INSERTED && !in[id]) {
+	    printf("snapshot misses record %d\n", id);
+	    ++failures;
+	}
+    }
+    return pinned;
+}
+
+// Whole and windowed searches must still return what the pin held
+static void Recheck(Pinned& pinned, unsigned int* seed)
+{
+    uint32_t min[DIMENSION], max[DIMENSION];
+    for (int d = 0; d < DIMENSION; ++d) {
+	min[d] = 0;
+	max[d] = UINT32_MAX;
+    }
+    std::vector<cmpt740::Rtree::RtreeRecord> results =
+	rtree->Search(pinned.snapshot, min, max);
+    if (Ids(results) != pinned.ids) {
+	printf("snapshot changed: %lu records, %lu at the pin\n",
+	       (unsigned long)results.size(),
+	       (unsigned long)pinned.ids.size());
+	++failures;
+    }
+
+    for (int d = 0; d < DIMENSION; ++d) {
+	min[d] = rand_r(seed) % 700000;
+	max[d] = min[d] + 300000;
+    }
+    results = rtree->Search(pinned.snapshot, min, max);
+    std::vector<int> expected;
+    for (size_t i = 0; i < pinned.ids.size(); ++i) {
+	if (Overlaps(&records[pinned.ids[i]], min, max))
+	    expected.push_back(pinned.ids[i]);
+    }
+    if (Ids(results) != expected) {
+	printf("window on the snapshot: %lu records, %lu expected\n",
+	       (unsigned long)results.size(), (unsigned long)expected.size());
+	++failures;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    srand(11);
+    for (int id = 0; id < NUM_WRITERS * NUM_RECORDS; ++id) {
+	TestRecord* record = &records[id];
+	// Distinct in the first dimension, so that a delete takes out
+	// its own record only
+	record->min[0] = record->max[0] = id * 8;
+	for (int d = 1; d < DIMENSION; ++d) {
+	    record->min[d] = rand() % 1000000;
+	    record->max[d] = record->min[d] + rand() % 100;
+	}
+	record->state = ABSENT;
+    }
+
+    rtree = new cmpt740::Rtree;
+    pthread_t writers[NUM_WRITERS];
+    for (long i = 0; i < NUM_WRITERS; ++i)
+	pthread_create(&writers[i], NULL, WriteRoutine, (void*)i);
+
+    // Keep a few pinned, release a random one, so that snapshots go
+    // out of order
+    unsigned int seed = 3;
+    std::vector<Pinned> pinned;
+    long pins = 0;
+    while (writers_done < NUM_WRITERS) {
+	pinned.push_back(Pin());
+	++pins;
+	for (size_t i = 0; i < pinned.size(); ++i)
+	    Recheck(pinned[i], &seed);
+	if (pinned.size() >= MAX_PINNED || rand_r(&seed) % 2 == 0) {
+	    size_t i = rand_r(&seed) % pinned.size();
+	    rtree->ReleaseSnapshot(pinned[i].snapshot);
+	    pinned.erase(pinned.begin() + i);
+	}
+    }
+    for (int i = 0; i < NUM_WRITERS; ++i)
+	pthread_join(writers[i], NULL);
+
+    // The writers are done: the survivors still see their pins, and a
+    // snapshot now holds exactly the records left
+    pinned.push_back(Pin());
+    while (!pinned.empty()) {
+	size_t i = rand_r(&seed) % pinned.size();
+	Recheck(pinned[i], &seed);
+	rtree->ReleaseSnapshot(pinned[i].snapshot);
+	pinned.erase(pinned.begin() + i);
+    }
+
+    delete rtree;
+    printf("%ld snapshots, %s, %ld failures\n", pins,
+	   failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+    printf("built without RTREE_SNAPSHOT, skipped\n");
+    return 0;
+}
+
+#endif
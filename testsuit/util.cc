@@ -21,6 +21,7 @@
  */
 
 #include <sys/time.h>
+#include <time.h>
 #include <cstdlib>
 
 #include "util.h"
@@ -38,3 +39,10 @@ void end_timer(unsigned long last)
 {
     __sync_fetch_and_add(&clock_cnt, start_timer() - last);
 }
+
+unsigned long long now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
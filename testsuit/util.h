@@ -25,5 +25,7 @@
 
 unsigned long start_timer();
 void          end_timer(unsigned long);
+// Monotonic clock in nanoseconds, for timing single operations
+unsigned long long now_nsec();
 
 #endif
@@ -0,0 +1,222 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "workload.h"
+
+#define WORKLOAD_CLUSTERS  16   // Gaussian clusters
+#define WORKLOAD_HOTSPOTS  1024 // Zipf hot spots
+#define WORKLOAD_ZIPF_S    1.0
+#define WORKLOAD_MAX_ASPECT 100
+#define WORKLOAD_SAMPLE    4096 // records used to size query windows
+
+static const char* workload_names[WORKLOAD_DISTRIBUTION_NUM] = {
+    "uniform", "gaussian", "zipf", "diagonal", "aspect"
+};
+
+Workload::Workload(uint32_t space, uint64_t seed)
+{
+    this->space = (space > 0) ? space : 1;
+    state = seed * 2685821657736338717ULL + 1;
+}
+
+const char* Workload::Name(WorkloadDistribution dist)
+{
+    return workload_names[dist];
+}
+
+bool Workload::Parse(const char* name, WorkloadDistribution* dist)
+{
+    for (int i = 0; i < WORKLOAD_DISTRIBUTION_NUM; ++i) {
+	if (strcmp(name, workload_names[i]) == 0) {
+	    *dist = (WorkloadDistribution)i;
+	    return true;
+	}
+    }
+    return false;
+}
+
+// xorshift64*
+uint64_t Workload::Next()
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+double Workload::Uniform()
+{
+    return (Next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Box-Muller
+double Workload::Gaussian()
+{
+    double u = Uniform();
+    double v = Uniform();
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+}
+
+uint32_t Workload::Clamp(double v)
+{
+    if (v < 0)
+	return 0;
+    if (v >= space)
+	return space - 1;
+    return (uint32_t)v;
+}
+
+void Workload::MakeRect(double center[DIMENSION], double side[DIMENSION],
+			WorkloadRect* rect)
+{
+    for (int d = 0; d < DIMENSION; ++d) {
+	rect->min[d] = Clamp(center[d] - side[d] / 2);
+	rect->max[d] = Clamp(center[d] + side[d] / 2);
+    }
+}
+
+void Workload::Generate(WorkloadDistribution dist, size_t n, uint32_t extent,
+			std::vector<WorkloadRect>& rects)
+{
+    double centers[WORKLOAD_CLUSTERS][DIMENSION];
+    std::vector<double> hot, cdf;
+    rects.resize(n);
+
+    if (dist == WORKLOAD_GAUSSIAN) {
+	for (int c = 0; c < WORKLOAD_CLUSTERS; ++c)
+	    for (int d = 0; d < DIMENSION; ++d)
+		centers[c][d] = Uniform() * space;
+    } else if (dist == WORKLOAD_ZIPF) {
+	double sum = 0;
+	hot.resize(WORKLOAD_HOTSPOTS * DIMENSION);
+	cdf.resize(WORKLOAD_HOTSPOTS);
+	for (int h = 0; h < WORKLOAD_HOTSPOTS; ++h) {
+	    for (int d = 0; d < DIMENSION; ++d)
+		hot[h * DIMENSION + d] = Uniform() * space;
+	    sum += 1.0 / pow(h + 1, WORKLOAD_ZIPF_S);
+	    cdf[h] = sum;
+	}
+	for (int h = 0; h < WORKLOAD_HOTSPOTS; ++h)
+	    cdf[h] /= sum;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+	double center[DIMENSION], side[DIMENSION];
+	for (int d = 0; d < DIMENSION; ++d)
+	    side[d] = Uniform() * extent;
+	switch (dist) {
+	case WORKLOAD_UNIFORM:
+	    for (int d = 0; d < DIMENSION; ++d)
+		center[d] = Uniform() * space;
+	    break;
+	case WORKLOAD_GAUSSIAN: {
+	    int c = Next() % WORKLOAD_CLUSTERS;
+	    for (int d = 0; d < DIMENSION; ++d)
+		center[d] = centers[c][d] + Gaussian() * space / 50;
+	    break;
+	}
+	case WORKLOAD_ZIPF: {
+	    int h = std::lower_bound(cdf.begin(), cdf.end(), Uniform())
+		- cdf.begin();
+	    if (h >= WORKLOAD_HOTSPOTS)
+		h = WORKLOAD_HOTSPOTS - 1;
+	    for (int d = 0; d < DIMENSION; ++d)
+		center[d] = hot[h * DIMENSION + d]
+		    + (Uniform() - 0.5) * space / 100;
+	    break;
+	}
+	case WORKLOAD_DIAGONAL: {
+	    double t = Uniform() * space;
+	    for (int d = 0; d < DIMENSION; ++d)
+		center[d] = t + Gaussian() * space / 1000;
+	    break;
+	}
+	case WORKLOAD_ASPECT: {
+	    // One long axis, the others shrunk by the same factor
+	    double aspect = 1 + Uniform() * (WORKLOAD_MAX_ASPECT - 1);
+	    int axis = Next() % DIMENSION;
+	    for (int d = 0; d < DIMENSION; ++d) {
+		center[d] = Uniform() * space;
+		side[d] = (d == axis) ? side[d] * sqrt(aspect)
+		    : side[d] / sqrt(aspect);
+	    }
+	    break;
+	}
+	default:
+	    break;
+	}
+	MakeRect(center, side, &rects[i]);
+    }
+}
+
+static bool Overlaps(const WorkloadRect& a, const WorkloadRect& b)
+{
+    for (int d = 0; d < DIMENSION; ++d) {
+	if (a.min[d] > b.max[d] || b.min[d] > a.max[d])
+	    return false;
+    }
+    return true;
+}
+
+void Workload::Queries(const std::vector<WorkloadRect>& data,
+		       double selectivity, size_t n,
+		       std::vector<WorkloadRect>& windows)
+{
+    windows.resize(n);
+    if (data.empty())
+	return;
+    std::vector<WorkloadRect> sample;
+    size_t m = std::min(data.size(), (size_t)WORKLOAD_SAMPLE);
+    for (size_t i = 0; i < m; ++i)
+	sample.push_back(data[Next() % data.size()]);
+    size_t target = (size_t)(selectivity * m + 0.5);
+
+    for (size_t q = 0; q < n; ++q) {
+	const WorkloadRect& at = data[Next() % data.size()];
+	double center[DIMENSION], side[DIMENSION];
+	for (int d = 0; d < DIMENSION; ++d)
+	    center[d] = ((double)at.min[d] + at.max[d]) / 2;
+	// Binary search on the side of the window
+	double lo = 0, hi = 2.0 * space;
+	for (int iter = 0; iter < 24; ++iter) {
+	    double mid = (lo + hi) / 2;
+	    for (int d = 0; d < DIMENSION; ++d)
+		side[d] = mid;
+	    MakeRect(center, side, &windows[q]);
+	    size_t hits = 0;
+	    for (size_t i = 0; i < m; ++i)
+		hits += Overlaps(windows[q], sample[i]);
+	    if (hits < target)
+		lo = mid;
+	    else
+		hi = mid;
+	}
+	for (int d = 0; d < DIMENSION; ++d)
+	    side[d] = hi;
+	MakeRect(center, side, &windows[q]);
+    }
+}
@@ -0,0 +1,79 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "../rtree.h"
+
+struct WorkloadRect {
+    uint32_t min[DIMENSION];
+    uint32_t max[DIMENSION];
+};
+
+enum WorkloadDistribution {
+    WORKLOAD_UNIFORM = 0,
+    WORKLOAD_GAUSSIAN,  // clustered around a few centers
+    WORKLOAD_ZIPF,      // hot spots picked with Zipf-distributed ranks
+    WORKLOAD_DIAGONAL,  // along the main diagonal of the space
+    WORKLOAD_ASPECT,    // uniform, with long thin rectangles
+    WORKLOAD_DISTRIBUTION_NUM
+};
+
+// Deterministic data and query generator: the same seed always gives
+// the same rectangles, so runs can be compared.
+class Workload {
+public:
+    // Coordinates fall in [0, space) on every axis
+    Workload(uint32_t space, uint64_t seed);
+
+    // n rectangles whose sides are at most extent long
+    void Generate(WorkloadDistribution dist, size_t n, uint32_t extent,
+		  std::vector<WorkloadRect>& rects);
+    // n square windows centered on records of data, each sized so that
+    // it overlaps about selectivity * data.size() records (calibrated on
+    // a sample of data).
+    void Queries(const std::vector<WorkloadRect>& data, double selectivity,
+		 size_t n, std::vector<WorkloadRect>& windows);
+
+    static const char* Name(WorkloadDistribution dist);
+    // False if name is not one of the names returned by Name()
+    static bool Parse(const char* name, WorkloadDistribution* dist);
+
+protected:
+    uint64_t Next();
+    double Uniform(); // [0, 1)
+    double Gaussian();
+    uint32_t Clamp(double v);
+    void MakeRect(double center[DIMENSION], double side[DIMENSION],
+		  WorkloadRect* rect);
+
+private:
+    uint32_t space;
+    uint64_t state;
+};
+
+#endif
@@ -0,0 +1,236 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#include "threadpool.h"
+#include "log.h"
+
+namespace cmpt740 {
+
+    // Worker the current thread runs as, if any
+    static __thread void* current_worker = NULL;
+
+    ThreadPool::ThreadPool(int nthreads)
+    {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+	queued = 0;
+	sleepers = 0;
+	waiters = 0;
+	shutdown = false;
+	for (int i = 0; i < nthreads; ++i) {
+	    Worker* worker = new Worker;
+	    worker->pool = this;
+	    worker->id = i;
+	    pthread_mutex_init(&worker->lock, NULL);
+	    workers.push_back(worker);
+	}
+	for (int i = 0; i < nthreads; ++i) {
+	    int rc = pthread_create(&workers[i]->tid, NULL, WorkerRoutine,
+				    (void*)workers[i]);
+	    if (rc) {
+		Err("pthread_create() returned %d\n", rc);
+		for (int j = i; j < nthreads; ++j) {
+		    pthread_mutex_destroy(&workers[j]->lock);
+		    delete workers[j];
+		}
+		workers.resize(i);
+		break;
+	    }
+	}
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+	pthread_mutex_lock(&mutex);
+	shutdown = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&mutex);
+	for (size_t i = 0; i < workers.size(); ++i) {
+	    pthread_join(workers[i]->tid, NULL);
+	    pthread_mutex_destroy(&workers[i]->lock);
+	    delete workers[i];
+	}
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&mutex);
+    }
+
+    int ThreadPool::CurrentWorker()
+    {
+	Worker* worker = (Worker*)current_worker;
+	if (worker != NULL && worker->pool == this)
+	    return worker->id;
+	return -1;
+    }
+
+    void* ThreadPool::WorkerRoutine(void* arg)
+    {
+	Worker* worker = (Worker*)arg;
+	ThreadPool* pool = worker->pool;
+	Task task;
+
+	current_worker = worker;
+	while (true) {
+	    if (pool->PopTask(&task)) {
+		pool->RunTask(&task);
+		continue;
+	    }
+	    pthread_mutex_lock(&pool->mutex);
+	    // Announce before checking, so Submit either sees a sleeper
+	    // or we see its task
+	    __sync_add_and_fetch(&pool->sleepers, 1);
+	    while (!pool->shutdown && pool->queued == 0) {
+		pthread_cond_wait(&pool->work_cond, &pool->mutex);
+	    }
+	    __sync_sub_and_fetch(&pool->sleepers, 1);
+	    bool done = pool->shutdown && pool->queued == 0;
+	    pthread_mutex_unlock(&pool->mutex);
+	    if (done)
+		break;
+	}
+	current_worker = NULL;
+	return NULL;
+    }
+
+    // Queue a task. Without worker threads the task runs inline.
+    void ThreadPool::Submit(task_fn fn, void* arg, TaskGroup* group)
+    {
+	Task task;
+	task.fn = fn;
+	task.arg = arg;
+	task.group = group;
+	if (group != NULL)
+	    __sync_add_and_fetch(&group->pending, 1);
+	if (workers.empty()) {
+	    RunTask(&task);
+	    return;
+	}
+
+	int id = CurrentWorker();
+	if (id >= 0) {
+	    Worker* worker = workers[id];
+	    pthread_mutex_lock(&worker->lock);
+	    worker->tasks.push_back(task);
+	    pthread_mutex_unlock(&worker->lock);
+	} else {
+	    pthread_mutex_lock(&mutex);
+	    tasks.push_back(task);
+	    pthread_mutex_unlock(&mutex);
+	}
+	__sync_add_and_fetch(&queued, 1);
+
+	if (sleepers > 0 || waiters > 0) {
+	    pthread_mutex_lock(&mutex);
+	    pthread_cond_signal(&work_cond);
+	    if (waiters > 0) // let waiting threads help
+		pthread_cond_broadcast(&done_cond);
+	    pthread_mutex_unlock(&mutex);
+	}
+    }
+
+    // Block until every task of the group has run, running queued tasks
+    // (of any group) in the meantime.
+    void ThreadPool::Wait(TaskGroup* group)
+    {
+	Task task;
+	while (group->pending > 0) {
+	    if (PopTask(&task)) {
+		RunTask(&task);
+		continue;
+	    }
+	    pthread_mutex_lock(&mutex);
+	    __sync_add_and_fetch(&waiters, 1);
+	    while (group->pending > 0 && queued == 0) {
+		pthread_cond_wait(&done_cond, &mutex);
+	    }
+	    __sync_sub_and_fetch(&waiters, 1);
+	    pthread_mutex_unlock(&mutex);
+	}
+    }
+
+    // Own deque first (newest task, still warm in cache), then the shared
+    // queue, then steal the oldest task of another worker.
+    bool ThreadPool::PopTask(Task* task)
+    {
+	if (queued == 0)
+	    return false;
+
+	int id = CurrentWorker();
+	Worker* self = (id >= 0) ? workers[id] : NULL;
+	if (self != NULL) {
+	    pthread_mutex_lock(&self->lock);
+	    if (!self->tasks.empty()) {
+		*task = self->tasks.back();
+		self->tasks.pop_back();
+		pthread_mutex_unlock(&self->lock);
+		__sync_sub_and_fetch(&queued, 1);
+		return true;
+	    }
+	    pthread_mutex_unlock(&self->lock);
+	}
+
+	pthread_mutex_lock(&mutex);
+	if (!tasks.empty()) {
+	    *task = tasks.front();
+	    tasks.pop_front();
+	    pthread_mutex_unlock(&mutex);
+	    __sync_sub_and_fetch(&queued, 1);
+	    return true;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return StealTask(self, task);
+    }
+
+    bool ThreadPool::StealTask(Worker* thief, Task* task)
+    {
+	int n = (int)workers.size();
+	int start = (thief != NULL) ? thief->id + 1 : 0;
+	for (int i = 0; i < n; ++i) {
+	    Worker* victim = workers[(start + i) % n];
+	    if (victim == thief)
+		continue;
+	    pthread_mutex_lock(&victim->lock);
+	    if (!victim->tasks.empty()) {
+		*task = victim->tasks.front();
+		victim->tasks.pop_front();
+		pthread_mutex_unlock(&victim->lock);
+		__sync_sub_and_fetch(&queued, 1);
+		return true;
+	    }
+	    pthread_mutex_unlock(&victim->lock);
+	}
+	return false;
+    }
+
+    void ThreadPool::RunTask(Task* task)
+    {
+	task->fn(task->arg);
+	if (task->group != NULL &&
+	    __sync_sub_and_fetch(&task->group->pending, 1) == 0) {
+	    pthread_mutex_lock(&mutex);
+	    pthread_cond_broadcast(&done_cond);
+	    pthread_mutex_unlock(&mutex);
+	}
+    }
+}
@@ -0,0 +1,89 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+namespace cmpt740 {
+
+    // Tasks submitted together, so that a caller can wait for all of them.
+    struct TaskGroup {
+	volatile long pending;
+	TaskGroup() { pending = 0; }
+    };
+
+    // Fixed-size pool of worker threads running C-style tasks.
+    // Every worker owns a deque: tasks submitted by a worker go to its own
+    // deque and are run LIFO by the owner, idle workers steal FIFO from
+    // the others. Tasks from other threads go to a shared queue.
+    // A thread waiting on a TaskGroup helps run queued tasks, so tasks may
+    // submit and wait for subtasks without starving the pool.
+    class ThreadPool {
+    public:
+	typedef void (*task_fn)(void* arg);
+
+	ThreadPool(int nthreads);
+	virtual ~ThreadPool();
+	void Submit(task_fn fn, void* arg, TaskGroup* group);
+	void Wait(TaskGroup* group);
+	int Size() { return (int)workers.size(); }
+	// Index of the calling worker thread, or -1 for other threads
+	int CurrentWorker();
+
+    protected:
+	struct Task {
+	    task_fn fn;
+	    void* arg;
+	    TaskGroup* group;
+	};
+
+	struct Worker {
+	    ThreadPool* pool;
+	    int id;
+	    pthread_t tid;
+	    pthread_mutex_t lock;
+	    std::deque<Task> tasks;
+	};
+
+	static void* WorkerRoutine(void* arg);
+	bool PopTask(Task* task);
+	bool StealTask(Worker* thief, Task* task);
+	void RunTask(Task* task);
+
+    private:
+	std::vector<Worker*> workers;
+	std::deque<Task> tasks;    // tasks from non-worker threads
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;  // signalled when a task is queued
+	pthread_cond_t done_cond;  // signalled when a group drains
+	volatile long queued;      // tasks sitting in any queue
+	volatile int sleepers;
+	volatile int waiters;
+	bool shutdown;
+    };
+}
+
+#endif
@@ -0,0 +1,188 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#include <time.h>
+#include <vector>
+
+#include "trace.h"
+
+namespace cmpt740 {
+
+    static const char* trace_names[TRACE_EVENT_NUM] = {
+	"Insert", "Delete", "Search", "ParallelSearch", "SplitNode",
+	"RootGrowth", "SiblingChase", "ReadLockWait", "WriteLockWait",
+	"MempoolRead", "MempoolWrite"
+    };
+
+    volatile uint32_t Tracer::sample_every = 0;
+    Tracer::TraceRing* volatile Tracer::rings = NULL;
+    volatile int Tracer::next_tid = 0;
+    __thread Tracer::TraceRing* Tracer::thread_ring = NULL;
+
+    void Tracer::Enable(uint32_t every)
+    {
+	sample_every = (every > 0) ? every : 1;
+    }
+
+    void Tracer::Disable()
+    {
+	sample_every = 0;
+    }
+
+    uint64_t Tracer::Now()
+    {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // A thread's ring is created on its first recorded event and pushed
+    // on a lock-free list. Rings outlive their threads so that Export
+    // still sees what they recorded.
+    Tracer::TraceRing* Tracer::Ring()
+    {
+	if (thread_ring == NULL) {
+	    TraceRing* ring = new TraceRing;
+	    ring->head = 0;
+	    ring->tid = __sync_add_and_fetch(&next_tid, 1);
+	    ring->depth = 0;
+	    ring->sampled = false;
+	    ring->seed = 2463534242U + ring->tid;
+	    do {
+		ring->next = rings;
+	    } while (!__sync_bool_compare_and_swap(&rings, ring->next,
+						   ring));
+	    thread_ring = ring;
+	}
+	return thread_ring;
+    }
+
+    // Events outside any operation are sampled on their own. Sampling is
+    // random so that it does not lock onto a repeating pattern of
+    // operations.
+    bool Tracer::Sampled(TraceRing* ring)
+    {
+	if (ring->depth > 0)
+	    return ring->sampled;
+	if (sample_every == 1)
+	    return true;
+	ring->seed ^= ring->seed << 13;
+	ring->seed ^= ring->seed >> 17;
+	ring->seed ^= ring->seed << 5;
+	return ring->seed % sample_every == 0;
+    }
+
+    void Tracer::Record(TraceRing* ring, TraceEvent event, char phase,
+			uint64_t ts, uint64_t dur, uint64_t arg)
+    {
+	TraceRecord* record = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+	record->ts = ts;
+	record->dur = dur;
+	record->arg = arg;
+	record->event = event;
+	record->phase = phase;
+	// A release store keeps the record before the head, see Export,
+	// and costs no fence
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+
+    void Tracer::Begin(TraceEvent event, uint64_t arg)
+    {
+	if (sample_every == 0)
+	    return;
+	TraceRing* ring = Ring();
+	bool sampled = Sampled(ring);
+	if (ring->depth++ == 0)
+	    ring->sampled = sampled;
+	if (sampled)
+	    Record(ring, event, 'B', Now(), 0, arg);
+    }
+
+    // Balanced with Begin even when tracing was switched meanwhile
+    void Tracer::End(TraceEvent event)
+    {
+	TraceRing* ring = thread_ring;
+	if (ring == NULL || ring->depth == 0)
+	    return;
+	ring->depth--;
+	if (ring->sampled)
+	    Record(ring, event, 'E', Now(), 0, 0);
+	if (ring->depth == 0)
+	    ring->sampled = false;
+    }
+
+    void Tracer::Instant(TraceEvent event, uint64_t arg)
+    {
+	if (sample_every == 0)
+	    return;
+	TraceRing* ring = Ring();
+	if (Sampled(ring))
+	    Record(ring, event, 'i', Now(), 0, arg);
+    }
+
+    void Tracer::Complete(TraceEvent event, uint64_t start, uint64_t end,
+			  uint64_t arg)
+    {
+	if (sample_every == 0)
+	    return;
+	TraceRing* ring = Ring();
+	if (Sampled(ring))
+	    Record(ring, event, 'X', start, end - start, arg);
+    }
+
+    // Copy a ring, then drop the copies of slots the owner may have been
+    // rewriting meanwhile: up to and including the slot of the head seen
+    // after the copy.
+    void Tracer::Export(std::ostream& out)
+    {
+	bool first = true;
+	out << "{\"traceEvents\": [";
+	for (TraceRing* ring = rings; ring != NULL; ring = ring->next) {
+	    uint64_t head = ring->head;
+	    __sync_synchronize();
+	    uint64_t from = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+	    std::vector<TraceRecord> copy(ring->records + 0,
+					  ring->records + TRACE_RING_SIZE);
+	    __sync_synchronize();
+	    uint64_t after = ring->head;
+	    if (after + 1 > TRACE_RING_SIZE && after + 1 - TRACE_RING_SIZE > from)
+		from = after + 1 - TRACE_RING_SIZE;
+	    for (uint64_t i = from; i < head; ++i) {
+		TraceRecord* record = &copy[i & (TRACE_RING_SIZE - 1)];
+		if (record->event >= TRACE_EVENT_NUM)
+		    continue;
+		out << (first ? "" : ",") << "\n{\"name\": \""
+		    << trace_names[record->event] << "\", \"ph\": \""
+		    << record->phase << "\", \"pid\": 1, \"tid\": " << ring->tid
+		    << ", \"ts\": " << record->ts / 1000.0;
+		if (record->phase == 'X')
+		    out << ", \"dur\": " << record->dur / 1000.0;
+		if (record->phase == 'i')
+		    out << ", \"s\": \"t\"";
+		out << ", \"args\": {\"arg\": " << record->arg << "}}";
+		first = false;
+	    }
+	}
+	out << "\n]}" << std::endl;
+    }
+}
@@ -0,0 +1,116 @@
+/***
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author:
+ *     2012 Bai Yu - zjuyubai@gmail.com
+ */
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <ostream>
+
+namespace cmpt740 {
+
+    // Events per thread kept by the trace ring, must be a power of two
+    #define TRACE_RING_SIZE (1 << 14)
+
+    enum TraceEvent {
+	TRACE_INSERT = 0,
+	TRACE_DELETE,
+	TRACE_SEARCH,
+	TRACE_PARALLEL_SEARCH,
+	TRACE_SPLIT,
+	TRACE_ROOT_GROWTH,
+	TRACE_SIBLING_CHASE,
+	TRACE_READ_LOCK_WAIT,
+	TRACE_WRITE_LOCK_WAIT,
+	TRACE_MEMPOOL_READ,
+	TRACE_MEMPOOL_WRITE,
+	TRACE_EVENT_NUM
+    };
+
+    // Timestamped events kept in a ring per thread; old events are
+    // overwritten. Only the owning thread writes a ring, so recording
+    // takes no lock, no atomic read-modify-write and no fence: the head
+    // is published with a release store. Sampling is per outermost
+    // operation: with Enable(n) each operation is recorded, together with
+    // everything that happens inside it, with probability 1/n.
+    class Tracer {
+    public:
+	static void Enable(uint32_t sample_every = 1);
+	static void Disable();
+	static void Begin(TraceEvent event, uint64_t arg = 0);
+	static void End(TraceEvent event);
+	static void Instant(TraceEvent event, uint64_t arg = 0);
+	// An event that ran from start to end, times from Now()
+	static void Complete(TraceEvent event, uint64_t start, uint64_t end,
+			     uint64_t arg = 0);
+	static uint64_t Now(); // monotonic, in ns
+	// Write every ring as Chrome trace JSON (chrome://tracing). Safe
+	// while threads keep recording; events overwritten during the
+	// export are left out.
+	static void Export(std::ostream& out);
+
+    protected:
+	struct TraceRecord {
+	    uint64_t ts;    // ns
+	    uint64_t dur;   // ns, complete events only
+	    uint64_t arg;
+	    uint16_t event;
+	    char phase;     // Chrome phase: B, E, i or X
+	};
+	struct TraceRing {
+	    TraceRecord records[TRACE_RING_SIZE];
+	    volatile uint64_t head; // records ever written
+	    int tid;
+	    uint32_t depth;         // nesting of Begin/End
+	    bool sampled;           // current outermost operation recorded
+	    uint32_t seed;          // xorshift state for sampling
+	    TraceRing* next;
+	};
+
+	static TraceRing* Ring();
+	static bool Sampled(TraceRing* ring);
+	static void Record(TraceRing* ring, TraceEvent event, char phase,
+			   uint64_t ts, uint64_t dur, uint64_t arg);
+
+    private:
+	static volatile uint32_t sample_every; // 0 = disabled
+	static TraceRing* volatile rings;
+	static volatile int next_tid;
+	static __thread TraceRing* thread_ring;
+    };
+}
+
+#ifdef RTREE_TRACE
+#define TRACE_BEGIN(event, arg) Tracer::Begin(event, arg)
+#define TRACE_END(event) Tracer::End(event)
+#define TRACE_INSTANT(event, arg) Tracer::Instant(event, arg)
+#define TRACE_COMPLETE(event, start, end, arg)		\
+    Tracer::Complete(event, start, end, arg)
+#else
+#define TRACE_BEGIN(event, arg)
+#define TRACE_END(event)
+#define TRACE_INSTANT(event, arg)
+#define TRACE_COMPLETE(event, start, end, arg)
+#endif
+
+#endif